@@ -0,0 +1,116 @@
+#pragma once
+#include <stdio.h>
+#include <stddef.h>
+#include <atomic>
+#include <new>
+#include <memory_resource>
+#include "slab.h"
+
+namespace kmem {
+
+/* ---------------------------------------------------------- */
+/* --------------------- MEMORY RESOURCE -------------------- */
+/* ---------------------------------------------------------- */
+
+/* std::pmr resource on kmalloc, deallocation is sized (kfree_sized). buffers are */
+/* aligned to KMEM_MIN_ALIGN, bigger alignment takes bytes + alignment and keeps  */
+/* offset to the start of buffer in the word before the aligned pointer          */
+class MemoryResource : public std::pmr::memory_resource {
+protected:
+	void* do_allocate(size_t bytes, size_t alignment) override {
+		if (bytes == 0) bytes = 1;
+
+		if (alignment <= KMEM_MIN_ALIGN) {
+			void* objp = kmalloc(bytes);
+			if (objp == nullptr) throw std::bad_alloc();
+			return objp;
+		}
+
+		void* objp = kmalloc(bytes + alignment);
+		if (objp == nullptr) throw std::bad_alloc();
+
+		uintptr_t aligned = KMEM_ALIGN_UP((uintptr_t)objp + sizeof(size_t), alignment);
+		((size_t*)aligned)[-1] = aligned - (uintptr_t)objp;
+		return (void*)aligned;
+	}
+
+	void do_deallocate(void* p, size_t bytes, size_t alignment) override {
+		if (bytes == 0) bytes = 1;
+
+		if (alignment <= KMEM_MIN_ALIGN) kfree_sized(p, bytes);
+		else kfree_sized((char*)p - ((size_t*)p)[-1], bytes + alignment);
+	}
+
+	bool do_is_equal(const std::pmr::memory_resource& other) const noexcept override {
+		return this == &other;
+	}
+};
+
+/* Returns resource shared by all users, kmem_init must be called before it's used */
+inline MemoryResource* memory_resource() {
+	static MemoryResource resource;
+	return &resource;
+}
+
+/* ---------------------------------------------------------- */
+/* --------------------- NODE ALLOCATOR --------------------- */
+/* ---------------------------------------------------------- */
+
+/* number of node caches made so far, shared by all node types so that */
+/* types of the same size get different cache names                   */
+inline std::atomic<unsigned int> node_caches_num;
+
+/* Allocator for node based containers (std::map, std::list, unordered_map nodes): */
+/* single objects come from a cache made for T on first use, arrays (e.g. hash    */
+/* buckets) come from kmalloc. caches are kept until exit, so kmem_init must not  */
+/* be called again once containers used them                                     */
+template <typename T>
+class NodeAllocator {
+public:
+	typedef T value_type;
+	typedef std::true_type is_always_equal;
+
+	static_assert(alignof(T) <= KMEM_MIN_ALIGN, "objects of kmem caches are aligned to KMEM_MIN_ALIGN at most");
+
+	NodeAllocator() noexcept {}
+	template <typename U> NodeAllocator(const NodeAllocator<U>&) noexcept {}
+
+	/* throws bad_alloc if there is no memory or cache of T could not be made */
+	T* allocate(size_t n) {
+		void* objp = (n == 1) ? kmem_cache_alloc(cache()) : kmalloc(n * sizeof(T));
+		if (objp == nullptr) throw std::bad_alloc();
+		return (T*)objp;
+	}
+
+	void deallocate(T* objp, size_t n) noexcept {
+		if (n == 1) kmem_cache_free(cache(), objp);
+		else kfree_sized(objp, n * sizeof(T));
+	}
+
+	/* cache of T, its name is "node-<size>-<number>" since names must be unique, */
+	/* nullptr if it could not be made                                          */
+	static kmem_cache_t* cache() {
+		static kmem_cache_t* cachep = create_cache();
+		return cachep;
+	}
+
+private:
+	static kmem_cache_t* create_cache() {
+		char name[CACHE_NAME_LEN];
+
+		/* name can still be taken by cache user made, next number is tried then */
+		do {
+			snprintf(name, CACHE_NAME_LEN, "node-%zu-%u", sizeof(T), node_caches_num.fetch_add(1));
+		} while (kmem_cache_find(name) != nullptr);
+
+		return kmem_cache_create(name, sizeof(T), nullptr, nullptr);
+	}
+};
+
+template <typename T, typename U>
+bool operator==(const NodeAllocator<T>&, const NodeAllocator<U>&) noexcept { return true; }
+
+template <typename T, typename U>
+bool operator!=(const NodeAllocator<T>&, const NodeAllocator<U>&) noexcept { return false; }
+
+}
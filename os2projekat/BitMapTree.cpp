@@ -2,132 +2,113 @@
 #include <stdlib.h>
 #include <assert.h>
 #include "slab.h"
+#include <new>
 
-static unsigned buddy_N;
+void* bitmapTree_init(bitmap_tree_t* tree, void* space, unsigned buddy_pow) {
 
-static char* bitmapTree;
-static int bitmapTree_words_count;
-static int bitmapTree_node_count;
+	tree->buddy_N = buddy_pow;
+	/* align with word size */
+	tree->words = (std::atomic<uint64_t>*)(((uintptr_t)space + sizeof(uint64_t) - 1) & ~(sizeof(uint64_t) - 1));
 
-void* bitmapTree_init(void* space, unsigned buddy_pow) {
+	tree->words_count = (((size_t)1 << (tree->buddy_N + 1)) * NODE_BITS + WORD_BITS - 1) / WORD_BITS;
+	tree->node_count = (((size_t)1 << (tree->buddy_N + 1)) - 1);
 
-	buddy_N = buddy_pow;
-	bitmapTree = (char*)space;
-
-	bitmapTree_words_count = ((1 << buddy_N + 1) * NODE_BITS) / WORD_BITS;
-	bitmapTree_node_count = ((1 << buddy_N + 1) - 1);
-
-	for (int i = 0; i < bitmapTree_words_count; i++) {
-		bitmapTree[i] = 0;
+	for (size_t i = 0; i < tree->words_count; i++) {
+		new (&tree->words[i]) std::atomic<uint64_t>(0);
 	}
 
-	return (void*)(bitmapTree + bitmapTree_words_count);
+	return (void*)(tree->words + tree->words_count);
 }
 
-short bitmapTree_get_node(unsigned index) {
+short bitmapTree_get_node(bitmap_tree_t* tree, size_t index) {
 	/* O(1) */
 
-	assert(index < bitmapTree_node_count);
+	assert(index < tree->node_count);
 
-	int word = index*NODE_BITS / WORD_BITS;
-	int node = (index*NODE_BITS) % WORD_BITS;
-	return (bitmapTree[word] >> (WORD_BITS - NODE_BITS - node)) & ((1<<NODE_BITS)-1);
+	size_t word = index / NODES_PER_WORD;
+	unsigned shift = (index % NODES_PER_WORD)*NODE_BITS;
+	return (short)((tree->words[word].load() >> shift) & ((1 << NODE_BITS) - 1));
 }
 
-void bitmapTree_set_node(unsigned index, short value) {
+void bitmapTree_set_node(bitmap_tree_t* tree, size_t index, short value) {
 	/* O(1) */
 
-	assert(index < bitmapTree_node_count);
+	assert(index < tree->node_count);
 	assert(value >=0 && value < (1<<NODE_BITS));
 
-	int word = index*NODE_BITS / WORD_BITS;
-	int node = (index*NODE_BITS) % WORD_BITS;
+	size_t word = index / NODES_PER_WORD;
+	unsigned shift = (index % NODES_PER_WORD)*NODE_BITS;
 
-	char clear_value = ~((0 | ((1 << NODE_BITS) - 1)) << (WORD_BITS - NODE_BITS - node));
-	char set_value = ((0 | value) << (WORD_BITS - NODE_BITS - node));
+	uint64_t clear_value = ~((uint64_t)((1 << NODE_BITS) - 1) << shift);
+	uint64_t set_value = ((uint64_t)value << shift);
 
-	bitmapTree[word] &= clear_value;
-	bitmapTree[word] |= set_value;
+	/* word can be changed by other thread (other node) */
+	uint64_t old_word = tree->words[word].load();
+	while (!tree->words[word].compare_exchange_weak(old_word, (old_word & clear_value) | set_value));
 }
 
-int bitmapTree_get_block_size(unsigned index) {
-	/* O( log(number of blocks) ) */
+int bitmapTree_get_block_size(bitmap_tree_t* tree, size_t index) {
+	/* O(1) */
 
-	assert(index < bitmapTree_node_count);
-	int i = 1;
-	while (index >((1 << i) - 2)) i++;
-	return buddy_N - i + 1;
+	assert(index < tree->node_count);
+	return tree->buddy_N - LEVEL(index);
 }
 
-int bitmapTree_dealloc(unsigned blockn) {
+size_t bitmapTree_get_taken(bitmap_tree_t* tree, size_t blockn) {
 	/* O( log(number of blocks) ) */
 
-	assert(blockn < (1 << buddy_N));
+	/* nodes below TAKEN node belong to its owner, so they can be read without lock */
 
-	int leaf = blockn + (1 << buddy_N) - 1;
-	while (bitmapTree_get_node(leaf) != TAKEN) {
-		assert(bitmapTree_get_node(leaf) == FREE);
+	assert(blockn < ((size_t)1 << tree->buddy_N));
+
+	size_t leaf = blockn + ((size_t)1 << tree->buddy_N) - 1;
+	while (bitmapTree_get_node(tree, leaf) != TAKEN) {
+		assert(bitmapTree_get_node(tree, leaf) == FREE);
 		leaf = PARENT(leaf);
 	}
-	bitmapTree_set_node(leaf, FREE);
 	return leaf;
 }
 
-void bitmapTree_alloc(unsigned blockn, int pow) {
-	/* O( log(number of blocks) ) */
+size_t bitmapTree_get_index(bitmap_tree_t* tree, size_t blockn, int pow) {
+	/* O(1) */
 
-	assert(blockn < (1 << buddy_N));
-	assert(pow >= 0 && pow <= buddy_N);
+	assert(blockn < ((size_t)1 << tree->buddy_N));
+	assert(pow >= 0 && pow <= (int)tree->buddy_N);
 
-	int leaf = blockn + (1 << buddy_N) - 1;
-	int hop;
-	for (hop = 0; hop < pow; hop++) {
-		assert(bitmapTree_get_node(leaf) == FREE);
-		leaf = PARENT(leaf);
-	}
-	bitmapTree_set_node(leaf, TAKEN);
-
-	while (leaf > 0) {
-		assert(bitmapTree_get_node(PARENT(leaf)) != TAKEN);
-		if (bitmapTree_get_node(PARENT(leaf)) == PARTLY_FREE) break;
-		bitmapTree_set_node(PARENT(leaf), PARTLY_FREE);
-		leaf = PARENT(leaf);
-	}
+	return ((blockn + ((size_t)1 << tree->buddy_N)) >> pow) - 1;
 }
 
-int bitmapTree_get_buddy(unsigned index) {
+size_t bitmapTree_get_buddy(size_t index) {
 	/* O(1) */
 
 	if ((index & 1) == 0) return index - 1;
 	else return index + 1;
 }
 
-int bitmapTree_is_buddy_free(unsigned index) {
+int bitmapTree_is_buddy_free(bitmap_tree_t* tree, size_t index) {
 	/* O(1) */
 
-	return bitmapTree_get_node(bitmapTree_get_buddy(index)) == FREE;
+	return bitmapTree_get_node(tree, bitmapTree_get_buddy(index)) == FREE;
 }
 
-int bitmapTree_get_block(unsigned index) {
-	/* O( log(number of blocks) ) */
+size_t bitmapTree_get_block(bitmap_tree_t* tree, size_t index) {
+	/* O(1) */
 
-	int i = index;
-	while (LEFT(i) < bitmapTree_node_count) {
-		i = LEFT(i);
-	}
-	return i - (1 << buddy_N) + 1;
+	/* leftmost leaf of index is (index+1)*2^(block size) - 1 */
+	assert(index < tree->node_count);
+	return ((index + 1) << (tree->buddy_N - LEVEL(index))) - ((size_t)1 << tree->buddy_N);
 }
 
-void bitmapTree_print() {
+void bitmapTree_print(bitmap_tree_t* tree) {
 	/* O(number of blocks) */
 
 	int exp = 0;
-	for (int i = 0; i < bitmapTree_node_count; i++) {
-		if (i == ((1 << exp) - 1)) {
+	for (size_t i = 0; i < tree->node_count; i++) {
+		if (i == (((size_t)1 << exp) - 1)) {
 			exp++;
 			printf("| ");
 		}
-		printf("%d ", bitmapTree_get_node(i));
+		printf("%d ", bitmapTree_get_node(tree, i));
 	}
 	printf("|\n");
 }
@@ -1,45 +1,97 @@
 #pragma once
 #include <stdio.h>
+#include <atomic>
+#include <stdint.h>
 #include "Buddy.h"
 
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+
 #define FREE (0)
 #define TAKEN (3)
 #define PARTLY_FREE (1)
 
 #define NODE_BITS (2)
-#define WORD_BITS (sizeof(char)*8)
+#define WORD_BITS (sizeof(uint64_t)*8)
+#define NODES_PER_WORD (WORD_BITS/NODE_BITS)
 
 #define PARENT(node) ((node-1)>>1)
 #define LEFT(node) ((node<<1)+1)
 #define RIGHT(node) ((node<<1)+2)
 
+/* returns index of lowest set bit, x must not be 0 */
+inline int bit_scan_forward(uint64_t x) {
+#if defined(_MSC_VER) && (defined(_M_X64) || defined(_M_ARM64))
+	unsigned long i;
+	_BitScanForward64(&i, x);
+	return (int)i;
+#elif defined(_MSC_VER)
+	/* 32-bit target has no 64-bit intrinsic, halves are scanned */
+	unsigned long i;
+	if (_BitScanForward(&i, (unsigned long)x)) return (int)i;
+	_BitScanForward(&i, (unsigned long)(x >> 32));
+	return (int)i + 32;
+#else
+	return __builtin_ctzll(x);
+#endif
+}
+
+/* returns index of highest set bit, x must not be 0 */
+inline int bit_scan_reverse(uint64_t x) {
+#if defined(_MSC_VER) && (defined(_M_X64) || defined(_M_ARM64))
+	unsigned long i;
+	_BitScanReverse64(&i, x);
+	return (int)i;
+#elif defined(_MSC_VER)
+	unsigned long i;
+	if (_BitScanReverse(&i, (unsigned long)(x >> 32))) return (int)i + 32;
+	_BitScanReverse(&i, (unsigned long)x);
+	return (int)i;
+#else
+	return 63 - __builtin_clzll(x);
+#endif
+}
+
+/* level of node in bitmapTree, root is on level 0 */
+#define LEVEL(node) (bit_scan_reverse((uint64_t)(node)+1))
+
+typedef struct bitmap_tree_s {
+	unsigned buddy_N;
+
+	/* nodes of different levels share words, so words are updated atomically */
+	std::atomic<uint64_t>* words;
+	size_t words_count;
+	size_t node_count;
+} bitmap_tree_t;
+
 /* prints bitmapTree info */
-void bitmapTree_print();
+void bitmapTree_print(bitmap_tree_t* tree);
 
 /* returns the value of bit at index */
-short bitmapTree_get_node(unsigned index);
+short bitmapTree_get_node(bitmap_tree_t* tree, size_t index);
 
-/* sets the value of bit at index */
-void bitmapTree_set_node(unsigned index,short value);
+/* sets the value of bit at index (atomic, other nodes in word are kept) */
+void bitmapTree_set_node(bitmap_tree_t* tree, size_t index, short value);
 
-/* sets all bits to 0 */
-void* bitmapTree_init(void* space, unsigned buddy_pow);
+/* places tree words on space and sets all bits to 0, returns end of words */
+void* bitmapTree_init(bitmap_tree_t* tree, void* space, unsigned buddy_pow);
 
 /* gets index level in bitmapTree */
-int bitmapTree_get_block_size(unsigned index);
+int bitmapTree_get_block_size(bitmap_tree_t* tree, size_t index);
 
-/* deallocates block in bitmapTree */
-int bitmapTree_dealloc(unsigned block_num);
+/* returns index of TAKEN node that block_num belongs to */
+size_t bitmapTree_get_taken(bitmap_tree_t* tree, size_t block_num);
 
-/* allocates memory of size 2^pow blocks */
-void bitmapTree_alloc(unsigned block_num, int pow);
+/* returns index of node for block_num with size 2^pow blocks */
+size_t bitmapTree_get_index(bitmap_tree_t* tree, size_t block_num, int pow);
 
 /* returns buddy of index */
-int bitmapTree_get_buddy(unsigned index);
+size_t bitmapTree_get_buddy(size_t index);
 
 /* checks if buddy subtree is free */
-int bitmapTree_is_buddy_free(unsigned index);
+int bitmapTree_is_buddy_free(bitmap_tree_t* tree, size_t index);
 
 /* returns number of first block pointed by index */
-int bitmapTree_get_block(unsigned index);
+size_t bitmapTree_get_block(bitmap_tree_t* tree, size_t index);
 
@@ -3,209 +3,763 @@
 #include <stdio.h>
 #include <assert.h>
 #include "slab.h"
+#include "Trace.h"
 #include <mutex>
+#include <thread>
 #include <cmath>
-
-#define NEXT(X) *(int*)block(X)      // reference
-#define PREV(X) *((int*)block(X)+1)  // reference
-
-static void* buddy_space;
-static unsigned buddy_blocks_num;
-static std::mutex buddy_mutex;
-
-static unsigned buddy_N;
-
-static int* buddy_blocks;
-
-void* block(int n) {
+#include <new>
+#include <chrono>
+
+#ifdef __linux__
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <sys/mman.h>
+#endif
+
+#ifdef _WIN32
+#include <windows.h>
+#endif
+
+#define NEXT(X) *(size_t*)block(zonep, X)      // reference
+#define PREV(X) *((size_t*)block(zonep, X)+1)  // reference
+
+/* only for free blocks with size >= 2^BUDDY_RELEASE_ORDER */
+#define FREED_AT(X) *((size_t*)block(zonep, X)+2)  // reference, ms
+#define RELEASED(X) *((size_t*)block(zonep, X)+3)  // reference
+
+/* MADV_FREE is cheaper, but RSS goes down only under memory pressure */
+#define BUDDY_RELEASE_ADVICE MADV_DONTNEED
+
+typedef struct buddy_zone_s {
+	void* buddy_space;
+	size_t buddy_blocks_num;
+	unsigned buddy_N;
+
+	/* NUMA node the zone memory is bound to */
+	int node;
+
+	size_t* buddy_blocks;
+
+	/* bit k is set when list of free blocks with size = 2^k is not empty */
+	/* (changed only inside buddy_mutex[k])                              */
+	std::atomic<uint64_t> buddy_free_orders;
+
+	/* splits and merges in flight: their block is off free lists until halves (or */
+	/* merged block) are listed, so empty buddy_free_orders is not out of memory   */
+	/* while it's not 0                                                            */
+	std::atomic<unsigned int> blocks_in_transit;
+
+	/* buddy_mutex[k] guards list of free blocks with size = 2^k and  */
+	/* all bitmapTree nodes on that level, so different orders can be */
+	/* allocated and deallocated in parallel                          */
+	std::mutex buddy_mutex[BUDDY_MAX_ORDER];
+
+	bitmap_tree_t tree;
+
+	/* BUDDY_LAZY: freed blocks stay TAKEN in bitmapTree and wait on lists */
+	/* of recently freed blocks, so same order alloc skips split/merge     */
+	/* (lazy list k is guarded by buddy_mutex[k] too)                      */
+	int mode;
+	size_t lazy_blocks[BUDDY_MAX_ORDER];
+	std::atomic<size_t> lazy_count[BUDDY_MAX_ORDER];
+	std::atomic<uint64_t> lazy_orders;
+
+	/* number of blocks in list of free blocks with size = 2^k, written */
+	/* inside buddy_mutex[k], read without locks by buddy_free_snapshot  */
+	std::atomic<size_t> free_count[BUDDY_MAX_ORDER];
+
+	/* statistics, updated with relaxed atomics (different order locks) */
+	std::atomic<size_t> stat_free_blocks;
+	std::atomic<size_t> stat_lazy_blocks;
+	std::atomic<size_t> stat_allocs;
+	std::atomic<size_t> stat_frees;
+	std::atomic<size_t> stat_splits;
+	std::atomic<size_t> stat_merges;
+	std::atomic<size_t> stat_alloc_failures;
+} buddy_zone_t;
+
+#define STAT_ADD(counter, n) (counter).fetch_add((n), std::memory_order_relaxed)
+#define STAT_SUB(counter, n) (counter).fetch_sub((n), std::memory_order_relaxed)
+#define STAT_READ(counter) ((counter).load(std::memory_order_relaxed))
+
+/* per-order counters have one writer at a time (order lock), so no atomic RMW is needed */
+#define COUNT_ADD(counter, n) (counter).store((counter).load(std::memory_order_relaxed) + (n), std::memory_order_relaxed)
+
+/* blocks of free block which are not off limit */
+#define SPAN(zonep, blockn, pow) \
+		((((blockn) + ((size_t)1 << (pow))) <= (zonep)->buddy_blocks_num) ? ((size_t)1 << (pow)) : ((zonep)->buddy_blocks_num - (blockn)))
+
+/* zones are added only during init, before any allocation */
+static buddy_zone_t* buddy_zones[BUDDY_MAX_ZONES];
+static int buddy_zones_num;
+
+void* block(buddy_zone_t* zonep, size_t n) {
 	/* O(1) */
 
 	/* returns the pointer to a block number n */
-	if (n >= 0 && n <= 1 << buddy_N) {
-		return (void*)((int)buddy_space + n*BLOCK_SIZE);
+	if (n <= ((size_t)1 << zonep->buddy_N)) {
+		return (void*)((uintptr_t)zonep->buddy_space + n*BLOCK_SIZE);
 	}
 	else return nullptr;
 }
 
-void* buddy_init(void * space, int *block_number){
+void* buddy_init(void * space, size_t *block_number, int mode){
+
+	/* forget zones from previous init */
+	buddy_zones_num = 0;
+
+	return buddy_zone_add(space, block_number, 0, mode);
+}
+
+void* buddy_zone_add(void* space, size_t* block_number, int node, int mode) {
+
+	/* assert MUST be true because on start of each block               */
+	/* there are two block numbers (size_t) used for linking free blocks */
+	/* and free time and release mark of big blocks                      */
+
+	assert(BLOCK_SIZE > 4 * sizeof(size_t));
+	assert(buddy_zones_num < BUDDY_MAX_ZONES);
+
+	/* zone struct is placed on the start of its own space */
+	space = (void*)(((uintptr_t)space + alignof(buddy_zone_t) - 1) & ~((uintptr_t)alignof(buddy_zone_t) - 1));
+	buddy_zone_t* zonep = new (space) buddy_zone_t();
 
-	/* assert MUST be true because on start of each block         */
-	/* there are two pointers (ints) used for linking free blocks */
+	zonep->node = node;
+	zonep->mode = mode;
 
-	assert(BLOCK_SIZE > 2 * sizeof(int));
+	zonep->stat_free_blocks = 0;
+	zonep->stat_lazy_blocks = 0;
+	zonep->stat_allocs = 0;
+	zonep->stat_frees = 0;
+	zonep->stat_splits = 0;
+	zonep->stat_merges = 0;
+	zonep->stat_alloc_failures = 0;
 
-	buddy_N = 0;
-	while ((1 << buddy_N) < *block_number) buddy_N++;
+	zonep->buddy_N = 0;
+	while (((size_t)1 << zonep->buddy_N) < *block_number) zonep->buddy_N++;
 
-	buddy_blocks = (int*)space;
+	assert(zonep->buddy_N < BUDDY_MAX_ORDER);
 
-	void* filled = bitmapTree_init((void*)((buddy_blocks + buddy_N + 1)), buddy_N);
+	zonep->buddy_blocks = (size_t*)(zonep + 1);
+
+	void* filled = bitmapTree_init(&zonep->tree, (void*)((zonep->buddy_blocks + zonep->buddy_N + 1)), zonep->buddy_N);
 
 	/* align with BLOCK_SIZE multiple */
-	filled = (void*)(((unsigned)filled + BLOCK_SIZE - 1) & ~(BLOCK_SIZE - 1));
+	filled = (void*)(((uintptr_t)filled + BLOCK_SIZE - 1) & ~((uintptr_t)BLOCK_SIZE - 1));
 
 	/* calculate how many blocks are lost for buddy and bitmap structs */
-	unsigned lost_blocks = ((unsigned)filled - (unsigned)space) / BLOCK_SIZE;
+	size_t lost_blocks = ((uintptr_t)filled - (uintptr_t)space) / BLOCK_SIZE;
 
 	/* buddy blocks start from this address */
-	buddy_space = filled;
+	zonep->buddy_space = filled;
 
 	(*block_number) = (*block_number) - lost_blocks;
 
-	buddy_blocks_num = *block_number;
+	zonep->buddy_blocks_num = *block_number;
+
+	for (unsigned i = 0; i < BUDDY_MAX_ORDER; i++) zonep->free_count[i] = 0;
+	for (unsigned i = 0; i <= zonep->buddy_N; i++) zonep->buddy_blocks[i] = BUDDY_NONE;
+	zonep->buddy_free_orders = 0;
+	zonep->blocks_in_transit = 0;
+	buddy_add_block(zonep, 0, zonep->buddy_N);
+
+	for (unsigned i = 0; i <= zonep->buddy_N; i++) {
+		zonep->lazy_blocks[i] = BUDDY_NONE;
+		zonep->lazy_count[i] = 0;
+	}
+	zonep->lazy_orders = 0;
 
-	for (int i = 0; i <= buddy_N; i++) buddy_blocks[i] = -1;
-	buddy_add_block(0, buddy_N);
+	buddy_zones[buddy_zones_num++] = zonep;
 
 	/* return starting address of blocks to kmem_init() */
 	/* it's needed for block to slab mapping            */
 	return filled;
 }
 
-int buddy_remove_block(int blockn, int pow) {
+size_t buddy_remove_block(buddy_zone_t* zonep, size_t blockn, int pow) {
 	/* O(1) */
 
-	assert(blockn >= 0 && blockn < buddy_blocks_num);
-	assert(pow >= 0 && pow<=buddy_N);
+	assert(blockn < zonep->buddy_blocks_num);
+	assert(pow >= 0 && pow <= (int)zonep->buddy_N);
 
-	if (NEXT(blockn) != -1) PREV(NEXT(blockn)) = PREV(blockn);
-	if (PREV(blockn) != -1) NEXT(PREV(blockn)) = NEXT(blockn);
+	if (NEXT(blockn) != BUDDY_NONE) PREV(NEXT(blockn)) = PREV(blockn);
+	if (PREV(blockn) != BUDDY_NONE) NEXT(PREV(blockn)) = NEXT(blockn);
 
 	/* if it was the first block in list */
-	if (PREV(blockn) == -1) buddy_blocks[pow] = NEXT(blockn);
+	if (PREV(blockn) == BUDDY_NONE) zonep->buddy_blocks[pow] = NEXT(blockn);
+
+	if (zonep->buddy_blocks[pow] == BUDDY_NONE) zonep->buddy_free_orders.fetch_and(~((uint64_t)1 << pow));
+
+	COUNT_ADD(zonep->free_count[pow], (size_t)-1);
+	STAT_SUB(zonep->stat_free_blocks, SPAN(zonep, blockn, pow));
 	return blockn;
 }
 
-void buddy_add_block(int blockn, int pow) {
+void buddy_add_block(buddy_zone_t* zonep, size_t blockn, int pow) {
 	/* O(1) */
 
-	assert(blockn >= 0 && blockn < buddy_blocks_num);
-	assert(pow >= 0 && pow<=buddy_N);
+	assert(blockn < zonep->buddy_blocks_num);
+	assert(pow >= 0 && pow <= (int)zonep->buddy_N);
 
-	PREV(blockn) = -1;
-	NEXT(blockn) = buddy_blocks[pow];
-	if (buddy_blocks[pow] != -1) PREV(buddy_blocks[pow]) = blockn;
-	buddy_blocks[pow] = blockn;
+	PREV(blockn) = BUDDY_NONE;
+	NEXT(blockn) = zonep->buddy_blocks[pow];
+	if (zonep->buddy_blocks[pow] != BUDDY_NONE) PREV(zonep->buddy_blocks[pow]) = blockn;
+	else zonep->buddy_free_orders.fetch_or((uint64_t)1 << pow);
+	zonep->buddy_blocks[pow] = blockn;
+
+	COUNT_ADD(zonep->free_count[pow], 1);
+	STAT_ADD(zonep->stat_free_blocks, SPAN(zonep, blockn, pow));
+
+	if (pow >= BUDDY_RELEASE_ORDER) {
+		FREED_AT(blockn) = (size_t)std::chrono::duration_cast<std::chrono::milliseconds>(
+			std::chrono::steady_clock::now().time_since_epoch()).count();
+		RELEASED(blockn) = 0;
+	}
 }
 
-void* bmalloc(int size_in_bytes) {
+void* bmalloc(size_t size_in_bytes) {
 	/* O(log(number of blocks)) */
 
 	assert(size_in_bytes > 0);
-	int pow = 0;
-	while ((1<<pow)*BLOCK_SIZE < size_in_bytes) pow++;
-	return buddy_alloc(pow);
+
+	/* smallest pow such that 2^pow blocks fit size_in_bytes */
+	size_t blocks = (size_in_bytes + BLOCK_SIZE - 1) / BLOCK_SIZE;
+	int pow = (blocks > 1) ? bit_scan_reverse(blocks - 1) + 1 : 0;
+	void* blockp = buddy_alloc(pow);
+
+	if (trace_enabled()) trace_record(TRACE_BMALLOC, 0, size_in_bytes, blockp);
+
+	return blockp;
 }
 
 int bfree(void* blockp) {
 	/* O(log(number of blocks)) */
 
-	if (blockp != nullptr) return buddy_dealloc(blockp);
-	else return 1;
+	if (blockp == nullptr) return 1;
+
+	if (trace_enabled()) trace_record(TRACE_BFREE, 0, 0, blockp);
+
+	return buddy_dealloc(blockp);
 }
 
 void* buddy_alloc(int i) {
 	/* O(log(number of blocks)) */
 
-	std::lock_guard<std::mutex> lock(buddy_mutex);
+	return buddy_alloc_node(i, buddy_numa_node());
+}
+
+void* buddy_alloc_node(int i, int node) {
+	/* O(number of zones * log(number of blocks)) */
+
+	void* blockp = nullptr;
 
-	int blockn;
+	/* zone local to the node first */
+	int local = -1;
+	for (int z = 0; z < buddy_zones_num; z++) {
+		if (buddy_zones[z]->node == node) {
+			local = z;
+			blockp = buddy_zone_alloc(buddy_zones[z], i);
+			if (blockp != nullptr) return blockp;
+			break;
+		}
+	}
 
-	if (i <= buddy_N) {
-		int j = i;
+	/* fallback to remote zones */
+	for (int z = 0; z < buddy_zones_num && blockp == nullptr; z++) {
+		if (z != local) blockp = buddy_zone_alloc(buddy_zones[z], i);
+	}
 
-		/* find block to split if needed */
-		while (j <= buddy_N && buddy_blocks[j] == -1) j++;
+	return blockp;
+}
 
-		/* if not enough memory return nullptr */
-		if (j > buddy_N) return nullptr;
-		
-		/* split segment(s) in two halves */
-		while (i != j) {
+void* buddy_zone_alloc(buddy_zone_t* zonep, int i) {
+	/* O(log(number of blocks)) */
 
-			blockn = buddy_remove_block(buddy_blocks[j], j);
-	
-			if (blockn + (1 << (j - 1)) >= buddy_blocks_num) {
-				/* if the beginning of the second half of divided block is off limit, fake alloc it */
-				bitmapTree_alloc(blockn + (1 << j - 1), j - 1);
-			}
-			else {
-				/* else, add it to appropriate list of free blocks */
-				buddy_add_block(blockn + (1 << j - 1), j - 1);
-			}
+	void* blockp = buddy_zone_split(zonep, i);
 
-			/* add first half of divided block to appropriate list of free blocks */
-			buddy_add_block(blockn, j - 1);
-			
-			j--;
+	/* not enough coalesced memory, merge recently freed blocks and retry */
+	if (blockp == nullptr && zonep->lazy_orders.load() != 0) {
+		buddy_zone_coalesce(zonep);
+		blockp = buddy_zone_split(zonep, i);
+	}
+
+	if (blockp != nullptr) STAT_ADD(zonep->stat_allocs, 1);
+	else STAT_ADD(zonep->stat_alloc_failures, 1);
+
+	return blockp;
+}
+
+void* buddy_zone_split(buddy_zone_t* zonep, int i) {
+	/* O(log(number of blocks)) */
+
+	/* only one buddy_mutex is held at a time:                       */
+	/* - block taken from a list is marked on its level in that CS,  */
+	/*   so it can't be merged by buddy_dealloc                      */
+	/* - ancestors of a listed block are never FREE, so there is no  */
+	/*   need to update levels above the taken block                 */
+
+	if (i < 0 || i > (int)zonep->buddy_N) return nullptr;
+
+	/* recently freed block of the same order is already TAKEN on level i */
+	if (zonep->lazy_orders.load() & ((uint64_t)1 << i)) {
+		std::lock_guard<std::mutex> lock(zonep->buddy_mutex[i]);
+
+		if (zonep->lazy_blocks[i] != BUDDY_NONE) return block(zonep, buddy_lazy_pop(zonep, i));
+	}
+
+	size_t blockn = BUDDY_NONE;
+	int j;
+
+	/* find block to split if needed: smallest non-empty order >= i */
+	while (blockn == BUDDY_NONE) {
+		uint64_t orders = zonep->buddy_free_orders.load() & ~(((uint64_t)1 << i) - 1);
+
+		if (orders == 0) {
+			/* if not enough memory return nullptr, blocks split or merged */
+			/* by other threads are back on lists soon                     */
+			if (zonep->blocks_in_transit.load() == 0) return nullptr;
+			std::this_thread::yield();
+			continue;
 		}
 
-		/* if there are blocks that are off limit within chosen block */
-		if (buddy_blocks[j] + (1 << j) - 1 >= buddy_blocks_num) return nullptr;
-		
-		/* return pointer to allocated memory and update buddy structs */
-		blockn = buddy_remove_block(buddy_blocks[i], i);
-		void* mem = block(blockn);
-		bitmapTree_alloc(blockn, i);
-		return mem;
+		j = bit_scan_forward(orders);
+
+		std::lock_guard<std::mutex> lock(zonep->buddy_mutex[j]);
+
+		/* list could be emptied by other thread, then bit is already cleared */
+		if (zonep->buddy_blocks[j] != BUDDY_NONE) {
+			/* counted before its bit can be cleared */
+			zonep->blocks_in_transit++;
+			blockn = buddy_remove_block(zonep, zonep->buddy_blocks[j], j);
+			bitmapTree_set_node(&zonep->tree, bitmapTree_get_index(&zonep->tree, blockn, j), (i == j) ? TAKEN : PARTLY_FREE);
+		}
 	}
 
+	/* split segment(s) in two halves */
+	while (i != j) {
+		j--;
+		STAT_ADD(zonep->stat_splits, 1);
+
+		std::lock_guard<std::mutex> lock(zonep->buddy_mutex[j]);
+
+		size_t half = blockn + ((size_t)1 << j);
+
+		if (half >= zonep->buddy_blocks_num) {
+			/* if the beginning of the second half of divided block is off limit, fake alloc it */
+			bitmapTree_set_node(&zonep->tree, bitmapTree_get_index(&zonep->tree, half, j), TAKEN);
+		}
+		else {
+			/* else, add it to appropriate list of free blocks */
+			buddy_add_block(zonep, half, j);
+		}
+
+		/* keep first half of divided block */
+		bitmapTree_set_node(&zonep->tree, bitmapTree_get_index(&zonep->tree, blockn, j), (i == j) ? TAKEN : PARTLY_FREE);
+	}
+
+	/* if there are blocks that are off limit within chosen block */
+	if (blockn + ((size_t)1 << i) - 1 >= zonep->buddy_blocks_num) {
+		std::lock_guard<std::mutex> lock(zonep->buddy_mutex[i]);
+
+		bitmapTree_set_node(&zonep->tree, bitmapTree_get_index(&zonep->tree, blockn, i), FREE);
+		buddy_add_block(zonep, blockn, i);
+		zonep->blocks_in_transit--;
+		return nullptr;
+	}
+
+	zonep->blocks_in_transit--;
+
+	/* return pointer to allocated memory */
+	return block(zonep, blockn);
+}
+
+buddy_zone_t* buddy_zone_of(void* blockp) {
+	/* O(number of zones) */
+
+	for (int z = 0; z < buddy_zones_num; z++) {
+		buddy_zone_t* zonep = buddy_zones[z];
+		if ((uintptr_t)blockp >= (uintptr_t)zonep->buddy_space &&
+			(uintptr_t)blockp < (uintptr_t)zonep->buddy_space + zonep->buddy_blocks_num*BLOCK_SIZE) {
+			return zonep;
+		}
+	}
 	return nullptr;
 }
 
 int buddy_dealloc(void * blockp) {
-	/* O(number of blocks) */
+	/* O(number of zones + log(number of blocks)) */
 
-	std::lock_guard<std::mutex> lock(buddy_mutex);
+	buddy_zone_t* zonep = buddy_zone_of(blockp);
+
+	/* check block_ptr validity */
+	assert(zonep != nullptr);
 
 	/* block_num is a number of the first block in the chunk of memory pointed by block_ptr */
-	int block_num = (int)(((char*)blockp - buddy_space) / BLOCK_SIZE);
+	size_t block_num = ((uintptr_t)blockp - (uintptr_t)zonep->buddy_space) / BLOCK_SIZE;
 
-	/* check block_ptr validity */
-	assert(block_num >= 0 && block_num < (1 << buddy_N));
+	/* node and nodes below it belong to this thread */
+	size_t node = bitmapTree_get_taken(&zonep->tree, block_num);
 
-	int node = bitmapTree_dealloc(block_num);
+	int block_size = bitmapTree_get_block_size(&zonep->tree, node);
 
-	int block_size = bitmapTree_get_block_size(node);
+	STAT_ADD(zonep->stat_frees, 1);
 
-	/* merge buddies */
-	while (node > 0 && bitmapTree_is_buddy_free(node)) {
+	/* block stays TAKEN until watermark of its order is reached */
+	if (zonep->mode == BUDDY_LAZY) {
+		std::lock_guard<std::mutex> lock(zonep->buddy_mutex[block_size]);
 
-		buddy_remove_block
-		(
-			bitmapTree_get_block(bitmapTree_get_buddy(node)), 
-			block_size
-		);
+		if (zonep->lazy_count[block_size] < BUDDY_LAZY_WATERMARK) {
+			buddy_lazy_push(zonep, block_num, block_size);
+			return 0;
+		}
+	}
 
-		block_size++;
-		node = PARENT(node);
+	buddy_merge(zonep, node, block_size);
+
+	return 0;
+}
+
+void buddy_merge(buddy_zone_t* zonep, size_t node, int block_size) {
+	/* O(log(number of blocks)) */
+
+	size_t block_num = bitmapTree_get_block(&zonep->tree, node);
 
-		assert(bitmapTree_get_node(node) == PARTLY_FREE);
-		bitmapTree_set_node(node, FREE);
+	/* removed buddies are off lists until merged block is added */
+	zonep->blocks_in_transit++;
 
-		block_num = bitmapTree_get_block(node);
+	/* merge buddies, one level at a time */
+	while (true) {
+		std::lock_guard<std::mutex> lock(zonep->buddy_mutex[block_size]);
+
+		/* buddy is FREE only when it's in list of free blocks: parent is not FREE */
+		if (node > 0 && bitmapTree_is_buddy_free(&zonep->tree, node)) {
+
+			buddy_remove_block
+			(
+				zonep,
+				bitmapTree_get_block(&zonep->tree, bitmapTree_get_buddy(node)),
+				block_size
+			);
+
+			/* parent stays PARTLY_FREE and belongs to this thread */
+			bitmapTree_set_node(&zonep->tree, node, FREE);
+
+			block_size++;
+			STAT_ADD(zonep->stat_merges, 1);
+			node = PARENT(node);
+
+			assert(bitmapTree_get_node(&zonep->tree, node) == PARTLY_FREE);
+
+			block_num = bitmapTree_get_block(&zonep->tree, node);
+		}
+		else {
+			/* link new memory block to the list of free blocks */
+			bitmapTree_set_node(&zonep->tree, node, FREE);
+			buddy_add_block(zonep, block_num, block_size);
+			break;
+		}
 	}
 
-	/* link new memory block to the list of free blocks */
-	buddy_add_block(block_num, block_size);
+	zonep->blocks_in_transit--;
+}
+
+int buddy_grow(void* blockp, int pow, int new_pow) {
+	/* O(new_pow - pow) */
+
+	buddy_zone_t* zonep = buddy_zone_of(blockp);
+	assert(zonep != nullptr);
 
+	if (new_pow <= pow) return new_pow == pow;
+	if (new_pow > (int)zonep->buddy_N) return 0;
+
+	size_t blockn = ((uintptr_t)blockp - (uintptr_t)zonep->buddy_space) / BLOCK_SIZE;
+
+	/* block must be the leftmost part of grown block, which must not be off limit */
+	if ((blockn & (((size_t)1 << new_pow) - 1)) != 0) return 0;
+	if (blockn + ((size_t)1 << new_pow) > zonep->buddy_blocks_num) return 0;
+
+	size_t node = bitmapTree_get_index(&zonep->tree, blockn, pow);
+
+	/* cheap check without locks, buddies can still be taken before they're locked */
+	for (size_t n = node; bitmapTree_get_block_size(&zonep->tree, n) < new_pow; n = PARENT(n)) {
+		if (!bitmapTree_is_buddy_free(&zonep->tree, n)) return 0;
+	}
+
+	int i;
+	for (i = pow; i < new_pow; i++) {
+		std::lock_guard<std::mutex> lock(zonep->buddy_mutex[i]);
+
+		/* parent is an ancestor of TAKEN block, so FREE buddy is in list of free blocks */
+		size_t buddy = bitmapTree_get_buddy(node);
+		if (bitmapTree_get_node(&zonep->tree, buddy) != FREE) break;
+
+		buddy_remove_block(zonep, bitmapTree_get_block(&zonep->tree, buddy), i);
+
+		/* parent is TAKEN before its children look free */
+		bitmapTree_set_node(&zonep->tree, PARENT(node), TAKEN);
+		bitmapTree_set_node(&zonep->tree, node, FREE);
+
+		node = PARENT(node);
+	}
+
+	if (i == new_pow) return 1;
+
+	/* buddy on level i was taken meanwhile, give back what was taken */
+	buddy_shrink(blockp, i, pow);
 	return 0;
 }
 
+void buddy_shrink(void* blockp, int pow, int new_pow) {
+	/* O(pow - new_pow) */
+
+	buddy_zone_t* zonep = buddy_zone_of(blockp);
+	assert(zonep != nullptr);
+
+	size_t blockn = ((uintptr_t)blockp - (uintptr_t)zonep->buddy_space) / BLOCK_SIZE;
+	size_t node = bitmapTree_get_index(&zonep->tree, blockn, pow);
+
+	for (int i = pow; i > new_pow; i--) {
+		/* left half is kept, it's TAKEN before right half is listed, */
+		/* so right half can't be merged with it                      */
+		bitmapTree_set_node(&zonep->tree, LEFT(node), TAKEN);
+		bitmapTree_set_node(&zonep->tree, node, PARTLY_FREE);
+
+		std::lock_guard<std::mutex> lock(zonep->buddy_mutex[i - 1]);
+
+		buddy_add_block(zonep, bitmapTree_get_block(&zonep->tree, RIGHT(node)), i - 1);
+
+		node = LEFT(node);
+	}
+}
+
+void buddy_lazy_push(buddy_zone_t* zonep, size_t blockn, int pow) {
+	/* O(1) */
+
+	/* only NEXT is used, blocks are always taken from the head */
+	NEXT(blockn) = zonep->lazy_blocks[pow];
+	if (zonep->lazy_blocks[pow] == BUDDY_NONE) zonep->lazy_orders.fetch_or((uint64_t)1 << pow);
+	zonep->lazy_blocks[pow] = blockn;
+	COUNT_ADD(zonep->lazy_count[pow], 1);
+	STAT_ADD(zonep->stat_lazy_blocks, (size_t)1 << pow);
+}
+
+size_t buddy_lazy_pop(buddy_zone_t* zonep, int pow) {
+	/* O(1) */
+
+	size_t blockn = zonep->lazy_blocks[pow];
+	assert(blockn != BUDDY_NONE);
+
+	zonep->lazy_blocks[pow] = NEXT(blockn);
+	if (zonep->lazy_blocks[pow] == BUDDY_NONE) zonep->lazy_orders.fetch_and(~((uint64_t)1 << pow));
+	COUNT_ADD(zonep->lazy_count[pow], (size_t)-1);
+	STAT_SUB(zonep->stat_lazy_blocks, (size_t)1 << pow);
+	return blockn;
+}
+
+void buddy_zone_coalesce(buddy_zone_t* zonep) {
+	/* O(number of lazy blocks * log(number of blocks)) */
+
+	/* smaller orders first, so merged blocks can meet larger lazy buddies later */
+	for (unsigned pow = 0; pow <= zonep->buddy_N; pow++) {
+		while (true) {
+			size_t blockn;
+			{
+				std::lock_guard<std::mutex> lock(zonep->buddy_mutex[pow]);
+				if (zonep->lazy_blocks[pow] == BUDDY_NONE) break;
+				blockn = buddy_lazy_pop(zonep, pow);
+			}
+
+			/* block is TAKEN and off all lists, so it belongs to this thread */
+			buddy_merge(zonep, bitmapTree_get_index(&zonep->tree, blockn, pow), pow);
+		}
+	}
+}
+
+void buddy_coalesce() {
+	for (int z = 0; z < buddy_zones_num; z++) buddy_zone_coalesce(buddy_zones[z]);
+}
+
 void buddy_print() {
-	/* prints buddy info */
-	bitmapTree_print();
-
-	for (int i = buddy_N; i >= 0; i--) {
-		printf("2^%d : %d", i, buddy_blocks[i]);
-		int ptr = buddy_blocks[i];
-		while (ptr != -1) {
-			ptr = NEXT(ptr);
-			printf(" %d", ptr);
+	/* prints buddy info, not thread safe */
+
+	for (int z = 0; z < buddy_zones_num; z++) {
+		buddy_zone_t* zonep = buddy_zones[z];
+
+		printf("zone %d (node %d)\n", z, zonep->node);
+		bitmapTree_print(&zonep->tree);
+
+		for (int i = zonep->buddy_N; i >= 0; i--) {
+			printf("2^%d :", i);
+			size_t ptr = zonep->buddy_blocks[i];
+			while (ptr != BUDDY_NONE) {
+				printf(" %zu", ptr);
+				ptr = NEXT(ptr);
+			}
+			printf(" -1");
+			if (zonep->lazy_blocks[i] != BUDDY_NONE) {
+				printf(" | lazy:");
+				for (ptr = zonep->lazy_blocks[i]; ptr != BUDDY_NONE; ptr = NEXT(ptr)) printf(" %zu", ptr);
+			}
+			printf("\n");
 		}
 		printf("\n");
 	}
-	printf("\n");
 }
 
+int buddy_stats_snapshot(buddy_zone_stats_t* stats, int max) {
+	/* O(number of zones) */
+
+	for (int z = 0; z < buddy_zones_num && z < max; z++) {
+		buddy_zone_t* zonep = buddy_zones[z];
+
+		stats[z].node = zonep->node;
+		stats[z].blocks = zonep->buddy_blocks_num;
+		stats[z].free_blocks = STAT_READ(zonep->stat_free_blocks);
+		stats[z].lazy_blocks = STAT_READ(zonep->stat_lazy_blocks);
+		stats[z].allocs = STAT_READ(zonep->stat_allocs);
+		stats[z].frees = STAT_READ(zonep->stat_frees);
+		stats[z].splits = STAT_READ(zonep->stat_splits);
+		stats[z].merges = STAT_READ(zonep->stat_merges);
+		stats[z].alloc_failures = STAT_READ(zonep->stat_alloc_failures);
+	}
+
+	return buddy_zones_num;
+}
+
+int buddy_free_snapshot(buddy_free_info_t* info, int max) {
+	/* O(number of zones * number of orders) */
+
+	for (int z = 0; z < buddy_zones_num && z < max; z++) {
+		buddy_zone_t* zonep = buddy_zones[z];
+		buddy_free_info_t* ip = &info[z];
+
+		ip->node = zonep->node;
+		ip->orders = zonep->buddy_N + 1;
+		ip->largest_free_order = -1;
+
+		for (int k = 0; k < BUDDY_MAX_ORDER; k++) {
+			ip->free[k] = (k < ip->orders) ? STAT_READ(zonep->free_count[k]) : 0;
+			ip->lazy[k] = (k < ip->orders) ? STAT_READ(zonep->lazy_count[k]) : 0;
+			if (ip->free[k] + ip->lazy[k] > 0) ip->largest_free_order = k;
+		}
+		for (int k = 0; k < BUDDY_MAX_ORDER; k++) ip->frag_index[k] = buddy_fragmentation_index(ip, k);
+	}
+
+	return buddy_zones_num;
+}
+
+int buddy_fragmentation_index(const buddy_free_info_t* info, int order) {
+	/* O(number of orders) */
+
+	/* recently freed blocks can be handed out for their order, so they count as free */
+	size_t free_blocks = 0, free_pages = 0, suitable = 0;
+	for (int k = 0; k < info->orders; k++) {
+		size_t n = info->free[k] + info->lazy[k];
+		free_blocks += n;
+		free_pages += n << k;
+		if (k >= order) suitable += n;
+	}
+
+	if (free_blocks == 0) return 0;
+	if (suitable > 0) return -1000;
+
+	/* 1000 - (1 + free pages / requested pages) / free blocks, in thousandths */
+	return (int)(1000 - (1000 + free_pages * 1000 / ((size_t)1 << order)) / free_blocks);
+}
+
+int buddy_largest_free_order() {
+	/* O(number of zones) */
+
+	int largest = -1;
+	for (int z = 0; z < buddy_zones_num; z++) {
+		uint64_t orders = buddy_zones[z]->buddy_free_orders.load(std::memory_order_relaxed) |
+			buddy_zones[z]->lazy_orders.load(std::memory_order_relaxed);
+		if (orders != 0 && bit_scan_reverse(orders) > largest) largest = bit_scan_reverse(orders);
+	}
+	return largest;
+}
+
+size_t buddy_release(unsigned age_ms, size_t granule) {
+	/* O(number of free big blocks) */
+
+	/* first page of a free block holds list links, so it stays resident. */
+	/* list lock is held during madvise, so block can't be handed out     */
+	/* and written to while its pages are dropped                         */
 
+	size_t now = (size_t)std::chrono::duration_cast<std::chrono::milliseconds>(
+		std::chrono::steady_clock::now().time_since_epoch()).count();
+	size_t released = 0;
+
+	for (int z = 0; z < buddy_zones_num; z++) {
+		buddy_zone_t* zonep = buddy_zones[z];
+
+		for (int pow = BUDDY_RELEASE_ORDER; pow <= (int)zonep->buddy_N; pow++) {
+			std::lock_guard<std::mutex> lock(zonep->buddy_mutex[pow]);
+
+			for (size_t blockn = zonep->buddy_blocks[pow]; blockn != BUDDY_NONE; blockn = NEXT(blockn)) {
+				if (RELEASED(blockn) || now - FREED_AT(blockn) < age_ms) continue;
+
+				uintptr_t from = ((uintptr_t)block(zonep, blockn) + BLOCK_SIZE + granule - 1) & ~((uintptr_t)granule - 1);
+				uintptr_t to = ((uintptr_t)block(zonep, blockn + ((size_t)1 << pow))) & ~((uintptr_t)granule - 1);
+				if (from >= to) continue;
+
+#if defined(__linux__)
+				if (madvise((void*)from, to - from, BUDDY_RELEASE_ADVICE) != 0) continue;
+#elif defined(_WIN32)
+				if (VirtualAlloc((void*)from, to - from, MEM_RESET, PAGE_READWRITE) == nullptr) continue;
+#else
+				continue;
+#endif
+				RELEASED(blockn) = 1;
+				released += to - from;
+			}
+		}
+	}
+
+	return released;
+}
+
+/* ----------------------------------------------------------- */
+/* --------------------------- NUMA -------------------------- */
+/* ----------------------------------------------------------- */
+
+/* raw syscalls are used, so there is no dependency on libnuma */
+
+int buddy_numa_nodes() {
+#ifdef __linux__
+	static int nodes = 0;
+
+	if (nodes == 0) {
+		char path[64];
+		int n = 0;
+		while (n < BUDDY_MAX_ZONES) {
+			snprintf(path, sizeof(path), "/sys/devices/system/node/node%d", n);
+			if (access(path, F_OK) != 0) break;
+			n++;
+		}
+		nodes = (n > 0) ? n : 1;
+	}
+	return nodes;
+#else
+	return 1;
+#endif
+}
+
+int buddy_numa_node() {
+#if defined(__linux__) && defined(SYS_getcpu)
+	unsigned cpu, node;
+	if (syscall(SYS_getcpu, &cpu, &node, nullptr) == 0) return (int)node;
+#endif
+	return 0;
+}
+
+int buddy_numa_bind(void* space, size_t size, int node) {
+#if defined(__linux__) && defined(SYS_mbind)
+	/* MPOL_BIND from <linux/mempolicy.h> */
+	const int mpol_bind = 2;
+
+	unsigned long nodemask = 1UL << node;
+	if (syscall(SYS_mbind, space, size, mpol_bind, &nodemask, sizeof(nodemask) * 8, 0) == 0) return 0;
+#endif
+	return 1;
+}
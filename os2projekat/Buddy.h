@@ -1,28 +1,139 @@
 #pragma once
+#include <stddef.h>
+#include <stdint.h>
 
-/* returns pointer to nth block */
-void* block(int n);
+/* marks end of list of free blocks */
+#define BUDDY_NONE ((size_t)-1)
 
-/* allocate 2^i continous memory blocks of size = __BUDDY_BLOCK_SIZE */
+/* one zone per NUMA node at most */
+#define BUDDY_MAX_ZONES (8)
+
+/* zone has at most 2^(BUDDY_MAX_ORDER-1) blocks */
+#define BUDDY_MAX_ORDER (32)
+
+/* buddy modes */
+#define BUDDY_EAGER (0)  // freed block is merged with its buddies right away
+#define BUDDY_LAZY (1)   // freed blocks are merged only after watermark or on shortage
+
+/* recently freed blocks kept per order before merging (BUDDY_LAZY) */
+#define BUDDY_LAZY_WATERMARK (16)
+
+typedef struct buddy_zone_s buddy_zone_t;
+
+/* statistics of one zone, filled by buddy_stats_snapshot */
+typedef struct buddy_zone_stats_s {
+	int node;
+	size_t blocks;          // blocks of zone
+	size_t free_blocks;     // blocks in lists of free blocks
+	size_t lazy_blocks;     // freed blocks waiting to be merged (BUDDY_LAZY)
+	size_t allocs;
+	size_t frees;
+	size_t splits;
+	size_t merges;
+	size_t alloc_failures;
+} buddy_zone_stats_t;
+
+/* free block histogram of one zone, filled by buddy_free_snapshot */
+typedef struct buddy_free_info_s {
+	int node;
+	int orders;                          // orders 0 .. orders-1 exist in zone
+	size_t free[BUDDY_MAX_ORDER];        // blocks with size = 2^k in lists of free blocks
+	size_t lazy[BUDDY_MAX_ORDER];        // recently freed blocks with size = 2^k (BUDDY_LAZY)
+	int largest_free_order;              // -1 if zone has no free block
+	int frag_index[BUDDY_MAX_ORDER];     // buddy_fragmentation_index of each order
+} buddy_free_info_t;
+
+/* returns pointer to nth block of zone */
+void* block(buddy_zone_t* zonep, size_t n);
+
+/* allocate 2^i continous memory blocks of size = __BUDDY_BLOCK_SIZE,   */
+/* from zone local to the calling thread, or from other zones if it's full */
 void* buddy_alloc(int i);
 
+/* allocate 2^i blocks, zone of the given node is tried first */
+void* buddy_alloc_node(int i, int node);
+
+/* allocate 2^i blocks from the given zone only */
+void* buddy_zone_alloc(buddy_zone_t* zonep, int i);
+
+/* takes block from lists of zone and splits it, without coalescing lazy blocks */
+void* buddy_zone_split(buddy_zone_t* zonep, int i);
+
 /* deallocates memory pointed by ptr */
 int buddy_dealloc(void* ptr);
 
-/* calls bitmapTree_init() and initializes buddy_blocks */
-void* buddy_init(void* space, int* block_number);
+/* removes all zones and makes one zone on space (node 0) */
+void* buddy_init(void* space, size_t* block_number, int mode = BUDDY_EAGER);
+
+/* places zone struct, bitmapTree and buddy_blocks on space and adds zone */
+/* for the given node, returns address of the first block of the zone     */
+void* buddy_zone_add(void* space, size_t* block_number, int node, int mode = BUDDY_EAGER);
+
+/* merges TAKEN block of size 2^block_size (node in bitmapTree) with its free buddies */
+void buddy_merge(buddy_zone_t* zonep, size_t node, int block_size);
+
+/* push/pop block on list of recently freed blocks with size = 2^pow */
+void buddy_lazy_push(buddy_zone_t* zonep, size_t blockn, int pow);
+size_t buddy_lazy_pop(buddy_zone_t* zonep, int pow);
+
+/* merges all recently freed blocks of zone / of all zones (BUDDY_LAZY) */
+void buddy_zone_coalesce(buddy_zone_t* zonep);
+void buddy_coalesce();
+
+/* returns zone which holds block pointed by ptr, nullptr if there is none */
+buddy_zone_t* buddy_zone_of(void* ptr);
 
 /* prints buddy info */
 void buddy_print();
 
+/* fills stats of up to max zones, returns number of zones, no lock is taken (thread safe) */
+int buddy_stats_snapshot(buddy_zone_stats_t* stats, int max);
+
+/* fills free block histograms of up to max zones, per-order counters are */
+/* read without locks, returns number of zones (thread safe)              */
+int buddy_free_snapshot(buddy_free_info_t* info, int max);
+
+/* fragmentation index of 2^order allocation from histogram in thousandths, like   */
+/* Linux extfrag_index: towards 0 it would fail for lack of free memory, towards */
+/* 1000 because free memory is fragmented, -1000 if there is a big enough block  */
+int buddy_fragmentation_index(const buddy_free_info_t* info, int order);
+
+/* returns the largest order with a free block in any zone, -1 if all zones are full (thread safe) */
+int buddy_largest_free_order();
+
 /* remove buddy blockn from the list of buddies with size = 2^pow */
-int buddy_remove_block(int blockn, int pow);
+size_t buddy_remove_block(buddy_zone_t* zonep, size_t blockn, int pow);
 
 /* add buddy blockn from the list of buddies with size = 2^pow */
-void buddy_add_block(int blockn, int pow);
+void buddy_add_block(buddy_zone_t* zonep, size_t blockn, int pow);
+
+/* grows TAKEN block of size 2^pow to 2^new_pow in place, by taking its free */
+/* buddies on the right, returns 1 on success, block is unchanged otherwise   */
+int buddy_grow(void* blockp, int pow, int new_pow);
+
+/* shrinks TAKEN block of size 2^pow to 2^new_pow in place, upper halves go */
+/* back to lists of free blocks                                             */
+void buddy_shrink(void* blockp, int pow, int new_pow);
 
 /* allocate size bytes */
-void* bmalloc(int size);
+void* bmalloc(size_t size);
 
 /* free allocated memory */
-int bfree(void*);
\ No newline at end of file
+int bfree(void*);
+
+/* free blocks with size >= 2^BUDDY_RELEASE_ORDER can be returned to the OS */
+#define BUDDY_RELEASE_ORDER (9)
+
+/* returns pages of free blocks with size >= 2^BUDDY_RELEASE_ORDER, that */
+/* stayed free for age_ms, to the OS (arena must be private anonymous    */
+/* memory), granule is the page size of the arena. returns bytes released */
+size_t buddy_release(unsigned age_ms, size_t granule);
+
+/* number of NUMA nodes (1 if unknown) */
+int buddy_numa_nodes();
+
+/* NUMA node of the cpu calling thread runs on (0 if unknown) */
+int buddy_numa_node();
+
+/* binds pages of space to the node, returns 0 on success */
+int buddy_numa_bind(void* space, size_t size, int node);
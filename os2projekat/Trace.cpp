@@ -0,0 +1,165 @@
+#include "Trace.h"
+#include <stdio.h>
+#include <string.h>
+#include <mutex>
+#include <chrono>
+
+/* ---------------------------------------------------------- */
+/* ------------------------- STRUCTS ------------------------ */
+/* ---------------------------------------------------------- */
+
+typedef struct trace_buffer_s {
+	struct trace_buffer_s* next_buf;
+	struct trace_buffer_s* prev_buf;
+
+	/* only contended while trace is being opened or closed */
+	std::mutex buf_mutex;
+
+	unsigned int num;              // records in buffer
+	uint8_t thread;
+	trace_record_t records[TRACE_BUFFER_RECORDS];
+} trace_buffer_t;
+
+/* buffer of thread is made on its first record, written and freed on thread exit */
+class trace_thread_buffer_t {
+public:
+	trace_buffer_t* bufp;
+
+	~trace_thread_buffer_t();
+};
+
+/* ---------------------------------------------------------- */
+/* ------------------------- GLOBALS ------------------------ */
+/* ---------------------------------------------------------- */
+
+std::atomic<int> trace_on;
+
+/* steady clock ns of trace start */
+static std::atomic<int64_t> trace_begin_ns;
+
+/* lock order: trace_list_mutex -> buf_mutex -> trace_file_mutex */
+static std::mutex trace_list_mutex;
+static trace_buffer_t* trace_buffers;   // guarded by trace_list_mutex
+static unsigned int trace_threads;      // guarded by trace_list_mutex
+
+static std::mutex trace_file_mutex;
+static FILE* trace_file;                // guarded by trace_file_mutex
+static size_t trace_written;            // guarded by trace_file_mutex
+
+static thread_local trace_thread_buffer_t trace_thread_buffer;
+
+/* ---------------------------------------------------------- */
+/* -------------------------- TRACE ------------------------- */
+/* ---------------------------------------------------------- */
+
+int64_t trace_now_ns() {
+	return std::chrono::duration_cast<std::chrono::nanoseconds>(
+		std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+/* writes records of buffer to file, or drops them if file is closed (inside buf CS) */
+void trace_flush(trace_buffer_t* bufp) {
+	std::lock_guard<std::mutex> lock(trace_file_mutex);
+
+	if (trace_file != nullptr && bufp->num > 0) {
+		trace_written += fwrite(bufp->records, sizeof(trace_record_t), bufp->num, trace_file);
+	}
+	bufp->num = 0;
+}
+
+trace_buffer_t* trace_buffer_register() {
+	trace_buffer_t* bufp = new trace_buffer_t();
+	bufp->num = 0;
+	bufp->prev_buf = nullptr;
+
+	std::lock_guard<std::mutex> lock(trace_list_mutex);
+	bufp->thread = (uint8_t)trace_threads++;
+	bufp->next_buf = trace_buffers;
+	if (trace_buffers != nullptr) trace_buffers->prev_buf = bufp;
+	trace_buffers = bufp;
+
+	return bufp;
+}
+
+trace_thread_buffer_t::~trace_thread_buffer_t() {
+	if (bufp == nullptr) return;
+
+	std::lock_guard<std::mutex> lock(trace_list_mutex);
+
+	bufp->buf_mutex.lock();
+	trace_flush(bufp);
+	bufp->buf_mutex.unlock();
+
+	if (bufp->prev_buf != nullptr) bufp->prev_buf->next_buf = bufp->next_buf;
+	else trace_buffers = bufp->next_buf;
+	if (bufp->next_buf != nullptr) bufp->next_buf->prev_buf = bufp->prev_buf;
+
+	delete bufp;
+}
+
+void trace_record(int op, unsigned cache, size_t size, const void* objp) {
+	trace_buffer_t* bufp = trace_thread_buffer.bufp;
+	if (bufp == nullptr) bufp = trace_thread_buffer.bufp = trace_buffer_register();
+
+	int64_t now = trace_now_ns();
+
+	std::lock_guard<std::mutex> lock(bufp->buf_mutex);
+
+	trace_record_t* recp = &bufp->records[bufp->num++];
+	recp->time_ns = (uint64_t)(now - trace_begin_ns.load(std::memory_order_relaxed));
+	recp->objp = (uint64_t)(uintptr_t)objp;
+	recp->size = (size > UINT32_MAX) ? UINT32_MAX : (uint32_t)size;
+	recp->cache = (uint16_t)cache;
+	recp->op = (uint8_t)op;
+	recp->thread = bufp->thread;
+
+	if (bufp->num == TRACE_BUFFER_RECORDS) trace_flush(bufp);
+}
+
+int trace_open(const char* path, size_t block_size) {
+	std::lock_guard<std::mutex> lock(trace_list_mutex);
+
+	if (trace_on.load(std::memory_order_relaxed)) return -1;
+
+	/* records left by operations that raced with previous close are dropped */
+	for (trace_buffer_t* bufp = trace_buffers; bufp != nullptr; bufp = bufp->next_buf) {
+		std::lock_guard<std::mutex> buf_lock(bufp->buf_mutex);
+		bufp->num = 0;
+	}
+
+	std::lock_guard<std::mutex> file_lock(trace_file_mutex);
+
+	trace_file = fopen(path, "wb");
+	if (trace_file == nullptr) return -1;
+
+	trace_header_t header;
+	memcpy(header.magic, TRACE_MAGIC, sizeof(header.magic));
+	header.record_size = sizeof(trace_record_t);
+	header.block_size = (uint32_t)block_size;
+	fwrite(&header, sizeof(header), 1, trace_file);
+	trace_written = 0;
+
+	trace_begin_ns.store(trace_now_ns(), std::memory_order_relaxed);
+	trace_on.store(1, std::memory_order_release);
+
+	return 0;
+}
+
+size_t trace_close() {
+	std::lock_guard<std::mutex> lock(trace_list_mutex);
+
+	if (trace_on.load(std::memory_order_relaxed) == 0) return 0;
+	trace_on.store(0, std::memory_order_release);
+
+	for (trace_buffer_t* bufp = trace_buffers; bufp != nullptr; bufp = bufp->next_buf) {
+		std::lock_guard<std::mutex> buf_lock(bufp->buf_mutex);
+		trace_flush(bufp);
+	}
+
+	std::lock_guard<std::mutex> file_lock(trace_file_mutex);
+
+	fclose(trace_file);
+	trace_file = nullptr;
+
+	return trace_written;
+}
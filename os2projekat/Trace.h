@@ -0,0 +1,55 @@
+#pragma once
+#include <stddef.h>
+#include <stdint.h>
+#include <atomic>
+
+/* trace file starts with header, records of all threads follow in the */
+/* order their buffers were flushed, replay sorts them by time          */
+#define TRACE_MAGIC "KMTRACE1"
+
+/* records kept per thread before they are written to file */
+#define TRACE_BUFFER_RECORDS (4096)
+
+/* traced operations */
+#define TRACE_CACHE_CREATE (1)   // cache, size = object size, objp = cache
+#define TRACE_CACHE_DESTROY (2)  // cache, objp = cache
+#define TRACE_CACHE_ALLOC (3)    // cache, size = object size, objp
+#define TRACE_CACHE_FREE (4)     // cache, size = object size, objp
+#define TRACE_KMALLOC (5)        // size, objp
+#define TRACE_KFREE (6)          // objp
+#define TRACE_KREALLOC (7)       // size = new size, objp (only resize in place, moves are kmalloc + kfree)
+#define TRACE_BMALLOC (8)        // size, objp
+#define TRACE_BFREE (9)          // objp
+
+typedef struct trace_header_s {
+	char magic[8];                 // TRACE_MAGIC
+	uint32_t record_size;          // sizeof(trace_record_t)
+	uint32_t block_size;           // BLOCK_SIZE of traced program
+} trace_header_t;
+
+/* 24 bytes, objp is address at capture time and identifies object until */
+/* it's freed, failed allocations have objp 0                             */
+typedef struct trace_record_s {
+	uint64_t time_ns;              // since trace start, taken after allocation and before free
+	uint64_t objp;
+	uint32_t size;                 // saturated at UINT32_MAX
+	uint16_t cache;                // trace id of cache, 0 for non cache operations
+	uint8_t op;
+	uint8_t thread;                // index of capturing thread (mod 256)
+} trace_record_t;
+
+extern std::atomic<int> trace_on;
+
+/* checked on every traced operation, records are written only while it's set */
+inline int trace_enabled() {
+	return trace_on.load(std::memory_order_acquire);
+}
+
+/* Appends record to buffer of calling thread, full buffer is written to file (thread safe) */
+void trace_record(int op, unsigned cache, size_t size, const void* objp);
+
+/* Creates trace file and sets trace_on, returns 0 on success, -1 if trace is on or file can't be made (thread safe) */
+int trace_open(const char* path, size_t block_size);
+
+/* Clears trace_on, writes buffers of all threads and closes file, returns number of written records (thread safe) */
+size_t trace_close();
@@ -0,0 +1,73 @@
+#pragma once
+#include <new>
+#include <utility>
+#include "slab.h"
+
+namespace kmem {
+
+/* options of TypedCache, same as kmem_cache_create arguments */
+template <unsigned int MagSize = KMEM_DEFAULT_MAG_SIZE, unsigned int Flags = 0, size_t Align = 0>
+struct CacheOptions {
+	static constexpr unsigned int mag_size = MagSize;
+	static constexpr unsigned int flags = Flags;
+	static constexpr size_t align = Align;
+};
+
+/* type-safe cache of objects of type T, objects are constructed by create and */
+/* destroyed by destroy, so cache has no ctor/dtor and no call goes through a   */
+/* function pointer. size and alignment of T are checked at compile time        */
+template <typename T, typename Options = CacheOptions<>>
+class TypedCache {
+public:
+	static constexpr size_t obj_size = sizeof(T);
+
+	/* alignof(T) is kept even if options ask for less */
+	static constexpr size_t obj_align = (Options::align > alignof(T)) ? Options::align : alignof(T);
+
+	static_assert(kmem_cache_align(obj_align, Options::flags) != 0, "alignment must be a power of two up to BLOCK_SIZE");
+	static_assert(kmem_cache_geometry(obj_size, obj_align, Options::flags).num > 0, "object does not fit in slab");
+
+	explicit TypedCache(const char* name)
+		: cachep(kmem_cache_create(name, obj_size, nullptr, nullptr, Options::mag_size, Options::flags, obj_align)) {}
+
+	/* all objects must be destroyed before cache */
+	~TypedCache() { kmem_cache_destroy(cachep); }
+
+	TypedCache(const TypedCache&) = delete;
+	TypedCache& operator=(const TypedCache&) = delete;
+
+	/* Allocates object and constructs it from args, nullptr if there is no memory */
+	template <typename... Args>
+	T* create(Args&&... args) {
+		void* objp = alloc();
+		if (objp == nullptr) return nullptr;
+
+		/* memory goes back to cache if constructor throws */
+		try {
+			return new (objp) T(std::forward<Args>(args)...);
+		}
+		catch (...) {
+			free(objp);
+			throw;
+		}
+	}
+
+	/* Destroys object and returns its memory to cache */
+	void destroy(T* objp) {
+		if (objp == nullptr) return;
+		objp->~T();
+		free(objp);
+	}
+
+	/* Raw memory of one object, not constructed */
+	void* alloc() { return kmem_cache_alloc(cachep); }
+	void free(void* objp) { kmem_cache_free(cachep, objp); }
+
+	/* nullptr if cache could not be created (e.g. name is taken) */
+	kmem_cache_t* cache() const { return cachep; }
+
+private:
+	kmem_cache_t* cachep;
+};
+
+}
@@ -0,0 +1,343 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <thread>
+#include <chrono>
+#include <atomic>
+#include <vector>
+#include <algorithm>
+#include "Buddy.h"
+#include "slab.h"
+
+#ifdef __linux__
+#include <malloc.h>
+#endif
+
+/* Linux build:                                                        */
+/*   g++ -std=c++17 -O2 -pthread -DALLOC_BENCH BitMapTree.cpp Buddy.cpp */
+/*       Trace.cpp slab.cpp alloc_bench.cpp -o alloc_bench              */
+/*   ./alloc_bench        table                                         */
+/*   ./alloc_bench csv    one line per run, for regression scripts      */
+
+#define ALLOC_BENCH_BLOCK_NUMBER ((size_t)1 << 18)  // 1 GiB own arena
+#define ALLOC_BENCH_OPS (100000)        // allocations per thread
+#define ALLOC_BENCH_SAMPLE (4)          // every 4th operation is timed
+#define ALLOC_BENCH_BATCH (64)          // LIFO/FIFO batch
+#define ALLOC_BENCH_SLOTS (1024)        // random working set per thread
+#define ALLOC_BENCH_LONG_LIVED (4096)   // long-lived objects per thread
+#define ALLOC_BENCH_QUEUE (1024)        // producer-consumer ring
+#define ALLOC_BENCH_MAX_THREADS (8)
+
+//#define ALLOC_BENCH
+
+typedef struct bench_allocator_s {
+	const char* name;
+	void* (*alloc)(size_t size);
+	void (*free)(void* objp);
+} bench_allocator_t;
+
+/* kmem_cache_alloc runs use one cache of the run object size */
+static kmem_cache_t* bench_cachep;
+
+void* bench_cache_alloc(size_t) { return kmem_cache_alloc(bench_cachep); }
+void bench_cache_free(void* objp) { kmem_cache_free(bench_cachep, objp); }
+void* bench_kmalloc(size_t size) { return kmalloc(size); }
+void bench_kfree(void* objp) { kfree(objp); }
+void* bench_bmalloc(size_t size) { return bmalloc(size); }
+void bench_bfree(void* objp) { bfree(objp); }
+void* bench_malloc(size_t size) { return malloc(size); }
+void bench_libc_free(void* objp) { free(objp); }
+
+static const bench_allocator_t bench_allocators[] = {
+	{ "kmem_cache", bench_cache_alloc, bench_cache_free },
+	{ "kmalloc", bench_kmalloc, bench_kfree },
+	{ "bmalloc", bench_bmalloc, bench_bfree },
+	{ "malloc", bench_malloc, bench_libc_free },
+};
+
+typedef struct bench_thread_s {
+	std::vector<uint32_t> lat;  // ns of timed operations
+	uint64_t ops;               // allocations and frees
+	uint32_t rand;              // xorshift state
+	int failed;
+} bench_thread_t;
+
+static const bench_allocator_t* bench_allocator;
+static size_t bench_size;
+
+uint32_t bench_rand(bench_thread_t* tp) {
+	tp->rand ^= tp->rand << 13;
+	tp->rand ^= tp->rand >> 17;
+	tp->rand ^= tp->rand << 5;
+	return tp->rand;
+}
+
+void* bench_alloc(bench_thread_t* tp) {
+	void* objp;
+
+	if ((++tp->ops % ALLOC_BENCH_SAMPLE) != 0) objp = bench_allocator->alloc(bench_size);
+	else {
+		auto begin = std::chrono::steady_clock::now();
+		objp = bench_allocator->alloc(bench_size);
+		auto end = std::chrono::steady_clock::now();
+		tp->lat.push_back((uint32_t)std::chrono::duration_cast<std::chrono::nanoseconds>(end - begin).count());
+	}
+
+	/* object is touched, as a real user would */
+	if (objp == nullptr) tp->failed = 1;
+	else *(volatile char*)objp = 1;
+
+	return objp;
+}
+
+void bench_free(bench_thread_t* tp, void* objp) {
+	if (objp == nullptr) return;
+
+	if ((++tp->ops % ALLOC_BENCH_SAMPLE) != 0) bench_allocator->free(objp);
+	else {
+		auto begin = std::chrono::steady_clock::now();
+		bench_allocator->free(objp);
+		auto end = std::chrono::steady_clock::now();
+		tp->lat.push_back((uint32_t)std::chrono::duration_cast<std::chrono::nanoseconds>(end - begin).count());
+	}
+}
+
+/* ---------------------------------------------------------- */
+/* ------------------------ PATTERNS ------------------------ */
+/* ---------------------------------------------------------- */
+
+void bench_lifo(bench_thread_t* tp, int) {
+	void* objs[ALLOC_BENCH_BATCH];
+	for (int i = 0; i < ALLOC_BENCH_OPS / ALLOC_BENCH_BATCH; i++) {
+		for (int j = 0; j < ALLOC_BENCH_BATCH; j++) objs[j] = bench_alloc(tp);
+		for (int j = ALLOC_BENCH_BATCH - 1; j >= 0; j--) bench_free(tp, objs[j]);
+	}
+}
+
+void bench_fifo(bench_thread_t* tp, int) {
+	void* objs[ALLOC_BENCH_BATCH];
+	for (int i = 0; i < ALLOC_BENCH_OPS / ALLOC_BENCH_BATCH; i++) {
+		for (int j = 0; j < ALLOC_BENCH_BATCH; j++) objs[j] = bench_alloc(tp);
+		for (int j = 0; j < ALLOC_BENCH_BATCH; j++) bench_free(tp, objs[j]);
+	}
+}
+
+void bench_random(bench_thread_t* tp, int) {
+	std::vector<void*> slots(ALLOC_BENCH_SLOTS, nullptr);
+	for (int i = 0; i < ALLOC_BENCH_OPS; i++) {
+		uint32_t j = bench_rand(tp) % ALLOC_BENCH_SLOTS;
+		bench_free(tp, slots[j]);
+		slots[j] = bench_alloc(tp);
+	}
+	for (int j = 0; j < ALLOC_BENCH_SLOTS; j++) bench_free(tp, slots[j]);
+}
+
+/* 1 of 16 objects lives long, the rest is freed right away */
+void bench_mixed(bench_thread_t* tp, int) {
+	std::vector<void*> long_lived(ALLOC_BENCH_LONG_LIVED, nullptr);
+	unsigned next = 0;
+	for (int i = 0; i < ALLOC_BENCH_OPS; i++) {
+		void* objp = bench_alloc(tp);
+		if (bench_rand(tp) % 16 == 0) {
+			bench_free(tp, long_lived[next]);
+			long_lived[next] = objp;
+			next = (next + 1) % ALLOC_BENCH_LONG_LIVED;
+		}
+		else bench_free(tp, objp);
+	}
+	for (int j = 0; j < ALLOC_BENCH_LONG_LIVED; j++) bench_free(tp, long_lived[j]);
+}
+
+/* single producer single consumer ring, objects are freed by the other thread */
+typedef struct bench_queue_s {
+	void* objs[ALLOC_BENCH_QUEUE];
+	std::atomic<size_t> head;  // written by consumer
+	std::atomic<size_t> tail;  // written by producer
+} bench_queue_t;
+
+static bench_queue_t bench_queues[ALLOC_BENCH_MAX_THREADS / 2];
+
+void bench_producer_consumer(bench_thread_t* tp, int id) {
+	bench_queue_t* qp = &bench_queues[id / 2];
+
+	if (id % 2 == 0) {
+		for (int i = 0; i < ALLOC_BENCH_OPS; i++) {
+			void* objp = bench_alloc(tp);
+			size_t tail = qp->tail.load(std::memory_order_relaxed);
+			while (tail - qp->head.load(std::memory_order_acquire) == ALLOC_BENCH_QUEUE) std::this_thread::yield();
+			qp->objs[tail % ALLOC_BENCH_QUEUE] = objp;
+			qp->tail.store(tail + 1, std::memory_order_release);
+		}
+	}
+	else {
+		for (int i = 0; i < ALLOC_BENCH_OPS; i++) {
+			size_t head = qp->head.load(std::memory_order_relaxed);
+			while (qp->tail.load(std::memory_order_acquire) == head) std::this_thread::yield();
+			void* objp = qp->objs[head % ALLOC_BENCH_QUEUE];
+			qp->head.store(head + 1, std::memory_order_release);
+			bench_free(tp, objp);
+		}
+	}
+}
+
+typedef struct bench_pattern_s {
+	const char* name;
+	void (*run)(bench_thread_t* tp, int id);
+	int min_threads;
+} bench_pattern_t;
+
+static const bench_pattern_t bench_patterns[] = {
+	{ "lifo", bench_lifo, 1 },
+	{ "fifo", bench_fifo, 1 },
+	{ "random", bench_random, 1 },
+	{ "mixed", bench_mixed, 1 },
+	{ "prod-cons", bench_producer_consumer, 2 },
+};
+
+static const size_t bench_sizes[] = { 32, 256, 4096 };
+
+/* ---------------------------------------------------------- */
+/* -------------------------- RUN --------------------------- */
+/* ---------------------------------------------------------- */
+
+/* returns VmRSS or VmHWM of this process in KiB, 0 if unknown */
+size_t bench_status_kib(const char* field) {
+	size_t kib = 0;
+#ifdef __linux__
+	char line[256];
+	FILE* f = fopen("/proc/self/status", "r");
+	if (f == nullptr) return 0;
+	while (fgets(line, sizeof(line), f) != nullptr) {
+		if (strncmp(line, field, strlen(field)) == 0) {
+			sscanf(line + strlen(field) + 1, "%zu", &kib);
+			break;
+		}
+	}
+	fclose(f);
+#endif
+	return kib;
+}
+
+/* peak RSS is reset to current RSS (Linux 4.0+) */
+void bench_reset_peak() {
+#ifdef __linux__
+	FILE* f = fopen("/proc/self/clear_refs", "w");
+	if (f == nullptr) return;
+	fputs("5", f);
+	fclose(f);
+#endif
+}
+
+typedef struct bench_result_s {
+	double ops_per_sec;
+	uint32_t p50, p99, p999;
+	size_t peak_kib;      // peak RSS above RSS at the start of run
+	int failed;
+} bench_result_t;
+
+bench_result_t bench_run(const bench_allocator_t* ap, const bench_pattern_t* pp, size_t size, int threads_num) {
+	bench_result_t res = { 0, 0, 0, 0, 0, 0 };
+
+	bench_allocator = ap;
+	bench_size = size;
+	if (ap->alloc == bench_cache_alloc) bench_cachep = kmem_cache_create("alloc bench", size, nullptr, nullptr);
+
+	for (int i = 0; i < ALLOC_BENCH_MAX_THREADS / 2; i++) {
+		bench_queues[i].head = 0;
+		bench_queues[i].tail = 0;
+	}
+
+	std::vector<bench_thread_t> tds(threads_num);
+	for (int i = 0; i < threads_num; i++) {
+		tds[i].lat.reserve(2 * ALLOC_BENCH_OPS / ALLOC_BENCH_SAMPLE + 2 * ALLOC_BENCH_SLOTS);
+		tds[i].ops = 0;
+		tds[i].rand = 2463534242u + i;
+		tds[i].failed = 0;
+	}
+
+	size_t rss = bench_status_kib("VmRSS");
+	bench_reset_peak();
+
+	std::vector<std::thread> threads;
+	auto begin = std::chrono::steady_clock::now();
+
+	for (int i = 0; i < threads_num; i++) threads.push_back(std::thread(pp->run, &tds[i], i));
+	for (int i = 0; i < threads_num; i++) threads[i].join();
+
+	auto end = std::chrono::steady_clock::now();
+
+	size_t peak = bench_status_kib("VmHWM");
+	res.peak_kib = (peak > rss) ? peak - rss : 0;
+
+	std::vector<uint32_t> lat;
+	uint64_t ops = 0;
+	for (int i = 0; i < threads_num; i++) {
+		lat.insert(lat.end(), tds[i].lat.begin(), tds[i].lat.end());
+		ops += tds[i].ops;
+		if (tds[i].failed) res.failed = 1;
+	}
+
+	res.ops_per_sec = ops / std::chrono::duration<double>(end - begin).count();
+	std::sort(lat.begin(), lat.end());
+	if (!lat.empty()) {
+		res.p50 = lat[lat.size() / 2];
+		res.p99 = lat[lat.size() * 99 / 100];
+		res.p999 = lat[lat.size() * 999 / 1000];
+	}
+
+	/* memory goes back to the OS, so next run starts from the same RSS, */
+	/* second reap returns depot magazines left by exited threads        */
+	if (ap->alloc == bench_cache_alloc) kmem_cache_destroy(bench_cachep);
+	kmem_reap();
+	kmem_reap();
+	kmem_release(0);
+#ifdef __linux__
+	malloc_trim(0);
+#endif
+
+	return res;
+}
+
+#ifdef ALLOC_BENCH
+
+int main(int argc, char** argv) {
+	int csv = (argc > 1 && strcmp(argv[1], "csv") == 0);
+
+	/* own arena, so freed memory can be returned to the OS between runs */
+	kmem_init(nullptr, ALLOC_BENCH_BLOCK_NUMBER, KMEM_OWN_ARENA);
+
+	/* kmem_reap between runs frees all empty slabs and unused magazines */
+	kmem_reaper_settings_t settings;
+	kmem_reaper_get(&settings);
+	settings.empty_low = 0;
+	settings.empty_high = 0;
+	settings.age_ms = 0;
+	kmem_reaper_set(&settings);
+
+	if (csv) printf("allocator,pattern,size,threads,ops_per_sec,p50_ns,p99_ns,p999_ns,peak_rss_kib\n");
+	else printf("%-11s %-10s %-6s %-8s %-12s %-8s %-8s %-8s %-10s\n",
+		"allocator", "pattern", "size", "threads", "ops/sec", "p50 ns", "p99 ns", "p99.9 ns", "peak KiB");
+
+	int failed = 0;
+
+	for (const bench_pattern_t& pattern : bench_patterns) {
+		for (size_t size : bench_sizes) {
+			for (int threads_num = pattern.min_threads; threads_num <= ALLOC_BENCH_MAX_THREADS; threads_num <<= 1) {
+				for (const bench_allocator_t& allocator : bench_allocators) {
+					bench_result_t res = bench_run(&allocator, &pattern, size, threads_num);
+					if (res.failed) failed = 1;
+
+					if (csv) printf("%s,%s,%zu,%d,%.0f,%u,%u,%u,%zu\n", allocator.name, pattern.name, size, threads_num,
+						res.ops_per_sec, res.p50, res.p99, res.p999, res.peak_kib);
+					else printf("%-11s %-10s %-6zu %-8d %-12.0f %-8u %-8u %-8u %-10zu%s\n", allocator.name, pattern.name, size, threads_num,
+						res.ops_per_sec, res.p50, res.p99, res.p999, res.peak_kib, res.failed ? " FAILED" : "");
+				}
+			}
+		}
+	}
+
+	return failed;
+}
+
+#endif
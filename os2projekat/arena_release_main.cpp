@@ -0,0 +1,73 @@
+#include <stdio.h>
+#include <string.h>
+#include <thread>
+#include <chrono>
+#include "Buddy.h"
+#include "slab.h"
+
+/* 1 GiB own arena */
+#define RELEASE_BLOCK_NUMBER ((size_t)1 << 18)
+#define RELEASE_OBJS (800000)
+#define RELEASE_OBJ_SIZE (256)  // slab descriptor is kept on slab
+
+//#define ARENA_RELEASE_MAIN
+
+size_t resident_kib() {
+#ifdef __linux__
+	size_t pages = 0, resident = 0;
+	FILE* f = fopen("/proc/self/statm", "r");
+	if (f == nullptr) return 0;
+	if (fscanf(f, "%zu %zu", &pages, &resident) != 2) resident = 0;
+	fclose(f);
+	return resident * 4;
+#else
+	return 0;
+#endif
+}
+
+#ifdef ARENA_RELEASE_MAIN
+
+void* release_objs[RELEASE_OBJS];
+
+int main() {
+	kmem_init(nullptr, RELEASE_BLOCK_NUMBER, KMEM_OWN_ARENA | KMEM_HUGEPAGES);
+
+	printf("after init:   %8zu KiB resident\n", resident_kib());
+
+	/* traffic spike, every object is touched */
+	kmem_cache_t* cachep = kmem_cache_create("spike", RELEASE_OBJ_SIZE, nullptr, nullptr);
+	for (int i = 0; i < RELEASE_OBJS; i++) {
+		release_objs[i] = kmem_cache_alloc(cachep);
+		if (release_objs[i] != nullptr) memset(release_objs[i], 0x5A, RELEASE_OBJ_SIZE);
+	}
+
+	size_t spike = resident_kib();
+	printf("after spike:  %8zu KiB resident\n", spike);
+
+	for (int i = 0; i < RELEASE_OBJS; i++) kmem_cache_free(cachep, release_objs[i]);
+
+	/* magazines are drained and empty slabs go back to buddy, */
+	/* but blocks are not old enough to be released yet        */
+	kmem_cache_shrink(cachep);
+	printf("after shrink: %8zu KiB resident\n", resident_kib());
+
+	std::this_thread::sleep_for(std::chrono::milliseconds(KMEM_RELEASE_AGE_MS + 100));
+
+	size_t released = kmem_release();
+	size_t after = resident_kib();
+	printf("released %zu KiB\n", released >> 10);
+	printf("after release:%8zu KiB resident\n", after);
+
+	/* released memory can be used again */
+	void* objp = kmem_cache_alloc(cachep);
+	int failed = (objp == nullptr);
+	kmem_cache_free(cachep, objp);
+	kmem_cache_destroy(cachep);
+
+	if (released == 0 || after >= spike) failed = 1;
+
+	printf(failed ? "FAILED\n" : "OK\n");
+	return failed;
+}
+
+#endif
@@ -0,0 +1,119 @@
+#include <stdio.h>
+#include <string.h>
+#include "Buddy.h"
+#include "slab.h"
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#endif
+
+/* 64 GiB arena, pages are committed only when touched */
+#define BIG_ARENA_SIZE ((size_t)64 << 30)
+#define BIG_BLOCK_NUMBER (BIG_ARENA_SIZE / BLOCK_SIZE)
+
+//#define BIG_ARENA_MAIN
+
+void* big_arena_map(size_t size) {
+#ifdef _WIN32
+	return VirtualAlloc(nullptr, size, MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE);
+#else
+	void* space = mmap(nullptr, size, PROT_READ | PROT_WRITE,
+		MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+	return (space == MAP_FAILED) ? nullptr : space;
+#endif
+}
+
+#ifdef BIG_ARENA_MAIN
+
+int main() {
+	void* space = big_arena_map(BIG_ARENA_SIZE);
+	if (space == nullptr) {
+		printf("can't map %zu bytes\n", BIG_ARENA_SIZE);
+		return 1;
+	}
+
+	kmem_init(space, BIG_BLOCK_NUMBER);
+
+	int failed = 0;
+
+	/* first quarter holds buddy structs and block to slab mapping, last one */
+	/* is partly lost to them too, so two 16 GiB blocks are fully free.      */
+	/* both lie past 4 GiB offset, so truncated pointers would show here    */
+	size_t big_size = (size_t)16 << 30;
+	char* big[2];
+	for (int i = 0; i < 2; i++) {
+		big[i] = (char*)bmalloc(big_size);
+		if (big[i] == nullptr) {
+			printf("bmalloc of 16 GiB #%d failed\n", i);
+			failed = 1;
+			continue;
+		}
+
+		/* touch first and last page only */
+		memset(big[i], i + 1, BLOCK_SIZE);
+		memset(big[i] + big_size - BLOCK_SIZE, i + 1, BLOCK_SIZE);
+		printf("16 GiB block #%d at offset %zu GiB\n", i, (size_t)(big[i] - (char*)space) >> 30);
+	}
+
+	/* use up free blocks below 4 GiB offset, so slabs are placed above it */
+	size_t low_blocks = 0;
+	for (int pow = 20; pow >= 0; pow--) {
+		void* blockp;
+		while ((blockp = buddy_alloc(pow)) != nullptr) {
+			if ((size_t)((char*)blockp - (char*)space) >= ((size_t)4 << 30)) {
+				bfree(blockp);
+				break;
+			}
+			low_blocks++;
+		}
+	}
+	printf("%zu blocks below 4 GiB offset are taken\n", low_blocks);
+
+	kmem_cache_t* cachep = kmem_cache_create("big-arena test", 200, nullptr, nullptr);
+	void* objs[1000];
+	for (int i = 0; i < 1000; i++) {
+		objs[i] = kmem_cache_alloc(cachep);
+		if (objs[i] == nullptr) failed = 1;
+		else memset(objs[i], 0xAB, 200);
+	}
+
+	void* buffers[100];
+	for (int i = 0; i < 100; i++) {
+		buffers[i] = kmalloc(32 << (i % 13));
+		if (buffers[i] == nullptr) failed = 1;
+	}
+
+	printf("slab object at offset %zu GiB\n", (size_t)((char*)objs[0] - (char*)space) >> 30);
+	if ((size_t)((char*)objs[0] - (char*)space) < ((size_t)4 << 30)) failed = 1;
+
+	for (int i = 0; i < 100; i++) kfree(buffers[i]);
+	for (int i = 0; i < 1000; i++) kmem_cache_free(cachep, objs[i]);
+
+	kmem_cache_info(cachep);
+	if (kmem_cache_error(cachep)) failed = 1;
+	kmem_cache_destroy(cachep);
+
+	/* first and last page must keep their contents */
+	for (int i = 0; i < 2; i++) {
+		if (big[i] == nullptr) continue;
+		if (big[i][0] != i + 1 || big[i][big_size - 1] != i + 1) {
+			printf("16 GiB block #%d corrupted\n", i);
+			failed = 1;
+		}
+		bfree(big[i]);
+	}
+
+	/* everything is merged back, so 16 GiB can be allocated again */
+	void* again = bmalloc(big_size);
+	if (again == nullptr) failed = 1;
+	bfree(again);
+
+	/* arena is not unmapped, magazines of this thread are released on exit */
+
+	printf(failed ? "FAILED\n" : "OK\n");
+	return failed;
+}
+
+#endif
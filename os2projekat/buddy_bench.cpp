@@ -0,0 +1,62 @@
+#include <stdio.h>
+#include "Buddy.h"
+#include <thread>
+#include <chrono>
+#include <vector>
+#include "slab.h"
+
+#define BENCH_BLOCK_NUMBER (1<<14)
+#define BENCH_MAX_THREADS (16)
+#define BENCH_OPS (200000)  // bmalloc/bfree pairs per thread
+#define BENCH_BATCH (16)    // blocks held by thread at once
+
+//#define BUDDY_BENCH
+
+void bench_worker(int id) {
+
+	void* ptrs[BENCH_BATCH];
+
+	/* each thread uses different orders, so they don't meet on same list */
+	int size = (1 << (id % 4))*BLOCK_SIZE;
+
+	for (int i = 0; i < BENCH_OPS / BENCH_BATCH; i++) {
+		for (int j = 0; j < BENCH_BATCH; j++) ptrs[j] = bmalloc(size);
+		for (int j = 0; j < BENCH_BATCH; j++) bfree(ptrs[j]);
+	}
+}
+
+#ifdef BUDDY_BENCH
+
+int main() {
+	void *space = malloc(BLOCK_SIZE * BENCH_BLOCK_NUMBER);
+	size_t block_number = BENCH_BLOCK_NUMBER;
+
+	buddy_init(space, &block_number);
+
+	printf("%-8s %-12s %-12s\n", "threads", "ops/sec", "speedup");
+
+	double base = 0;
+
+	for (int n = 1; n <= BENCH_MAX_THREADS; n <<= 1) {
+		std::vector<std::thread> threads;
+
+		auto begin = std::chrono::steady_clock::now();
+
+		for (int i = 0; i < n; i++) threads.push_back(std::thread(bench_worker, i));
+		for (int i = 0; i < n; i++) threads[i].join();
+
+		auto end = std::chrono::steady_clock::now();
+
+		double sec = std::chrono::duration<double>(end - begin).count();
+		double ops = 2.0 * BENCH_OPS * n / sec;
+		if (n == 1) base = ops;
+
+		printf("%-8d %-12.0f %-12.2f\n", n, ops, ops / base);
+	}
+
+	free(space);
+
+	return 0;
+}
+
+#endif
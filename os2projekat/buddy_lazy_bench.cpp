@@ -0,0 +1,70 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include "Buddy.h"
+#include <thread>
+#include <chrono>
+#include <vector>
+#include "slab.h"
+
+#define LAZY_BENCH_BLOCK_NUMBER (1<<14)
+#define LAZY_BENCH_MAX_THREADS (4)
+#define LAZY_BENCH_OPS (400000)  // bmalloc/bfree pairs per thread
+#define LAZY_BENCH_BATCH (8)     // blocks held by thread at once, below watermark
+
+//#define BUDDY_LAZY_BENCH
+
+void lazy_bench_worker(int id) {
+
+	void* ptrs[LAZY_BENCH_BATCH];
+
+	/* slab-like churn: same small orders are freed and allocated again */
+	for (int i = 0; i < LAZY_BENCH_OPS / LAZY_BENCH_BATCH; i++) {
+		for (int j = 0; j < LAZY_BENCH_BATCH; j++) ptrs[j] = buddy_alloc((id + j) % 3);
+		for (int j = 0; j < LAZY_BENCH_BATCH; j++) bfree(ptrs[j]);
+	}
+}
+
+double lazy_bench_run(int mode, int n) {
+	void *space = malloc(BLOCK_SIZE * LAZY_BENCH_BLOCK_NUMBER);
+	size_t block_number = LAZY_BENCH_BLOCK_NUMBER;
+
+	buddy_init(space, &block_number, mode);
+
+	std::vector<std::thread> threads;
+
+	auto begin = std::chrono::steady_clock::now();
+
+	for (int i = 0; i < n; i++) threads.push_back(std::thread(lazy_bench_worker, i));
+	for (int i = 0; i < n; i++) threads[i].join();
+
+	auto end = std::chrono::steady_clock::now();
+
+	/* large order request must still succeed after churn */
+	int pow = 0;
+	while (((size_t)2 << pow) <= block_number) pow++;
+	void* big = buddy_alloc(pow - 1);
+	if (big == nullptr) printf("order %d alloc failed after churn\n", pow - 1);
+	bfree(big);
+
+	free(space);
+
+	double sec = std::chrono::duration<double>(end - begin).count();
+	return 2.0 * LAZY_BENCH_OPS * n / sec;
+}
+
+#ifdef BUDDY_LAZY_BENCH
+
+int main() {
+	printf("%-8s %-14s %-14s %-12s\n", "threads", "eager ops/sec", "lazy ops/sec", "lazy/eager");
+
+	for (int n = 1; n <= LAZY_BENCH_MAX_THREADS; n <<= 1) {
+		double eager = lazy_bench_run(BUDDY_EAGER, n);
+		double lazy = lazy_bench_run(BUDDY_LAZY, n);
+
+		printf("%-8d %-14.0f %-14.0f %-12.2f\n", n, eager, lazy, lazy / eager);
+	}
+
+	return 0;
+}
+
+#endif
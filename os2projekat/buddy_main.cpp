@@ -11,7 +11,8 @@
 int main() {
 	void *space = malloc(BLOCK_SIZE * BLOCK_NUMBER);
 
-	buddy_init(space, BLOCK_NUMBER);
+	size_t block_number = BLOCK_NUMBER;
+	buddy_init(space, &block_number);
 
 	void* ptr1 = bmalloc(64);
 	if (ptr1 == nullptr) printf("not enough memory!\n");
@@ -0,0 +1,91 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <chrono>
+#include "Buddy.h"
+#include "slab.h"
+
+#define BUFCTL_BLOCK_NUMBER (1 << 15)
+#define BUFCTL_OPS (4000000)
+#define BUFCTL_BATCH (1024)
+
+//#define BUFCTL_BENCH
+
+void bufctl_ctor(void* mem) {
+	*(int*)mem = 0;
+}
+
+/* returns ns per alloc/free pair, no magazines so every call goes to slab */
+double bufctl_bench(kmem_cache_t* cachep) {
+	static void* batch[BUFCTL_BATCH];
+
+	auto begin = std::chrono::steady_clock::now();
+	for (int i = 0; i < BUFCTL_OPS / BUFCTL_BATCH; i++) {
+		for (int j = 0; j < BUFCTL_BATCH; j++) batch[j] = kmem_cache_alloc(cachep);
+		for (int j = 0; j < BUFCTL_BATCH; j++) kmem_cache_free(cachep, batch[j]);
+	}
+	auto end = std::chrono::steady_clock::now();
+
+	return std::chrono::duration<double, std::nano>(end - begin).count() / BUFCTL_OPS;
+}
+
+#ifdef BUFCTL_BENCH
+
+int main() {
+	void *space = malloc(BLOCK_SIZE * (size_t)BUFCTL_BLOCK_NUMBER);
+	kmem_init(space, BUFCTL_BLOCK_NUMBER);
+
+	int failed = 0;
+	const size_t sizes[] = { 8, 16, 32, 48, 64, 128, 256, 512 };
+
+	/* int indexes are the layout before compact encoding */
+	printf("%-6s %-22s %-22s %-22s\n", "", "int index", "narrow index (ctor)", "embedded (no ctor)");
+	printf("%-6s %-8s %-13s %-8s %-13s %-8s %-13s\n", "size", "objs", "meta", "objs", "meta", "objs", "meta");
+	for (size_t size : sizes) {
+		kmem_geometry_t narrow = kmem_cache_geometry(size, 0, 0, 1);
+		kmem_geometry_t embedded = kmem_cache_geometry(size);
+		unsigned int_pow = 0, int_num = 0;
+		kmem_cache_estimate(&int_pow, &int_num, size, sizeof(int), narrow.off_slab, KMEM_MIN_ALIGN);
+
+		printf("%-6zu", size);
+		kmem_geometry_t layouts[] = { narrow, narrow, embedded };
+		layouts[0].pow = int_pow, layouts[0].num = int_num, layouts[0].bufctl = sizeof(int);
+		for (const kmem_geometry_t& g : layouts) {
+			size_t meta = SLAB_META_SIZE(g.num, g.bufctl, g.off_slab, g.align);
+			if (g.off_slab) meta = SLAB_DESC_SIZE + g.num * g.bufctl;
+			printf(" %-8u %-5zu %5.2f%% ", g.num, meta, 100.0 * meta / SLAB_SIZE(g.pow));
+		}
+		printf("\n");
+
+		if (narrow.num < int_num || embedded.num < narrow.num) failed = 1;
+	}
+	printf("\n");
+
+	printf("%-6s %-16s %-16s\n", "size", "ns/pair ctor", "ns/pair no ctor");
+	for (size_t size : { (size_t)16, (size_t)32, (size_t)64 }) {
+		char name[CACHE_NAME_LEN];
+		snprintf(name, CACHE_NAME_LEN, "bufctl %zu", size);
+		kmem_cache_t* ctor_cachep = kmem_cache_create(name, size, bufctl_ctor, nullptr, 0);
+		snprintf(name, CACHE_NAME_LEN, "bufctl %zu embedded", size);
+		kmem_cache_t* cachep = kmem_cache_create(name, size, nullptr, nullptr, 0);
+
+		/* warm up, slabs are allocated */
+		bufctl_bench(ctor_cachep);
+		bufctl_bench(cachep);
+		printf("%-6zu %-16.1f %-16.1f\n", size, bufctl_bench(ctor_cachep), bufctl_bench(cachep));
+
+		/* geometry of created cache must match */
+		kmem_cache_stats_t stats;
+		kmem_cache_stats(cachep, &stats);
+		if (stats.objs_per_slab != kmem_cache_geometry(size).num) failed = 1;
+		kmem_cache_stats(ctor_cachep, &stats);
+		if (stats.objs_per_slab != kmem_cache_geometry(size, 0, 0, 1).num) failed = 1;
+
+		kmem_cache_destroy(ctor_cachep);
+		kmem_cache_destroy(cachep);
+	}
+
+	printf(failed ? "FAILED\n" : "OK\n");
+	return failed;
+}
+
+#endif
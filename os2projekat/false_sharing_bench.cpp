@@ -0,0 +1,129 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <thread>
+#include <chrono>
+#include <vector>
+#include "Buddy.h"
+#include "slab.h"
+
+#define FS_BLOCK_NUMBER (1 << 14)
+#define FS_THREADS (4)
+#define FS_INCREMENTS (20000000)  // per thread
+
+//#define FALSE_SHARING_BENCH
+
+/* per-thread counter, 8 bytes so eight of them fit in one packed cache line */
+typedef struct fs_counter_s {
+	volatile uint64_t value;
+} fs_counter_t;
+
+/* returns pairs of counters which share a cache line */
+int fs_shared_lines(fs_counter_t** counters, int n) {
+	int shared = 0;
+	for (int i = 0; i < n; i++)
+		for (int j = i + 1; j < n; j++)
+			if ((uintptr_t)counters[i] / CACHE_L1_LINE_SIZE == (uintptr_t)counters[j] / CACHE_L1_LINE_SIZE) shared++;
+	return shared;
+}
+
+/* each thread increments its own counter, returns ns per increment */
+double fs_run(fs_counter_t** counters) {
+	std::vector<std::thread> threads;
+
+	auto begin = std::chrono::steady_clock::now();
+	for (int t = 0; t < FS_THREADS; t++) {
+		threads.emplace_back([](fs_counter_t* cp) {
+			for (int i = 0; i < FS_INCREMENTS; i++) cp->value = cp->value + 1;
+		}, counters[t]);
+	}
+	for (auto& thread : threads) thread.join();
+	auto end = std::chrono::steady_clock::now();
+
+	return std::chrono::duration<double, std::nano>(end - begin).count() / ((double)FS_THREADS * FS_INCREMENTS);
+}
+
+/* objects of several slabs must be aligned, and stride must match geometry */
+int fs_check_align(const char* name, size_t size, size_t align, unsigned int flags) {
+	kmem_cache_t* cachep = kmem_cache_create(name, size, nullptr, nullptr, 0, flags, align);
+	if (cachep == nullptr) return 0;
+
+	kmem_geometry_t geometry = kmem_cache_geometry(size, align, flags);
+	size_t obj_align = ((flags & KMEM_CACHE_HWCACHE_ALIGN) && align < CACHE_L1_LINE_SIZE) ? CACHE_L1_LINE_SIZE : align;
+	if (obj_align == 0) obj_align = 1;
+	size_t n = 3 * (size_t)geometry.num + 1;
+	std::vector<void*> objs(n);
+	int ok = 1;
+
+	for (size_t i = 0; i < n; i++) {
+		objs[i] = kmem_cache_alloc(cachep);
+		if (objs[i] == nullptr || (uintptr_t)objs[i] % obj_align != 0) ok = 0;
+	}
+	for (size_t i = 0; i < n; i++) kmem_cache_free(cachep, objs[i]);
+
+	kmem_cache_stats_t stats;
+	kmem_cache_stats(cachep, &stats);
+	if (stats.obj_size != geometry.size || stats.objs_per_slab != geometry.num) ok = 0;
+
+	printf("%-18s size %-5zu align %-5zu stride %-5zu %4u objs/slab of 2^%u blocks, %3u colours %s\n", name, size,
+		obj_align, geometry.size, geometry.num, geometry.pow, geometry.colour_num, ok ? "" : "FAILED");
+
+	kmem_cache_destroy(cachep);
+	return ok;
+}
+
+#ifdef FALSE_SHARING_BENCH
+
+int main() {
+	void *space = malloc(BLOCK_SIZE * (size_t)FS_BLOCK_NUMBER);
+	kmem_init(space, FS_BLOCK_NUMBER);
+
+	int failed = 0;
+
+	printf("%-18s %-8s %-14s\n", "", "ns/inc", "shared lines");
+	for (unsigned flags : { 0u, (unsigned)KMEM_CACHE_HWCACHE_ALIGN }) {
+		/* counters are allocated one after another, as threads usually get them */
+		kmem_cache_t* cachep = kmem_cache_create(flags ? "counters aligned" : "counters packed", sizeof(fs_counter_t),
+			nullptr, nullptr, KMEM_DEFAULT_MAG_SIZE, flags);
+		fs_counter_t* counters[FS_THREADS];
+		for (int t = 0; t < FS_THREADS; t++) {
+			counters[t] = (fs_counter_t*)kmem_cache_alloc(cachep);
+			counters[t]->value = 0;
+		}
+
+		int shared = fs_shared_lines(counters, FS_THREADS);
+		double ns = fs_run(counters);
+		printf("%-18s %-8.2f %-14d\n", flags ? "HWCACHE_ALIGN" : "packed", ns, shared);
+
+		for (int t = 0; t < FS_THREADS; t++) {
+			if (counters[t]->value != FS_INCREMENTS) failed = 1;
+			kmem_cache_free(cachep, counters[t]);
+		}
+		if (flags && shared != 0) failed = 1;
+		kmem_cache_destroy(cachep);
+	}
+	printf("\n");
+
+	/* on and off slab descriptors, colours in align units */
+	if (!fs_check_align("hwcache 8", 8, 0, KMEM_CACHE_HWCACHE_ALIGN)) failed = 1;
+	if (!fs_check_align("hwcache 100", 100, 0, KMEM_CACHE_HWCACHE_ALIGN)) failed = 1;
+	if (!fs_check_align("align 32", 40, 32, 0)) failed = 1;
+
+	/* alignment below KMEM_MIN_ALIGN does not pad stride to it */
+	if (!fs_check_align("align 8", 24, 8, 0)) failed = 1;
+	if (kmem_cache_geometry(24, 8).size != 24) failed = 1;
+	if (!fs_check_align("align 256", 24, 256, 0)) failed = 1;
+	if (!fs_check_align("align 1024", 700, 1024, 0)) failed = 1;
+	if (!fs_check_align("align block", 100, BLOCK_SIZE, 0)) failed = 1;
+
+	/* not a power of two, larger than block */
+	if (kmem_cache_create("align 48", 8, nullptr, nullptr, 0, 0, 48) != nullptr) failed = 1;
+	if (kmem_cache_create("align 2 blocks", 8, nullptr, nullptr, 0, 0, 2 * BLOCK_SIZE) != nullptr) failed = 1;
+
+	/* space is not freed, magazines of this thread are released on exit */
+
+	printf(failed ? "FAILED\n" : "OK\n");
+	return failed;
+}
+
+#endif
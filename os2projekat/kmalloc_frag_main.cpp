@@ -0,0 +1,78 @@
+#include <stdio.h>
+#include <string.h>
+#include <random>
+#include "Buddy.h"
+#include "slab.h"
+
+#define FRAG_BLOCK_NUMBER (1 << 16)
+#define FRAG_REQUESTS (200000)
+
+//#define KMALLOC_FRAG_MAIN
+
+/* class size of power of two size-N caches kmalloc used before */
+size_t pow2_class_size(size_t size) {
+	size_t class_size = KMALLOC_MIN_SIZE;
+	while (class_size < size) class_size <<= 1;
+	return class_size;
+}
+
+/* request sizes are log-normal, median 64 B: mostly small objects, */
+/* some strings and arrays of a few KiB, rare big buffers          */
+size_t frag_request_size(std::mt19937& gen) {
+	static std::lognormal_distribution<double> dist(4.16, 1.3);
+	double size = dist(gen);
+	if (size < 1) size = 1;
+	if (size > KMALLOC_MAX_SIZE) size = KMALLOC_MAX_SIZE;
+	return (size_t)size;
+}
+
+#ifdef KMALLOC_FRAG_MAIN
+
+void* frag_objs[FRAG_REQUESTS];
+
+int main() {
+	void *space = malloc(BLOCK_SIZE * (size_t)FRAG_BLOCK_NUMBER);
+	kmem_init(space, FRAG_BLOCK_NUMBER);
+
+	int failed = 0;
+
+	/* every size maps to the smallest class it fits in */
+	for (size_t size = 1; size <= KMALLOC_MAX_SIZE; size++) {
+		unsigned i = kmalloc_index(size);
+		if (kmalloc_class_size(i) < size || (i > 0 && kmalloc_class_size(i - 1) >= size)) {
+			printf("size %zu maps to class %u (%zu B)\n", size, i, kmalloc_class_size(i));
+			failed = 1;
+			break;
+		}
+	}
+
+	std::mt19937 gen(42);
+	size_t requested = 0, pow2_used = 0, class_used = 0;
+
+	for (int i = 0; i < FRAG_REQUESTS; i++) {
+		size_t size = frag_request_size(gen);
+		requested += size;
+		pow2_used += pow2_class_size(size);
+		class_used += kmalloc_class_size(kmalloc_index(size));
+
+		frag_objs[i] = kmalloc(size);
+		if (frag_objs[i] == nullptr) failed = 1;
+		else memset(frag_objs[i], 0x5A, size);
+	}
+
+	for (int i = 0; i < FRAG_REQUESTS; i++) kfree(frag_objs[i]);
+
+	printf("%d requests, %zu KiB requested\n", FRAG_REQUESTS, requested >> 10);
+	printf("%-22s %-12s %-12s\n", "classes", "KiB used", "wasted");
+	printf("%-22s %-12zu %.2f%%\n", "power of two (13)", pow2_used >> 10,
+		100.0 * (pow2_used - requested) / pow2_used);
+	printf("%-22s %-12zu %.2f%%\n", "4 per power (47)", class_used >> 10,
+		100.0 * (class_used - requested) / class_used);
+
+	/* space is not freed, magazines of this thread are released on exit */
+
+	printf(failed ? "FAILED\n" : "OK\n");
+	return failed;
+}
+
+#endif
@@ -0,0 +1,69 @@
+#include <stdio.h>
+#include <string.h>
+#include <chrono>
+#include "Buddy.h"
+#include "slab.h"
+
+#define LARGE_BLOCK_NUMBER (1 << 16)
+#define LARGE_OPS (200000)
+#define LARGE_BUFFERS (64)
+
+//#define KMALLOC_LARGE_MAIN
+
+/* returns ops/sec of alloc/free pairs of size */
+double large_bench(size_t size, int use_kmalloc) {
+	auto begin = std::chrono::steady_clock::now();
+
+	for (int i = 0; i < LARGE_OPS; i++) {
+		void* objp = use_kmalloc ? kmalloc(size) : bmalloc(size);
+		if (use_kmalloc) kfree(objp);
+		else bfree(objp);
+	}
+
+	auto end = std::chrono::steady_clock::now();
+	return 2.0 * LARGE_OPS / std::chrono::duration<double>(end - begin).count();
+}
+
+#ifdef KMALLOC_LARGE_MAIN
+
+int main() {
+	void *space = malloc(BLOCK_SIZE * (size_t)LARGE_BLOCK_NUMBER);
+	kmem_init(space, LARGE_BLOCK_NUMBER);
+
+	int failed = 0;
+
+	/* large and small buffers mixed, all go back through kfree/kfree_bulk */
+	void* buffers[LARGE_BUFFERS];
+	for (int i = 0; i < LARGE_BUFFERS; i++) {
+		size_t size = (i % 2) ? KMALLOC_MAX_SIZE + 1 + (size_t)i * 50000 : (size_t)i * 100 + 1;
+		buffers[i] = kmalloc(size);
+		if (buffers[i] == nullptr) {
+			failed = 1;
+			continue;
+		}
+		memset(buffers[i], i, size);
+		if (((char*)buffers[i])[size - 1] != (char)i) failed = 1;
+	}
+	for (int i = 0; i < LARGE_BUFFERS / 2; i++) kfree(buffers[i]);
+	kfree_bulk(LARGE_BUFFERS / 2, buffers + LARGE_BUFFERS / 2);
+
+	/* freed large blocks are cached, they go back to buddy on flush */
+	kmalloc_large_flush(0);
+	void* whole = bmalloc(BLOCK_SIZE * (size_t)LARGE_BLOCK_NUMBER / 4);
+	if (whole == nullptr) failed = 1;
+	bfree(whole);
+
+	printf("%-10s %-20s %-20s\n", "size", "kmalloc+kfree", "bmalloc+bfree");
+	for (size_t size = (size_t)200 << 10; size <= ((size_t)4 << 20); size <<= 2) {
+		double cached = large_bench(size, 1);
+		double raw = large_bench(size, 0);
+		printf("%-10zu %-20.0f %-20.0f\n", size, cached, raw);
+	}
+
+	/* space is not freed, magazines of this thread are released on exit */
+
+	printf(failed ? "FAILED\n" : "OK\n");
+	return failed;
+}
+
+#endif
@@ -0,0 +1,105 @@
+#include <stdio.h>
+#include <string.h>
+#include <chrono>
+#include "Buddy.h"
+#include "slab.h"
+
+#define KREALLOC_BLOCK_NUMBER (1 << 16)
+#define KREALLOC_BUFFERS (8)             // buffers grown in turns
+#define KREALLOC_ROUNDS (20)
+#define KREALLOC_MAX ((size_t)4 << 20)   // buffer size at the end of a round
+
+//#define KREALLOC_BENCH
+
+typedef struct krealloc_result_s {
+	double sec;
+	size_t moves;          // times buffer got new address
+	size_t copied;         // bytes of contents copied
+	int failed;
+} krealloc_result_t;
+
+/* buffers grow by 1/2 of their size, like growable arrays do */
+krealloc_result_t krealloc_run(int in_place) {
+	krealloc_result_t res = { 0, 0, 0, 0 };
+	void* bufs[KREALLOC_BUFFERS];
+	size_t sizes[KREALLOC_BUFFERS];
+
+	auto begin = std::chrono::steady_clock::now();
+
+	for (int r = 0; r < KREALLOC_ROUNDS; r++) {
+		for (int b = 0; b < KREALLOC_BUFFERS; b++) {
+			sizes[b] = 64;
+			bufs[b] = kmalloc(sizes[b]);
+			memset(bufs[b], b, sizes[b]);
+		}
+
+		for (int grown = 1; grown; ) {
+			grown = 0;
+			for (int b = 0; b < KREALLOC_BUFFERS; b++) {
+				if (sizes[b] >= KREALLOC_MAX) continue;
+				grown = 1;
+
+				size_t new_size = sizes[b] + sizes[b] / 2;
+				void* newp;
+				if (in_place) newp = krealloc(bufs[b], new_size);
+				else {
+					newp = kmalloc(new_size);
+					if (newp != nullptr) memcpy(newp, bufs[b], sizes[b]);
+					kfree(bufs[b]);
+				}
+
+				if (newp == nullptr) {
+					res.failed = 1;
+					return res;
+				}
+				if (newp != bufs[b]) {
+					res.moves++;
+					res.copied += sizes[b];
+				}
+
+				/* appended part is written, old contents must be kept */
+				if (((char*)newp)[sizes[b] - 1] != (char)b) res.failed = 1;
+				memset((char*)newp + sizes[b], b, new_size - sizes[b]);
+
+				bufs[b] = newp;
+				sizes[b] = new_size;
+			}
+		}
+
+		for (int b = 0; b < KREALLOC_BUFFERS; b++) kfree(bufs[b]);
+	}
+
+	auto end = std::chrono::steady_clock::now();
+	res.sec = std::chrono::duration<double>(end - begin).count();
+	return res;
+}
+
+#ifdef KREALLOC_BENCH
+
+int main() {
+	void *space = malloc(BLOCK_SIZE * (size_t)KREALLOC_BLOCK_NUMBER);
+	kmem_init(space, KREALLOC_BLOCK_NUMBER);
+
+	/* shrink in place keeps the lower half */
+	int failed = 0;
+	char* big = (char*)kmalloc((size_t)1 << 20);
+	memset(big, 7, (size_t)1 << 20);
+	if (krealloc(big, (size_t)300 << 10) != big || big[(300 << 10) - 1] != 7) failed = 1;
+	kfree(big);
+
+	krealloc_result_t copy = krealloc_run(0);
+	krealloc_result_t res = krealloc_run(1);
+
+	printf("%-24s %-10s %-12s %-10s\n", "", "moves", "MiB copied", "sec");
+	printf("%-24s %-10zu %-12zu %-10.3f\n", "kmalloc+memcpy+kfree", copy.moves, copy.copied >> 20, copy.sec);
+	printf("%-24s %-10zu %-12zu %-10.3f\n", "krealloc", res.moves, res.copied >> 20, res.sec);
+
+	if (copy.failed || res.failed) failed = 1;
+
+	/* space is not freed, magazines of this thread are released on exit */
+
+	printf(failed ? "FAILED\n" : "OK\n");
+	return failed;
+}
+
+#endif
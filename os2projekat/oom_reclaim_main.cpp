@@ -0,0 +1,157 @@
+#include <stdio.h>
+#include <string.h>
+#include <mutex>
+#include <atomic>
+#include <thread>
+#include <vector>
+#include "Buddy.h"
+#include "slab.h"
+
+/* 8 MiB arena, it runs out of blocks in every phase */
+#define OOM_BLOCK_NUMBER (2048)
+#define OOM_SMALL_SIZE (64)       // fills arena and is freed, its slabs stay empty
+#define OOM_BIG_SIZE (2000)       // slab descriptor is kept off slab (size-N cache)
+#define OOM_LARGE_SIZE ((size_t)1 << 20)
+#define OOM_THREADS (4)
+#define OOM_ROUNDS (20)
+
+//#define OOM_RECLAIM_MAIN
+
+/* application cache: list of entries dropped by its shrinker */
+typedef struct oom_entry_s {
+	struct oom_entry_s* next;
+	char data[1000];              // slab descriptor is kept off slab
+} oom_entry_t;
+
+static kmem_cache_t* oom_entry_cache;
+static oom_entry_t* oom_entries;
+static size_t oom_entries_num;
+static std::mutex oom_mutex;
+static std::atomic<size_t> oom_shrinker_calls;
+static std::atomic<size_t> oom_dropped;
+
+/* oom_mutex is held around allocations (oom_insert), so it is only tried */
+size_t oom_shrink(void*, size_t) {
+	std::unique_lock<std::mutex> lock(oom_mutex, std::try_to_lock);
+	oom_shrinker_calls++;
+	if (!lock.owns_lock()) return 0;
+
+	size_t dropped = 0;
+	while (oom_entries != nullptr) {
+		oom_entry_t* ep = oom_entries;
+		oom_entries = ep->next;
+		kmem_cache_free(oom_entry_cache, ep);
+		dropped++;
+	}
+	oom_entries_num = 0;
+	oom_dropped += dropped;
+
+	return dropped;
+}
+
+/* failed allocation reclaims with oom_mutex held, shrinker skips this cache then */
+int oom_insert() {
+	std::lock_guard<std::mutex> lock(oom_mutex);
+
+	oom_entry_t* ep = (oom_entry_t*)kmem_cache_alloc(oom_entry_cache);
+	if (ep == nullptr) return 0;
+
+	ep->next = oom_entries;
+	oom_entries = ep;
+	oom_entries_num++;
+	return 1;
+}
+
+/* allocates from cachep until buddy is out of blocks, returns allocated objects */
+std::vector<void*> oom_fill(kmem_cache_t* cachep) {
+	std::vector<void*> objs;
+	void* objp;
+	while ((objp = kmem_cache_alloc(cachep)) != nullptr) objs.push_back(objp);
+	return objs;
+}
+
+size_t oom_slabs(kmem_cache_t* cachep) {
+	kmem_cache_stats_t stats;
+	kmem_cache_stats(cachep, &stats);
+	return stats.num_of_slabs;
+}
+
+/* threads exhaust arena at once, each from its own cache, and keep the shrinker busy */
+void oom_worker(int id) {
+	char name[CACHE_NAME_LEN];
+	snprintf(name, CACHE_NAME_LEN, "oom worker %d", id);
+	kmem_cache_t* cachep = kmem_cache_create(name, (id % 2) ? OOM_BIG_SIZE : OOM_SMALL_SIZE, nullptr, nullptr);
+
+	for (int round = 0; round < OOM_ROUNDS; round++) {
+		if (id == 0) while (oom_insert());
+
+		std::vector<void*> objs = oom_fill(cachep);
+		for (void* objp : objs) kmem_cache_free(cachep, objp);
+	}
+
+	kmem_cache_destroy(cachep);
+}
+
+#ifdef OOM_RECLAIM_MAIN
+
+int main() {
+	void *space = malloc(BLOCK_SIZE * (size_t)OOM_BLOCK_NUMBER);
+	kmem_init(space, OOM_BLOCK_NUMBER);
+
+	int failed = 0;
+
+	kmem_cache_t* small = kmem_cache_create("oom small", OOM_SMALL_SIZE, nullptr, nullptr);
+	kmem_cache_t* big = kmem_cache_create("oom big", OOM_BIG_SIZE, nullptr, nullptr);
+	oom_entry_cache = kmem_cache_create("oom entry", sizeof(oom_entry_t), nullptr, nullptr);
+	int shrinker = kmem_shrinker_register(oom_shrink, nullptr);
+
+	/* small cache takes the whole arena, freed objects wait in magazines so slabs are kept */
+	std::vector<void*> objs = oom_fill(small);
+	size_t small_objs = objs.size();
+	for (void* objp : objs) kmem_cache_free(small, objp);
+	size_t small_slabs = oom_slabs(small);
+
+	/* empty slabs of small cache are reclaimed, shrinker can't take oom_mutex */
+	while (oom_insert());
+	size_t entries = oom_entries_num;
+	printf("small: %zu objects on %zu slabs, then %zu slabs after %zu entries were inserted\n",
+		small_objs, small_slabs, oom_slabs(small), entries);
+	if (small_slabs == 0 || oom_slabs(small) != 0) failed = 1;
+
+	/* shrinker drops entries, big cache needs descriptors from size-N cache too */
+	objs = oom_fill(big);
+	printf("big: %zu objects, shrinker called %zu times, %zu entries dropped, %zu left\n",
+		objs.size(), oom_shrinker_calls.load(), oom_dropped.load(), oom_entries_num);
+	if (objs.size() == 0 || oom_dropped.load() == 0) failed = 1;
+
+	/* freed objects wait in magazines, large buffer needs them back in buddy */
+	for (void* objp : objs) kmem_cache_free(big, objp);
+	size_t big_slabs = oom_slabs(big);
+	void* large = kmalloc(OOM_LARGE_SIZE);
+	printf("kmalloc of %zu KiB: %s, big slabs %zu -> %zu\n", OOM_LARGE_SIZE >> 10, large ? "ok" : "failed",
+		big_slabs, oom_slabs(big));
+	if (large == nullptr) failed = 1;
+	kfree(large);
+
+	/* no deadlock while threads reclaim together */
+	std::vector<std::thread> threads;
+	for (int i = 0; i < OOM_THREADS; i++) threads.emplace_back(oom_worker, i);
+	for (std::thread& t : threads) t.join();
+	printf("%d threads x %d rounds of exhaustion: shrinker called %zu times\n", OOM_THREADS, OOM_ROUNDS,
+		oom_shrinker_calls.load());
+
+	kmem_shrinker_unregister(shrinker);
+	oom_shrink(nullptr, 0);
+	size_t freed = kmem_reclaim();
+	printf("final reclaim freed %zu blocks\n", freed);
+	if (oom_slabs(small) + oom_slabs(big) + oom_slabs(oom_entry_cache) != 0) failed = 1;
+
+	kmem_cache_destroy(oom_entry_cache);
+	kmem_cache_destroy(big);
+	kmem_cache_destroy(small);
+
+	printf(failed ? "FAILED\n" : "OK\n");
+	return failed;
+}
+
+#endif
@@ -0,0 +1,120 @@
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <chrono>
+#include "Buddy.h"
+#include "slab.h"
+
+/* 1 GiB own arena */
+#define CHURN_BLOCK_NUMBER ((size_t)1 << 18)
+#define CHURN_OBJS (400000)      // objects after the spike
+#define CHURN_LIVE (80000)       // objects kept alive during churn
+#define CHURN_ROUNDS (6)         // half of live objects is freed and allocated again
+#define CHURN_OBJ_SIZE (256)     // slab descriptor is kept on slab
+
+//#define PARTIAL_CHURN_BENCH
+
+size_t churn_resident_kib() {
+#ifdef __linux__
+	size_t pages = 0, resident = 0;
+	FILE* f = fopen("/proc/self/statm", "r");
+	if (f == nullptr) return 0;
+	if (fscanf(f, "%zu %zu", &pages, &resident) != 2) resident = 0;
+	fclose(f);
+	return resident * 4;
+#else
+	return 0;
+#endif
+}
+
+/* xorshift, same sequence on every run */
+uint32_t churn_random(uint32_t* state) {
+	*state ^= *state << 13;
+	*state ^= *state >> 17;
+	*state ^= *state << 5;
+	return *state;
+}
+
+void churn_shuffle(void** objs, int n, uint32_t* state) {
+	for (int i = n - 1; i > 0; i--) {
+		int j = churn_random(state) % (i + 1);
+		void* tmp = objs[i];
+		objs[i] = objs[j];
+		objs[j] = tmp;
+	}
+}
+
+/* frees empty slabs and returns their blocks to the OS, */
+/* first shrink only ends growth phase of cache          */
+void churn_reclaim(kmem_cache_t* cachep) {
+	kmem_cache_shrink(cachep);
+	kmem_cache_shrink(cachep);
+	kmem_release(0);
+}
+
+void churn_print(const char* phase, kmem_cache_t* cachep) {
+	kmem_cache_stats_t stats;
+	kmem_cache_stats(cachep, &stats);
+	printf("%-14s %-9zu %-9zu %-9.1f %-10zu\n", phase, stats.active_objs, stats.num_of_slabs,
+		100.0 * stats.active_objs / (stats.total_objs ? stats.total_objs : 1), churn_resident_kib());
+}
+
+#ifdef PARTIAL_CHURN_BENCH
+
+void* churn_objs[CHURN_OBJS];
+
+int main() {
+	kmem_init(nullptr, CHURN_BLOCK_NUMBER, KMEM_OWN_ARENA);
+
+	/* no magazines, every call goes to slab lists */
+	kmem_cache_t* cachep = kmem_cache_create("churn", CHURN_OBJ_SIZE, nullptr, nullptr, 0);
+	uint32_t state = 2463534242u;
+
+	printf("%-14s %-9s %-9s %-9s %-10s\n", "", "objects", "slabs", "used %", "RSS KiB");
+
+	/* spike, every object is touched */
+	for (int i = 0; i < CHURN_OBJS; i++) {
+		churn_objs[i] = kmem_cache_alloc(cachep);
+		memset(churn_objs[i], 0x5A, CHURN_OBJ_SIZE);
+	}
+	churn_print("spike", cachep);
+
+	/* random objects are freed, survivors are spread over all slabs */
+	churn_shuffle(churn_objs, CHURN_OBJS, &state);
+	for (int i = CHURN_LIVE; i < CHURN_OBJS; i++) kmem_cache_free(cachep, churn_objs[i]);
+	churn_reclaim(cachep);
+	churn_print("after free", cachep);
+
+	/* random half of live objects is replaced, then empty slabs are reclaimed */
+	double ns = 0;
+	for (int r = 1; r <= CHURN_ROUNDS; r++) {
+		churn_shuffle(churn_objs, CHURN_LIVE, &state);
+
+		auto begin = std::chrono::steady_clock::now();
+		for (int i = 0; i < CHURN_LIVE / 2; i++) kmem_cache_free(cachep, churn_objs[i]);
+		for (int i = 0; i < CHURN_LIVE / 2; i++) {
+			churn_objs[i] = kmem_cache_alloc(cachep);
+			memset(churn_objs[i], 0x5A, CHURN_OBJ_SIZE);
+		}
+		auto end = std::chrono::steady_clock::now();
+		ns += std::chrono::duration<double, std::nano>(end - begin).count();
+
+		char phase[32];
+		snprintf(phase, sizeof(phase), "round %d", r);
+		churn_reclaim(cachep);
+		churn_print(phase, cachep);
+	}
+	printf("%.1f ns per free + alloc\n", ns / (CHURN_ROUNDS * (CHURN_LIVE / 2)));
+
+	int failed = 0;
+	for (int i = 0; i < CHURN_LIVE; i++) {
+		if (churn_objs[i] == nullptr) failed = 1;
+		kmem_cache_free(cachep, churn_objs[i]);
+	}
+	kmem_cache_destroy(cachep);
+
+	printf(failed ? "FAILED\n" : "OK\n");
+	return failed;
+}
+
+#endif
@@ -0,0 +1,102 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <chrono>
+#include <map>
+#include <vector>
+#include <memory_resource>
+#include "Buddy.h"
+#include "slab.h"
+#include "Allocator.h"
+
+#define PMR_BLOCK_NUMBER (1 << 15)
+#define PMR_KEYS (200000)
+#define PMR_ROUNDS (5)
+
+//#define PMR_BENCH
+
+/* same keys for every map, so results can be compared */
+static std::vector<int> pmr_keys() {
+	std::vector<int> keys(PMR_KEYS);
+	srand(42);
+	for (int i = 0; i < PMR_KEYS; i++) keys[i] = rand();
+	return keys;
+}
+
+/* returns ns per insert/erase, map holds up to PMR_KEYS nodes between erases */
+template <typename Map>
+double pmr_map_bench(Map& map, const std::vector<int>& keys, long long* checksum) {
+	auto begin = std::chrono::steady_clock::now();
+	for (int r = 0; r < PMR_ROUNDS; r++) {
+		for (int key : keys) map[key] = key + r;
+		for (auto& kv : map) *checksum += kv.second;
+		for (size_t i = 0; i < keys.size(); i += 2) map.erase(keys[i]);
+		for (size_t i = 1; i < keys.size(); i += 2) map.erase(keys[i]);
+	}
+	auto end = std::chrono::steady_clock::now();
+
+	return std::chrono::duration<double, std::nano>(end - begin).count() / (2.0 * PMR_ROUNDS * keys.size());
+}
+
+/* two node types of the same size, each gets its own cache */
+typedef struct pmr_node_a_s { void* link[3]; int key; int value; } pmr_node_a_t;
+typedef struct pmr_node_b_s { void* link[3]; long long key; } pmr_node_b_t;
+static_assert(sizeof(pmr_node_a_t) == sizeof(pmr_node_b_t), "node types must be of the same size");
+
+template <typename T>
+int pmr_node_check() {
+	kmem::NodeAllocator<T> alloc;
+	if (alloc.cache() == nullptr) return 0;
+
+	T* np = alloc.allocate(1);
+	alloc.deallocate(np, 1);
+	return 1;
+}
+
+#ifdef PMR_BENCH
+
+int main() {
+	void *space = malloc(BLOCK_SIZE * (size_t)PMR_BLOCK_NUMBER);
+	kmem_init(space, PMR_BLOCK_NUMBER);
+
+	std::vector<int> keys = pmr_keys();
+	long long expected = 0, node = 0, pmr = 0;
+
+	printf("%-34s %-10s\n", "std::map<int, int>", "ns/op");
+
+	{
+		std::map<int, int> map;
+		printf("%-34s %-10.1f\n", "std::allocator", pmr_map_bench(map, keys, &expected));
+	}
+
+	{
+		std::map<int, int, std::less<int>, kmem::NodeAllocator<std::pair<const int, int>>> map;
+		printf("%-34s %-10.1f\n", "kmem::NodeAllocator", pmr_map_bench(map, keys, &node));
+	}
+
+	{
+		std::pmr::map<int, int> map(kmem::memory_resource());
+		printf("%-34s %-10.1f\n", "std::pmr::map, kmem resource", pmr_map_bench(map, keys, &pmr));
+	}
+
+	/* over-aligned buffers of resource */
+	int failed = expected != node || expected != pmr;
+	std::pmr::memory_resource* resource = kmem::memory_resource();
+	for (size_t align = 1; align <= 4096; align <<= 1) {
+		for (size_t bytes : { (size_t)0, (size_t)24, (size_t)1000, (size_t)KMALLOC_MAX_SIZE + 1 }) {
+			void* p = resource->allocate(bytes, align);
+			if ((uintptr_t)p % align) failed = 1;
+			resource->deallocate(p, bytes, align);
+		}
+	}
+
+	/* same sized node types must not share cache name */
+	if (!pmr_node_check<pmr_node_a_t>() || !pmr_node_check<pmr_node_b_t>()) failed = 1;
+	if (kmem::NodeAllocator<pmr_node_a_t>::cache() == kmem::NodeAllocator<pmr_node_b_t>::cache()) failed = 1;
+
+	/* space is not freed, magazines of this thread are released on exit */
+
+	printf(failed ? "FAILED\n" : "OK\n");
+	return failed;
+}
+
+#endif
@@ -0,0 +1,147 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <thread>
+#include <chrono>
+#include <atomic>
+#include <vector>
+#include "Buddy.h"
+#include "slab.h"
+
+#define REG_BENCH_BLOCK_NUMBER (1 << 16)
+#define REG_BENCH_CACHES (4000)     // per-tenant caches
+#define REG_BENCH_THREADS (4)
+#define REG_BENCH_ROUNDS (300)      // create/destroy rounds per thread
+#define REG_BENCH_RACES (200)       // rounds in which all threads create the same name
+
+//#define REGISTRY_BENCH
+
+static kmem_cache_t* reg_bench_caches[REG_BENCH_CACHES];
+
+double reg_bench_ns(std::chrono::steady_clock::time_point begin, int n) {
+	return std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - begin).count() / n;
+}
+
+/* ns per create, find and destroy with n caches registered */
+void reg_bench_scaling(int n) {
+	char name[CACHE_NAME_LEN];
+
+	auto begin = std::chrono::steady_clock::now();
+	for (int i = 0; i < n; i++) {
+		snprintf(name, CACHE_NAME_LEN, "tenant-%d", i);
+		reg_bench_caches[i] = kmem_cache_create(name, 64, nullptr, nullptr, 0);
+	}
+	double create = reg_bench_ns(begin, n);
+
+	begin = std::chrono::steady_clock::now();
+	int found = 0;
+	for (int i = 0; i < n; i++) {
+		snprintf(name, CACHE_NAME_LEN, "tenant-%d", i);
+		found += kmem_cache_find(name) == reg_bench_caches[i];
+	}
+	double find = reg_bench_ns(begin, n);
+
+	begin = std::chrono::steady_clock::now();
+	for (int i = 0; i < n; i++) kmem_cache_destroy(reg_bench_caches[i]);
+	double destroy = reg_bench_ns(begin, n);
+
+	printf("%-8d %-12.0f %-12.0f %-12.0f %s\n", n, create, find, destroy, found == n ? "" : "FAILED");
+}
+
+/* threads create, use and destroy own caches while others walk the cache list */
+void reg_bench_tenant(int id, std::atomic<int>* failed) {
+	char name[CACHE_NAME_LEN];
+
+	for (int r = 0; r < REG_BENCH_ROUNDS; r++) {
+		snprintf(name, CACHE_NAME_LEN, "t%d-%d", id, r);
+		kmem_cache_t* cachep = kmem_cache_create(name, 32 + 16 * id, nullptr, nullptr);
+		if (cachep == nullptr || kmem_cache_find(name) != cachep) {
+			failed->store(1);
+			continue;
+		}
+
+		void* objs[64];
+		for (int i = 0; i < 64; i++) objs[i] = kmem_cache_alloc(cachep);
+		for (int i = 0; i < 64; i++) kmem_cache_free(cachep, objs[i]);
+
+		kmem_cache_destroy(cachep);
+		if (kmem_cache_find(name) != nullptr) failed->store(1);
+	}
+}
+
+/* every round all threads try to create one name, exactly one must get it */
+void reg_bench_race(std::atomic<int>* ready, std::atomic<int>* created, kmem_cache_t** winners) {
+	char name[CACHE_NAME_LEN];
+
+	for (int r = 0; r < REG_BENCH_RACES; r++) {
+		snprintf(name, CACHE_NAME_LEN, "race-%d", r);
+
+		/* all threads start together */
+		ready->fetch_add(1);
+		while (ready->load() < (r + 1) * REG_BENCH_THREADS) std::this_thread::yield();
+
+		kmem_cache_t* cachep = kmem_cache_create(name, 64, nullptr, nullptr, 0);
+		if (cachep != nullptr) {
+			created[r].fetch_add(1);
+			winners[r] = cachep;
+		}
+	}
+}
+
+#ifdef REGISTRY_BENCH
+
+int main() {
+	void *space = malloc(BLOCK_SIZE * (size_t)REG_BENCH_BLOCK_NUMBER);
+	kmem_init(space, REG_BENCH_BLOCK_NUMBER);
+
+	std::atomic<int> failed(0);
+
+	printf("%-8s %-12s %-12s %-12s\n", "caches", "ns/create", "ns/find", "ns/destroy");
+	for (int n : { 250, 1000, REG_BENCH_CACHES }) reg_bench_scaling(n);
+	printf("\n");
+
+	/* tenants churn caches while stats and reaper walk the list */
+	std::atomic<int> walking(1);
+	size_t walks = 0;
+	std::thread walker([&]() {
+		static kmem_cache_stats_t stats[REG_BENCH_CACHES];
+		while (walking.load()) {
+			kmem_stats_snapshot(stats, REG_BENCH_CACHES);
+			kmem_reap();
+			walks++;
+		}
+	});
+
+	auto begin = std::chrono::steady_clock::now();
+	std::vector<std::thread> threads;
+	for (int t = 0; t < REG_BENCH_THREADS; t++) threads.emplace_back(reg_bench_tenant, t, &failed);
+	for (auto& thread : threads) thread.join();
+	double ns = reg_bench_ns(begin, REG_BENCH_THREADS * REG_BENCH_ROUNDS);
+
+	walking.store(0);
+	walker.join();
+	printf("%d threads: %.0f ns per create + use + destroy, %zu list walks meanwhile\n", REG_BENCH_THREADS, ns, walks);
+
+	std::atomic<int> ready(0);
+	std::atomic<int> created[REG_BENCH_RACES];
+	kmem_cache_t* winners[REG_BENCH_RACES];
+	for (int r = 0; r < REG_BENCH_RACES; r++) created[r].store(0);
+
+	threads.clear();
+	for (int t = 0; t < REG_BENCH_THREADS; t++) threads.emplace_back(reg_bench_race, &ready, created, winners);
+	for (auto& thread : threads) thread.join();
+
+	int duplicates = 0;
+	for (int r = 0; r < REG_BENCH_RACES; r++) {
+		if (created[r].load() != 1) duplicates++;
+		else kmem_cache_destroy(winners[r]);
+	}
+	printf("same name races: %d of %d created more or less than one cache\n", duplicates, REG_BENCH_RACES);
+	if (duplicates != 0) failed.store(1);
+
+	/* space is not freed, magazines of this thread are released on exit */
+
+	printf(failed.load() ? "FAILED\n" : "OK\n");
+	return failed.load();
+}
+
+#endif
@@ -1,14 +1,53 @@
 #include "slab.h"
+#include "BitMapTree.h"
+#include "Trace.h"
 #include <string.h>
 #include <assert.h>
 #include <mutex>
-
-/* for size-N caches mem_buffer_array must follow those values! */
-#define CACHE_SIZES_NUM (13)
-#define MIN_CACHE_SIZE (5)
+#include <atomic>
+#include <new>
+#include <thread>
+#include <chrono>
+#include <condition_variable>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#endif
 
 //#define LINUX_LIKE_CACHE_INFO
 
+/* btsm entry of the first block of large kmalloc buffer: order of its */
+/* buddy block with low bit set, slab pointers never have it set       */
+#define LARGE_ENTRY(order) ((kmem_slab_t*)(((uintptr_t)(order) << 1) | 1))
+#define IS_LARGE_ENTRY(slabp) (((uintptr_t)(slabp)) & 1)
+#define LARGE_ENTRY_ORDER(slabp) ((int)((uintptr_t)(slabp) >> 1))
+
+/* smallest order such that 2^order blocks fit size, size is above KMALLOC_MAX_SIZE */
+#define LARGE_ORDER(size) (bit_scan_reverse((((size) + BLOCK_SIZE - 1) >> block_N) - 1) + 1)
+
+/* statistics counters have one writer at a time (cc_mutex or cache CS), so */
+/* they are updated without atomic RMW, snapshots read them without locks  */
+#define STAT_ADD(counter, n) (counter).store((counter).load(std::memory_order_relaxed) + (n), std::memory_order_relaxed)
+#define STAT_READ(counter) ((counter).load(std::memory_order_relaxed))
+
+/* only caches made by kmem_cache_create have trace id, objects of internal */
+/* and size-N caches are not traced (kmalloc traces its own buffers)         */
+#define TRACE_CACHE(op, cachep, objp) do { \
+		if (trace_enabled() && (cachep)->trace_id != 0) \
+			trace_record(op, (cachep)->trace_id, (cachep)->obj_size, objp); \
+	} while (0)
+
+/* off slab descriptor comes from size-N cache directly, so it's not traced as kmalloc */
+#define SLAB_DESC_CACHE(cachep) \
+		(size_N_caches[kmalloc_index(sizeof(kmem_slab_t) + (cachep)->objs_per_slab*(cachep)->bufctl)].cs_cachep)
+
+/* walks cache list, only between registry_enter and registry_leave */
+#define FOR_EACH_CACHE(cachep) \
+		for (kmem_cache_t* cachep = cache_head.load(std::memory_order_acquire); cachep != nullptr; \
+			cachep = cachep->next_cache.load(std::memory_order_acquire))
+
 /* ---------------------------------------------------------- */
 /* ------------------------- STRUCTS ------------------------ */
 /* ---------------------------------------------------------- */
@@ -18,25 +57,70 @@ typedef struct size_N {
 	kmem_cache_t* cs_cachep;
 } size_N_t;
 
+typedef struct large_cached_s {
+	void* blockp;
+	size_t freed_at;               // ms
+} large_cached_t;
+
+typedef struct kmem_shrinker_s {
+	kmem_shrinker_fn fn;           // nullptr if slot is free
+	void* arg;
+} kmem_shrinker_t;
+
 typedef struct kmem_slab_s {
 	struct kmem_slab_s* next_slab; // initially nullptr
 	struct kmem_slab_s* prev_slab; // initially nullptr
 	struct kmem_cache_s* my_cache;
-	unsigned int my_colour;        // offset
+	unsigned int my_colour;        // offset in colour_off units
 	unsigned int inuse;            // number of used objects 
 	unsigned int free;             // index of first free object 
+	unsigned int bin;              // partial bin, valid while slab is partial
 	void* objs;                    // pointer to first object 
+	size_t empty_since;            // ms, set when slab is put on empty list
 }kmem_slab_t;
 
+typedef struct kmem_magazine_s {
+	struct kmem_magazine_s* next_mag;
+	unsigned int rounds;              // number of objects in magazine
+	void* objs[KMEM_MAX_MAG_SIZE];    // stack of objects
+}kmem_magazine_t;
+
+typedef struct kmem_cpu_cache_s {
+	struct kmem_cpu_cache_s* next_cc; // initially nullptr
+	struct kmem_cpu_cache_s* prev_cc; // initially nullptr
+
+	/* nullptr when cache is destroyed, owner thread then frees this struct */
+	struct kmem_cache_s* my_cache;
+
+	/* only contended while cache is being shrinked */
+	std::mutex cc_mutex;
+
+	kmem_magazine_t* loaded;          // always partly filled, full or empty
+	kmem_magazine_t* previous;        // always full or empty
+
+	/* objects allocated/freed through magazines by owner thread */
+	std::atomic<size_t> allocs;
+	std::atomic<size_t> frees;
+}kmem_cpu_cache_t;
+
 typedef struct kmem_cache_s {
-	struct kmem_cache_s* next_cache; // initially nullptr
+	/* cache list is walked without lock (registry_enter), so next_cache is atomic */
+	std::atomic<struct kmem_cache_s*> next_cache; // initially nullptr
 	struct kmem_cache_s* prev_cache; // initially nullptr
+	struct kmem_cache_s* hash_next;  // next cache in name hash bucket
 
 	kmem_slab_t* full;               // initially nullptr
-	kmem_slab_t* partial;            // initially nullptr
+	kmem_slab_t* partial[KMEM_PARTIAL_BINS]; // by inuse, initially nullptr
+	unsigned int partial_mask;       // bit i is set if partial[i] is not empty
 	kmem_slab_t* empty;              // initially nullptr
 
-	size_t obj_size; 
+	size_t obj_size;                 // stride, size given to kmem_cache_create padded to align given to it
+	size_t obj_align;                // object array starts at multiples of it
+	size_t colour_off;               // colour unit, multiple of CACHE_L1_LINE_SIZE and obj_align
+
+	/* ceil(2^32 / obj_size), object index on slab is (offset * obj_reciprocal) >> 32, */
+	/* exact for offsets of objects since slab is smaller than 4 GiB                   */
+	uint64_t obj_reciprocal;
 
 	/* mutex is shared between processes */
 	void* mutex_placement;
@@ -45,11 +129,17 @@ typedef struct kmem_cache_s {
 	unsigned int slab_size;
 	unsigned int num_of_slabs; 
 	unsigned int objs_per_slab;
+	unsigned int bufctl;             // bytes per free object index, KMEM_BUFCTL_EMBEDDED if kept in free objects
 	unsigned int colour_num;
 	unsigned int colour_next;
 	unsigned int num_of_active_objs;
+	unsigned int num_of_empty_slabs;
 	int off_slab;
 
+	/* empty slabs kept by reaper, KMEM_WATERMARK_DEFAULT follows reaper settings */
+	unsigned int empty_low;
+	unsigned int empty_high;
+
 	/* set it to 1 when cache is expanded, set it to 0 when cache is shrinked */
 	unsigned int growing;
 
@@ -61,8 +151,57 @@ typedef struct kmem_cache_s {
 	void(*dtor)(void*); 
 	char name[CACHE_NAME_LEN];
 
+	/* KMEM_CACHE_* flags given to kmem_cache_create */
+	unsigned int flags;
+
+	/* id in trace records, 0 for caches which are not traced */
+	unsigned int trace_id;
+
+	/* magazine layer, disabled when mag_size is 0 */
+	int cache_id;                       // index in thread's cpu cache table
+	unsigned int mag_size;
+	kmem_cpu_cache_t* cpu_caches;       // guarded by magazine_mutex
+
+	/* depot of magazines */
+	std::mutex* depot_mutex;
+	void* depot_mutex_placement;
+	kmem_magazine_t* depot_full;
+	kmem_magazine_t* depot_empty;
+
+	/* working set of depot: full magazines not taken since last reap are */
+	/* not needed, reaper returns depot_full_min of them to slabs         */
+	unsigned int depot_full_num;
+	unsigned int depot_full_min;
+
+	/* objects freed while cache was locked by other thread, linked through */
+	/* their first word, drained in batches by the thread holding the lock  */
+	std::atomic<void*> remote_free;
+
+	/* statistics, updated inside cache CS */
+	std::atomic<size_t> stat_allocs;
+	std::atomic<size_t> stat_frees;
+	std::atomic<size_t> stat_grows;
+	std::atomic<size_t> stat_shrinks;
+	std::atomic<size_t> stat_alloc_failures;
+
+	/* magazine allocs/frees of exited threads (guarded by magazine_mutex) */
+	size_t stat_exited_allocs;
+	size_t stat_exited_frees;
+
 } kmem_cache_t;
 
+/* per-thread table of cpu caches, indexed by cache_id */
+class kmem_thread_caches_t {
+public:
+	kmem_cpu_cache_t* ccs[KMEM_MAX_CACHES];
+
+	/* magazines are flushed to depots on thread exit */
+	~kmem_thread_caches_t() { cpu_caches_release(); }
+};
+
+static_assert(sizeof(kmem_slab_t) == SLAB_DESC_SIZE, "SLAB_DESC_SIZE must be sizeof(kmem_slab_t)");
+static_assert(KMEM_PARTIAL_BINS <= 32, "partial_mask has one bit per partial bin");
+
 /* ---------------------------------------------------------- */
 /* ------------------------- GLOBALS ------------------------ */
 /* ---------------------------------------------------------- */
@@ -73,36 +212,94 @@ static kmem_cache_t cache_cache;
 /* cache used to store std::mutex structs */
 static kmem_cache_t mutex_cache;
 
+/* cache used to store kmem_magazine_t structs */
+static kmem_cache_t mag_cache;
+
+/* cache used to store kmem_cpu_cache_t structs */
+static kmem_cache_t cpu_cache_cache;
+
 /* beginning of available space */
-static unsigned start;
+static uintptr_t start;
+
+/* arena mapped by kmem_init (KMEM_OWN_ARENA), its size and page size */
+static int arena_owned;
+static void* arena_space;
+static size_t arena_size;
+static size_t arena_page_size;
 
 /* head of cache linked list */
-static kmem_cache_t* cache_head;
+static std::atomic<kmem_cache_t*> cache_head;
+
+/* caches by name hash, guarded by cache_list_mutex */
+static kmem_cache_t* cache_hash[KMEM_CACHE_HASH_SIZE];
+
+/* guards changes of cache linked list and name hash, taken before any cache mutex */
+static std::mutex cache_list_mutex;
+
+/* readers walking cache list in each of two epochs, cache removed from the list is */
+/* freed once all readers of the epoch in which it was removed have left           */
+static std::atomic<unsigned int> registry_epoch;
+static std::atomic<unsigned int> registry_readers[2];
+static std::mutex registry_sync_mutex;
+
+/* reaper thread, its settings are guarded by reaper_mutex */
+static std::mutex reaper_mutex;
+static std::condition_variable reaper_cv;
+static std::thread reaper_thread;
+static std::atomic<int> reaper_running;
+static kmem_reaper_settings_t reaper_settings = {
+	KMEM_REAPER_INTERVAL_MS, KMEM_REAPER_EMPTY_LOW, KMEM_REAPER_EMPTY_HIGH, KMEM_REAPER_AGE_MS
+};
+
+/* reaper is stopped on exit, before static caches are gone */
+class kmem_reaper_guard_t {
+public:
+	~kmem_reaper_guard_t() { kmem_reaper_stop(); }
+};
+static kmem_reaper_guard_t reaper_guard;
 
 /* mutexes for static caches */
 static std::mutex mutex_cache_mutex;
 static std::mutex cache_cache_mutex;
-static std::mutex size_N_mutex[CACHE_SIZES_NUM];
+static std::mutex mag_cache_mutex;
+static std::mutex cpu_cache_cache_mutex;
+static std::mutex size_N_mutex[KMALLOC_CLASSES_NUM];
+static std::mutex size_N_depot_mutex[KMALLOC_CLASSES_NUM];
+
+/* guards cpu cache lists of all caches and cache_ids */
+/* lock order: magazine_mutex -> cc_mutex -> depot_mutex -> cache_mutex */
+static std::mutex magazine_mutex;
+
+/* 1 if cache id is taken */
+static char cache_ids[KMEM_MAX_CACHES];
+
+/* last trace id given to cache, ids are 16 bit in trace records */
+static std::atomic<unsigned int> cache_trace_ids;
+
+/* cpu caches of this thread */
+static thread_local kmem_thread_caches_t thread_caches;
 
 /* all pointers are set to nullptr at the beginning */
 static kmem_slab_t** block_to_slab_mapping;
 
-/* static array of size-N caches */
-static size_N_t size_N_caches[] = {
-	{ 32, nullptr },     // 5
-	{ 64, nullptr },     // 6
-	{ 128, nullptr },    // 7
-	{ 256, nullptr },    // 8
-	{ 512, nullptr },    // 9
-	{ 1024, nullptr },   // 10
-	{ 2048, nullptr },   // 11
-	{ 4096, nullptr },   // 12
-	{ 8192, nullptr },   // 13
-	{ 16384, nullptr },  // 14
-	{ 32768, nullptr },  // 15
-	{ 65536, nullptr },  // 16
-	{ 131072, nullptr }  // 17
-};
+/* static array of size-N caches, indexed by kmalloc_index */
+static size_N_t size_N_caches[KMALLOC_CLASSES_NUM];
+
+/* recently freed large kmalloc blocks, per order, the oldest is at index 0 */
+static large_cached_t large_cache[KMEM_LARGE_CACHE_MAX_ORDER + 1][KMEM_LARGE_CACHE_DEPTH];
+static unsigned int large_cache_num[KMEM_LARGE_CACHE_MAX_ORDER + 1];
+static std::mutex large_cache_mutex[KMEM_LARGE_CACHE_MAX_ORDER + 1];
+
+/* shrinkers, shrinker_mutex is held while they run so unregister waits for them */
+static kmem_shrinker_t shrinkers[KMEM_MAX_SHRINKERS];
+static std::mutex shrinker_mutex;
+
+/* cache, cpu cache and depot locks held by this thread, failed allocation reclaims */
+/* only when it's 0: reclaim takes all of them and they are not recursive          */
+static thread_local unsigned int locks_held;
+
+/* 1 while this thread runs kmem_reclaim, allocations of shrinkers don't reclaim again */
+static thread_local int reclaim_running;
 
 int block_N;
 
@@ -110,18 +307,90 @@ int block_N;
 /* -------------------------- UTIL -------------------------- */
 /* ---------------------------------------------------------- */
 
+unsigned int cache_name_hash(const char* name) {
+	/* FNV-1a */
+	unsigned int hash = 2166136261u;
+	for (; *name != '\0'; name++) hash = (hash ^ (unsigned char)*name) * 16777619u;
+	return hash & (KMEM_CACHE_HASH_SIZE - 1);
+}
+
+kmem_cache_t* cache_lookup(const char* name) {
+	/* Inside cache_list_mutex */
+
+	for (kmem_cache_t* cachep = cache_hash[cache_name_hash(name)]; cachep != nullptr; cachep = cachep->hash_next) {
+		if (strcmp(name, cachep->name) == 0) return cachep;
+	}
+	return nullptr;
+}
+
+int cache_register(kmem_cache_t* cachep) {
+	std::lock_guard<std::mutex> lock(cache_list_mutex);
+
+	/* name check and insert are one step, so two caches can't get the same name */
+	if (cache_lookup(cachep->name) != nullptr) return 0;
+
+	unsigned int hash = cache_name_hash(cachep->name);
+	cachep->hash_next = cache_hash[hash];
+	cache_hash[hash] = cachep;
+
+	/* cache is published at the beginning of the list after it's fully constructed */
+	kmem_cache_t* head = cache_head.load(std::memory_order_relaxed);
+	cachep->prev_cache = nullptr;
+	cachep->next_cache.store(head, std::memory_order_relaxed);
+	if (head != nullptr) head->prev_cache = cachep;
+	cache_head.store(cachep, std::memory_order_release);
+
+	return 1;
+}
+
 kmem_cache_t* cache_remove_from_list(kmem_cache_t* cachep) {
+	/* Inside cache_list_mutex */
+
 	if (cachep == nullptr) return nullptr;
-	if (cachep->prev_cache != nullptr) cachep->prev_cache->next_cache = cachep->next_cache;
-	if (cachep->next_cache != nullptr) cachep->next_cache->prev_cache = cachep->prev_cache;
-	if (cachep == cache_head) cache_head = cache_head->next_cache;
-	cachep->next_cache = nullptr;
+
+	kmem_cache_t** hpp = &cache_hash[cache_name_hash(cachep->name)];
+	while (*hpp != nullptr && *hpp != cachep) hpp = &(*hpp)->hash_next;
+	if (*hpp == cachep) *hpp = cachep->hash_next;
+	cachep->hash_next = nullptr;
+
+	/* next_cache of removed cache is kept, readers may still stand on it */
+	kmem_cache_t* next = cachep->next_cache.load(std::memory_order_relaxed);
+	if (cachep->prev_cache != nullptr) cachep->prev_cache->next_cache.store(next, std::memory_order_release);
+	else if (cache_head.load(std::memory_order_relaxed) == cachep) cache_head.store(next, std::memory_order_release);
+	if (next != nullptr) next->prev_cache = cachep->prev_cache;
 	cachep->prev_cache = nullptr;
 	return cachep;
 }
 
+unsigned int registry_enter() {
+	/* O(1), lock-free */
+
+	for (;;) {
+		unsigned int epoch = registry_epoch.load() & 1;
+		registry_readers[epoch].fetch_add(1);
+
+		/* epoch was flipped before reader was counted, it would not be waited for */
+		if ((registry_epoch.load() & 1) == epoch) return epoch;
+		registry_readers[epoch].fetch_sub(1);
+	}
+}
+
+void registry_leave(unsigned int epoch) {
+	registry_readers[epoch].fetch_sub(1, std::memory_order_release);
+}
+
+void registry_synchronize() {
+	/* waits for readers which could have seen caches removed before the call */
+
+	std::lock_guard<std::mutex> lock(registry_sync_mutex);
+
+	unsigned int epoch = registry_epoch.fetch_add(1) & 1;
+	while (registry_readers[epoch].load(std::memory_order_acquire) != 0) std::this_thread::yield();
+}
+
 kmem_slab_t* slab_remove_from_list(kmem_slab_t** headp, kmem_slab_t* slabp) {
 	if (slabp == nullptr || *headp == nullptr) return nullptr;
+	if (headp == &slabp->my_cache->empty) slabp->my_cache->num_of_empty_slabs--;
 	if (slabp->prev_slab != nullptr) (slabp->prev_slab)->next_slab = slabp->next_slab;
 	if (slabp->next_slab != nullptr) (slabp->next_slab)->prev_slab = slabp->prev_slab;
 	if (slabp == (*headp)) (*headp) = (*headp)->next_slab;
@@ -132,6 +401,11 @@ kmem_slab_t* slab_remove_from_list(kmem_slab_t** headp, kmem_slab_t* slabp) {
 
 void slab_add_to_list(kmem_slab_t** headp, kmem_slab_t* slabp) {
 	if (slabp == nullptr) return;
+	if (headp == &slabp->my_cache->empty) {
+		/* reaper frees slabs that stayed empty for too long */
+		slabp->empty_since = kmem_now_ms();
+		slabp->my_cache->num_of_empty_slabs++;
+	}
 	slabp->next_slab = *headp;
 	slabp->prev_slab = nullptr;
 	if (*headp != nullptr) (*headp)->prev_slab = slabp;
@@ -141,44 +415,115 @@ void slab_add_to_list(kmem_slab_t** headp, kmem_slab_t* slabp) {
 void kmem_slab_info(kmem_slab_t* slabp) {
 	/* for debugging purposes */
 
+	/* offsets are printed relative to base, they always fit into int */
+#define SLAB_OFFSET(ptr, base) ((int)((uintptr_t)(ptr) - (uintptr_t)(base)))
+#define SLAB_OBJ(i) ((uintptr_t)slabp->objs + (i)*slabp->my_cache->obj_size)
+
 	if (slabp == nullptr) return;
 	printf("\nallocated %d blocks\n", slabp->my_cache->slab_size);
-	printf("slab desc. start %d\n", (int)slabp - (int)slabp);
-	printf("slab desc. end %d\n", (int)slabp - (int)slabp + sizeof(kmem_slab_t));
-	printf("slab desc. array start %d\n", (unsigned)FREE_OBJS(slabp) - (unsigned)slabp);
+	printf("slab desc. start %d\n", SLAB_OFFSET(slabp, slabp));
+	printf("slab desc. end %d\n", SLAB_OFFSET(slabp, slabp) + (int)sizeof(kmem_slab_t));
+	printf("slab desc. array start %d\n", SLAB_OFFSET(FREE_OBJS(slabp), slabp));
 
 	for (int i = 0; i < slabp->my_cache->objs_per_slab; i++) {
-		printf("%d ", *(FREE_OBJS(slabp) + i));
+		printf("%d ", (int)slab_next_free(slabp, i));
 	}
 	printf("\n");
-	printf("slab desc. array end %d\n", (unsigned)FREE_OBJS(slabp) - (unsigned)slabp + 4 * slabp->my_cache->objs_per_slab);
+	printf("slab desc. array end %d\n", SLAB_OFFSET(FREE_OBJS(slabp), slabp) +
+		(int)(slabp->my_cache->bufctl * slabp->my_cache->objs_per_slab));
 	if (slabp->my_cache->off_slab == 1) {
 		printf("slab desc.off slab\n");
 		printf("objs slab start %d\n", 0);
 
 		for (int i = 0; i < slabp->my_cache->objs_per_slab; i++) {
-			printf("%d - %d\n", 
-				((unsigned)slabp->objs + i*slabp->my_cache->obj_size) - (unsigned)slabp->objs + (slabp->my_colour)*CACHE_L1_LINE_SIZE,
-				*(unsigned*)((unsigned)slabp->objs + i*slabp->my_cache->obj_size));
+			printf("%zu - %d\n", 
+				SLAB_OFFSET(SLAB_OBJ(i), slabp->objs) + (slabp->my_colour)*slabp->my_cache->colour_off,
+				*(unsigned*)SLAB_OBJ(i));
 		}
-		printf("slab objs end %d\n", ((unsigned)slabp->objs + slabp->my_cache->objs_per_slab*slabp->my_cache->obj_size)
-			- (unsigned)slabp->objs + (slabp->my_colour)*CACHE_L1_LINE_SIZE);
+		printf("slab objs end %zu\n", SLAB_OFFSET(SLAB_OBJ(slabp->my_cache->objs_per_slab), slabp->objs)
+			+ (slabp->my_colour)*slabp->my_cache->colour_off);
 
 		printf("slab end %d\n", BLOCK_SIZE*(slabp->my_cache->slab_size));
 	}
 	else {
 		printf("slab desc. on slab\n");
-		printf("slab objs start %d\n", (unsigned)slabp->objs - (unsigned)slabp);
+		printf("slab objs start %d\n", SLAB_OFFSET(slabp->objs, slabp));
 
 		for (int i = 0; i < slabp->my_cache->objs_per_slab; i++) {
-			printf("%d - %d\n", ((unsigned)slabp->objs + i*slabp->my_cache->obj_size) - (unsigned)slabp,
-				*(unsigned*)((unsigned)slabp->objs + i*slabp->my_cache->obj_size));
+			printf("%d - %d\n", SLAB_OFFSET(SLAB_OBJ(i), slabp),
+				*(unsigned*)SLAB_OBJ(i));
 		}
-		printf("slab objs end %d\n", ((unsigned)slabp->objs + slabp->my_cache->objs_per_slab*slabp->my_cache->obj_size)
-			- (unsigned)slabp);
+		printf("slab objs end %d\n", SLAB_OFFSET(SLAB_OBJ(slabp->my_cache->objs_per_slab), slabp));
 
 		printf("slab end %d\n", BLOCK_SIZE*(slabp->my_cache->slab_size));
 	}
+
+#undef SLAB_OBJ
+#undef SLAB_OFFSET
+}
+
+/* index of free object after free object i, -1 after the last one */
+unsigned int slab_next_free(kmem_slab_t* slabp, unsigned int i) {
+	unsigned int next = 0;
+
+	switch (slabp->my_cache->bufctl) {
+	case KMEM_BUFCTL_EMBEDDED:
+		memcpy(&next, (void*)((uintptr_t)slabp->objs + i*slabp->my_cache->obj_size), sizeof(next));
+		return next;
+	case 1:
+		next = FREE_OBJS(slabp)[i];
+		return (next == KMEM_BUFCTL_END(1)) ? (unsigned)-1 : next;
+	case 2:
+		next = ((uint16_t*)FREE_OBJS(slabp))[i];
+		return (next == KMEM_BUFCTL_END(2)) ? (unsigned)-1 : next;
+	default:
+		return ((uint32_t*)FREE_OBJS(slabp))[i];
+	}
+}
+
+/* narrow indexes keep -1 as KMEM_BUFCTL_END */
+void slab_set_next_free(kmem_slab_t* slabp, unsigned int i, unsigned int next) {
+	switch (slabp->my_cache->bufctl) {
+	case KMEM_BUFCTL_EMBEDDED:
+		memcpy((void*)((uintptr_t)slabp->objs + i*slabp->my_cache->obj_size), &next, sizeof(next));
+		break;
+	case 1:
+		FREE_OBJS(slabp)[i] = (uint8_t)next;
+		break;
+	case 2:
+		((uint16_t*)FREE_OBJS(slabp))[i] = (uint16_t)next;
+		break;
+	default:
+		((uint32_t*)FREE_OBJS(slabp))[i] = next;
+	}
+}
+
+/* partial bin of slab with inuse objects, fuller slabs are in higher bins */
+#define PARTIAL_BIN(cachep, inuse) ((unsigned)((inuse) * KMEM_PARTIAL_BINS / (cachep)->objs_per_slab))
+
+void slab_partial_add(kmem_cache_t* cachep, kmem_slab_t* slabp) {
+	slabp->bin = PARTIAL_BIN(cachep, slabp->inuse);
+	slab_add_to_list(&cachep->partial[slabp->bin], slabp);
+	cachep->partial_mask |= 1u << slabp->bin;
+}
+
+void slab_partial_remove(kmem_cache_t* cachep, kmem_slab_t* slabp) {
+	slab_remove_from_list(&cachep->partial[slabp->bin], slabp);
+	if (cachep->partial[slabp->bin] == nullptr) cachep->partial_mask &= ~(1u << slabp->bin);
+}
+
+kmem_slab_t* slab_partial_fullest(kmem_cache_t* cachep) {
+	/* amortized O(1), slab is moved down at most once per bin it lost on free */
+
+	/* frees do not move partial slabs, bins are corrected when slab comes first */
+	while (cachep->partial_mask != 0) {
+		kmem_slab_t* slabp = cachep->partial[bit_scan_reverse(cachep->partial_mask)];
+		if (PARTIAL_BIN(cachep, slabp->inuse) >= slabp->bin) return slabp;
+
+		slab_partial_remove(cachep, slabp);
+		slab_partial_add(cachep, slabp);
+	}
+	return nullptr;
 }
 
 kmem_slab_t* new_slab(kmem_cache_t* cachep) {
@@ -193,28 +538,32 @@ kmem_slab_t* new_slab(kmem_cache_t* cachep) {
 	if (cachep->off_slab == 1) {
 		/* if slab descriptor is kept off slab */
 
-		slabp = (kmem_slab_t*)kmalloc(sizeof(kmem_slab_t) + (cachep->objs_per_slab)*sizeof(int));
+		slabp = (kmem_slab_t*)kmem_cache_alloc(SLAB_DESC_CACHE(cachep));
 		if (slabp == nullptr) return nullptr;
 
-		slabp->objs = bmalloc(BLOCK_SIZE*cachep->slab_size);
-		if (slabp->objs == nullptr) return nullptr;
+		slabp->objs = buddy_alloc(bit_scan_reverse(cachep->slab_size));
+		if (slabp->objs == nullptr) {
+			/* buddy is out of blocks, descriptor goes back */
+			kmem_cache_free(SLAB_DESC_CACHE(cachep), slabp);
+			return nullptr;
+		}
 
 		/* coulouring */
-		slabp->objs = (void*)((unsigned)slabp->objs + (cachep->colour_next)*CACHE_L1_LINE_SIZE);
+		slabp->objs = (void*)((uintptr_t)slabp->objs + (cachep->colour_next)*cachep->colour_off);
 	}
 	else {
 		/* if slab descriptor is kept on slab */
 
-		slabp = (kmem_slab_t*)bmalloc(BLOCK_SIZE*cachep->slab_size);
+		slabp = (kmem_slab_t*)buddy_alloc(bit_scan_reverse(cachep->slab_size));
 		if (slabp == nullptr) return nullptr;
 
 		/* coulouring */
-		slabp = (kmem_slab_t*)((unsigned)slabp + (cachep->colour_next)*CACHE_L1_LINE_SIZE);
-		slabp->objs = (void*)(unsigned)(FREE_OBJS(slabp) + cachep->objs_per_slab);
+		slabp = (kmem_slab_t*)((uintptr_t)slabp + (cachep->colour_next)*cachep->colour_off);
+		slabp->objs = (void*)((uintptr_t)slabp + SLAB_META_SIZE(cachep->objs_per_slab, cachep->bufctl, 0, cachep->obj_align));
 	}
 
 	slabp->my_colour = cachep->colour_next;
-	cachep->colour_next = (++(cachep->colour_next) % cachep->colour_num);
+	cachep->colour_next = (cachep->colour_next + 1) % cachep->colour_num;
 	slabp->my_cache = cachep;
 	slabp->inuse = 0;
 	slabp->free = 0;
@@ -223,12 +572,13 @@ kmem_slab_t* new_slab(kmem_cache_t* cachep) {
 
 	/* cache is growing */
 	cachep->growing = 1;
+	STAT_ADD(cachep->stat_grows, 1);
 
-	/* init array of indexes of free objects (always kept on slab)*/
-	for (int i = 0; i < cachep->objs_per_slab - 1; i++) {
-		FREE_OBJS(slabp)[i] = i + 1;
+	/* init indexes of free objects (in descriptor or in objects) */
+	for (unsigned i = 0; i < cachep->objs_per_slab - 1; i++) {
+		slab_set_next_free(slabp, i, i + 1);
 	}
-	FREE_OBJS(slabp)[cachep->objs_per_slab - 1] = -1;
+	slab_set_next_free(slabp, cachep->objs_per_slab - 1, -1);
 
 	/* init all objects on the slab */
 	process_objects_on_slab(slabp, cachep->ctor);
@@ -242,34 +592,34 @@ kmem_slab_t* new_slab(kmem_cache_t* cachep) {
 void* slab_alloc(kmem_slab_t* slabp) {
 	if (slabp == nullptr) return nullptr;
 	if (slabp->free == -1) return nullptr;
-	void* objp = (void*)((int)slabp->objs + slabp->free*slabp->my_cache->obj_size);
-	slabp->free = FREE_OBJS(slabp)[slabp->free];
+	void* objp = (void*)((uintptr_t)slabp->objs + slabp->free*slabp->my_cache->obj_size);
+	slabp->free = slab_next_free(slabp, slabp->free);
 	slabp->inuse++;
 	return objp;
 }
 
-void slab_free(kmem_slab_t* slabp, void* objp) {
+void slab_free(kmem_slab_t* slabp, void* objp, int constructed) {
 	if (slabp == nullptr) return;
 	if (objp == nullptr) return;
 
 	/* object must be on this slab */
 	assert(is_obj_on_slab(slabp, objp));
 
-	/* back to init state */
-	if (slabp->my_cache->ctor != nullptr) {
+	/* back to init state, unless caller returns objects constructed or ctor already ran */
+	if (!constructed && slabp->my_cache->ctor != nullptr && !(slabp->my_cache->flags & KMEM_CACHE_CONSTRUCTED)) {
 		slabp->my_cache->ctor(objp);
 	}
 
-	unsigned objn = ((int)objp - (int)slabp->objs) / slabp->my_cache->obj_size;
-	FREE_OBJS(slabp)[objn] = slabp->free;
+	unsigned objn = (unsigned)((((uintptr_t)objp - (uintptr_t)slabp->objs) * slabp->my_cache->obj_reciprocal) >> 32);
+	slab_set_next_free(slabp, objn, slabp->free);
 	slabp->free = objn;
 	slabp->inuse--;
 }
 
 int is_obj_on_slab(kmem_slab_t* slabp, void* objp) {
 	if (slabp == nullptr || objp == nullptr) return 0;
-	return ((int)slabp->objs <= (int)objp &&
-		(int)objp <= ((int)slabp->objs + (slabp->my_cache->slab_size*BLOCK_SIZE)));
+	return ((uintptr_t)slabp->objs <= (uintptr_t)objp &&
+		(uintptr_t)objp <= ((uintptr_t)slabp->objs + (slabp->my_cache->slab_size*BLOCK_SIZE)));
 }
 
 void add_empty_slab(kmem_cache_t* cachep) {
@@ -283,57 +633,85 @@ void add_empty_slab(kmem_cache_t* cachep) {
 
 void kmem_cache_constructor(kmem_cache_t* cachep, const char* name, size_t size,
 	void(*ctor)(void*),
-	void(*dtor)(void*)) {
+	void(*dtor)(void*),
+	unsigned int mag_size,
+	unsigned int flags,
+	size_t align) {
 	/* Does NOT initiazlize mutex_placement & cache_mutex */
+	/* Does NOT initiazlize depot_mutex_placement & depot_mutex */
+
+	/* objects are padded to alignment, free objects of caches without ctor/dtor hold free list */
+	kmem_geometry_t geometry = kmem_cache_geometry(size, align, flags, (ctor != nullptr || dtor != nullptr) ? 1 : 0);
 
 	strcpy(cachep->name, name);
-	cachep->obj_size = size;
+	cachep->obj_size = geometry.size;
+	cachep->obj_align = geometry.align;
+	cachep->colour_off = geometry.colour_off;
+	cachep->obj_reciprocal = ((((uint64_t)1) << 32) + geometry.size - 1) / geometry.size;
 	cachep->ctor = ctor;
 	cachep->dtor = dtor;
+	cachep->flags = flags;
 	cachep->growing = 0;
 	cachep->num_of_slabs = 0;
 	cachep->error = 0;
 	cachep->num_of_active_objs = 0;
-
-	/* if object size is larger then treshold slab desc. is kept off slab */
-	cachep->off_slab = ((size > OBJECT_TRESHOLD) ? 1 : 0);
+	cachep->num_of_empty_slabs = 0;
+	cachep->empty_low = KMEM_WATERMARK_DEFAULT;
+	cachep->empty_high = KMEM_WATERMARK_DEFAULT;
 
 	cachep->full = nullptr;
-	cachep->partial = nullptr;
+	for (int i = 0; i < KMEM_PARTIAL_BINS; i++) cachep->partial[i] = nullptr;
+	cachep->partial_mask = 0;
 	cachep->empty = nullptr;
 
-	/* puts new cache at the beginning of the cache list */
-	cachep->next_cache = cache_head;
-	cachep->prev_cache = nullptr;
-	if (cache_head != nullptr) cache_head->prev_cache = cachep;
-	cache_head = cachep;
-
-	/* slab_size, objs_pre_slab, colour_num, colour_next */
+	cachep->cpu_caches = nullptr;
+	cachep->depot_full = nullptr;
+	cachep->depot_full_num = 0;
+	cachep->depot_full_min = 0;
+	cachep->depot_empty = nullptr;
+	cachep->cache_id = -1;
+	cachep->trace_id = 0;
 
-	unsigned int pow = 0;
-	unsigned int num = 1;
+	/* cache is put on the cache list by cache_register */
+	new (&cachep->next_cache) std::atomic<kmem_cache_t*>(nullptr);
+	cachep->prev_cache = nullptr;
+	cachep->hash_next = nullptr;
+
+	new (&cachep->remote_free) std::atomic<void*>(nullptr);
+	new (&cachep->stat_allocs) std::atomic<size_t>(0);
+	new (&cachep->stat_frees) std::atomic<size_t>(0);
+	new (&cachep->stat_grows) std::atomic<size_t>(0);
+	new (&cachep->stat_shrinks) std::atomic<size_t>(0);
+	new (&cachep->stat_alloc_failures) std::atomic<size_t>(0);
+	cachep->stat_exited_allocs = 0;
+	cachep->stat_exited_frees = 0;
+	cachep->mag_size = 0;
+
+	if (mag_size > 0) {
+		/* magazine layer needs free cache id */
+
+		if (mag_size > KMEM_MAX_MAG_SIZE) mag_size = KMEM_MAX_MAG_SIZE;
+
+		std::lock_guard<std::mutex> lock(magazine_mutex);
+		for (int i = 0; i < KMEM_MAX_CACHES; i++) {
+			if (cache_ids[i] == 0) {
+				cache_ids[i] = 1;
+				cachep->cache_id = i;
+				cachep->mag_size = mag_size;
+				break;
+			}
+		}
+	}
 
-	kmem_cache_estimate(&pow, &num, size, cachep->off_slab); 
+	/* off_slab, slab_size, objs_pre_slab, colour_num, colour_next */
 
-	cachep->slab_size = (1 << pow);
-	cachep->objs_per_slab = num;
+	cachep->off_slab = geometry.off_slab;
+	cachep->slab_size = (1 << geometry.pow);
+	cachep->objs_per_slab = geometry.num;
+	cachep->bufctl = geometry.bufctl;
 
 	cachep->colour_next = 0;
-	cachep->colour_num = LEFT_OVER(num, pow, size, cachep->off_slab) / CACHE_L1_LINE_SIZE + 1; 
-}
-
-void kmem_cache_estimate(unsigned* pow, unsigned* num, int size, int off) {
-	/* memory wastage is less then 1/8 of total slab size */
-
-	*pow = 0;
-	*num = 1;
-
-	while (!INSUFFICIENT_SLAB_SPACE((*num) + 1, *pow, size, off)) (*num)++;
-	while (INSUFFICIENT_SLAB_SPACE(*num, *pow, size, off) || 
-		   LEFT_OVER(*num, *pow, size, off)>(SLAB_SIZE(*pow) >> 3)) {
-		(*pow)++;
-		while (!INSUFFICIENT_SLAB_SPACE((*num) + 1, *pow, size, off)) (*num)++;
-	}
+	cachep->colour_num = geometry.colour_num;
 }
 
 void cache_ctor(void* mem) {
@@ -342,62 +720,95 @@ void cache_ctor(void* mem) {
 
 void static_caches_init() {
 
+	/* static caches below have no magazine layer */
+
 	/* init cache_cache with static mutex */
 	cache_cache.cache_mutex = &cache_cache_mutex;
 	cache_cache.mutex_placement = nullptr;
-	kmem_cache_constructor(&cache_cache, "cache-cache\0", sizeof(kmem_cache_t), cache_ctor, nullptr);
+	cache_cache.depot_mutex = nullptr;
+	cache_cache.depot_mutex_placement = nullptr;
+	kmem_cache_constructor(&cache_cache, "cache-cache\0", sizeof(kmem_cache_t), cache_ctor, nullptr, 0, 0);
+	cache_register(&cache_cache);
 
 	/* init mutex_cache with static mutex */
 	mutex_cache.cache_mutex = &mutex_cache_mutex;
 	mutex_cache.mutex_placement = nullptr;
-	kmem_cache_constructor(&mutex_cache, "mutex-cache\0", sizeof(std::mutex), cache_ctor, nullptr);
+	mutex_cache.depot_mutex = nullptr;
+	mutex_cache.depot_mutex_placement = nullptr;
+	kmem_cache_constructor(&mutex_cache, "mutex-cache\0", sizeof(std::mutex), cache_ctor, nullptr, 0, 0);
+	cache_register(&mutex_cache);
+
+	/* init mag_cache with static mutex */
+	mag_cache.cache_mutex = &mag_cache_mutex;
+	mag_cache.mutex_placement = nullptr;
+	mag_cache.depot_mutex = nullptr;
+	mag_cache.depot_mutex_placement = nullptr;
+	kmem_cache_constructor(&mag_cache, "magazine-cache\0", sizeof(kmem_magazine_t), nullptr, nullptr, 0, 0);
+	cache_register(&mag_cache);
+
+	/* init cpu_cache_cache with static mutex */
+	cpu_cache_cache.cache_mutex = &cpu_cache_cache_mutex;
+	cpu_cache_cache.mutex_placement = nullptr;
+	cpu_cache_cache.depot_mutex = nullptr;
+	cpu_cache_cache.depot_mutex_placement = nullptr;
+	kmem_cache_constructor(&cpu_cache_cache, "cpu-cache-cache\0", sizeof(kmem_cpu_cache_t), nullptr, nullptr, 0, 0);
+	cache_register(&cpu_cache_cache);
 
-	int pow = MIN_CACHE_SIZE;
 	char name[CACHE_NAME_LEN];
 
-	/* init all size-N caches */
-	for (int i = 0; i < CACHE_SIZES_NUM; i++) {
+	/* init all size-N caches, slab geometry of each comes from kmem_cache_estimate */
+	for (int i = 0; i < KMALLOC_CLASSES_NUM; i++) {
 
 		kmem_cache_t* cachep = (kmem_cache_t*)kmem_cache_alloc(&cache_cache);
 		
-		unsigned int bsize = (1 << pow);
-		sprintf_s(name, CACHE_NAME_LEN, "size-%d cache", bsize);
+		unsigned int bsize = (unsigned int)kmalloc_class_size(i);
+		snprintf(name, CACHE_NAME_LEN, "size-%u cache", bsize);
 
-		/* init size-N cache with static mutex */
+		/* init size-N cache with static mutexes */
 		cachep->cache_mutex = &(size_N_mutex[i]);
 		cachep->mutex_placement = nullptr;
+		cachep->depot_mutex = &(size_N_depot_mutex[i]);
+		cachep->depot_mutex_placement = nullptr;
 
-		kmem_cache_constructor(cachep, name, bsize, cache_ctor, nullptr);
+		kmem_cache_constructor(cachep, name, bsize, cache_ctor, nullptr, KMEM_DEFAULT_MAG_SIZE, 0);
+		cache_register(cachep);
+		size_N_caches[i].cs_size = bsize;
 		size_N_caches[i].cs_cachep = cachep;
-
-		pow++;
 	}
 }
 
 void enter_cs(kmem_cache_t* cachep) {
 	cachep->cache_mutex->lock();
+	locks_held++;
+}
+
+int try_enter_cs(kmem_cache_t* cachep) {
+	if (!cachep->cache_mutex->try_lock()) return 0;
+	locks_held++;
+	return 1;
 }
 
 void leave_cs(kmem_cache_t* cachep) {
+	locks_held--;
 	cachep->cache_mutex->unlock();
 }
 
 void process_objects_on_slab(kmem_slab_t* slabp, void(*function)(void *)) {
 	if (slabp == nullptr || function == nullptr) return;
 	int obj_num = slabp->my_cache->objs_per_slab;
-	int obj_size = slabp->my_cache->obj_size;
+	size_t obj_size = slabp->my_cache->obj_size;
 
 	for (int i = 0; i < obj_num; i++) {
-			function((void*)((int)slabp->objs + i*obj_size));
+			function((void*)((uintptr_t)slabp->objs + i*obj_size));
 	}
 }
 
 void btsm_update(kmem_slab_t* slabp, kmem_slab_t* set_to) {
 	if (slabp == nullptr) return;
-	int blockn = ((((int)slabp->objs - start) & ~(BLOCK_SIZE - 1)) >> block_N);
-	int limit = blockn + slabp->my_cache->slab_size;
+	size_t blockn = (((uintptr_t)slabp->objs - start) >> block_N);
+	size_t limit = blockn + slabp->my_cache->slab_size;
 
-	for (int i = blockn; i < limit; i++) {
+	for (size_t i = blockn; i < limit; i++) {
 		block_to_slab_mapping[i] = set_to;
 	}
 }
@@ -406,10 +817,16 @@ int kmem_cache_check_name_availability(const char* name) {
 	/* Returns 0 if name is unavailable */
 
 	if (name == nullptr) return 0;
-	for (kmem_cache_t* i = cache_head; i != nullptr; i = i->next_cache) {
-		if (strcmp(name, i->name) == 0) return 0;
-	}
-	return 1;
+
+	std::lock_guard<std::mutex> lock(cache_list_mutex);
+	return cache_lookup(name) == nullptr;
+}
+
+kmem_cache_t* kmem_cache_find(const char* name) {
+	if (name == nullptr) return nullptr;
+
+	std::lock_guard<std::mutex> lock(cache_list_mutex);
+	return cache_lookup(name);
 }
 
 int kmem_cache_shrink_no_cs(kmem_cache_t *cachep) {
@@ -427,225 +844,1037 @@ int kmem_cache_shrink_no_cs(kmem_cache_t *cachep) {
 	while (cachep->empty != nullptr) {
 		/* free all empty slabs */
 
-		kmem_slab_t* slabp = slab_remove_from_list(&cachep->empty, cachep->empty);
-		cachep->num_of_slabs--;
-
-		/*              --- block to slab mapping update ---                     */
+		num_of_freed_blocks += slab_destroy(cachep, cachep->empty);
+	}
 
-		/* !!!  if used, MUST be before bfree to avoid data corruption:  !!!     */
+	return num_of_freed_blocks;
+}
 
-		/* - POSSIBLE SCENARIO (btsm_update after bfree):                        */
-		/* - 1) bfree is called and blocks are freed.                            */
-		/* - 2) some other thread allocate those blocks for cache [C],           */
-		/*      and sets pointers to its slab.                                   */
-		/* - 3) btsm_update is called and those pointers are set to nullptr,     */
-		/*      where they should point to slab of cache [C].                    */
-		/* - 4) cache [C] is left with corrupted pointers to its slab.           */
-		/* - 5) assertion in kmem_cache_free() will be triggered.                */
+int slab_destroy(kmem_cache_t* cachep, kmem_slab_t* slabp) {
+	/* Does not have critical section */
 
-		//btsm_update(slabp, nullptr);
+	slab_remove_from_list(&cachep->empty, slabp);
+	cachep->num_of_slabs--;
+	STAT_ADD(cachep->stat_shrinks, 1);
 
-		/* destroy all objects on this slab */
-		process_objects_on_slab(slabp, cachep->dtor);
+	/*              --- block to slab mapping update ---                     */
 
-		if (cachep->off_slab == 1) {
-			/* if slab descriptor is kept off slab */
+	/* !!!  if used, MUST be before bfree to avoid data corruption:  !!!     */
 
-			bfree(slabp->objs);
-			kfree(slabp);
-		}
-		else bfree(slabp);
+	/* - POSSIBLE SCENARIO (btsm_update after bfree):                        */
+	/* - 1) bfree is called and blocks are freed.                            */
+	/* - 2) some other thread allocate those blocks for cache [C],           */
+	/*      and sets pointers to its slab.                                   */
+	/* - 3) btsm_update is called and those pointers are set to nullptr,     */
+	/*      where they should point to slab of cache [C].                    */
+	/* - 4) cache [C] is left with corrupted pointers to its slab.           */
+	/* - 5) assertion in kmem_cache_free() will be triggered.                */
 
-		num_of_freed_blocks += cachep->slab_size;
-	}
+	//btsm_update(slabp, nullptr);
 
-	return num_of_freed_blocks;
-}
+	/* destroy all objects on this slab */
+	process_objects_on_slab(slabp, cachep->dtor);
 
-/* ----------------------------------------------------------- */
-/* -------------------------- CACHE -------------------------- */
-/* ----------------------------------------------------------- */
+	if (cachep->off_slab == 1) {
+		/* if slab descriptor is kept off slab */
 
-kmem_cache_t *kmem_cache_create(const char *name, size_t size,
-	void(*ctor)(void *),
-	void(*dtor)(void *)) {
+		buddy_dealloc(slabp->objs);
+		kmem_cache_free(SLAB_DESC_CACHE(cachep), slabp);
+	}
+	else buddy_dealloc(slabp);
 
-	if (kmem_cache_check_name_availability(name) == 0) return nullptr;
-	
-	kmem_cache_t* cachep = (kmem_cache_t*)kmem_cache_alloc(&cache_cache);
-	if (cachep == nullptr) return nullptr; 
+	return cachep->slab_size;
+}
 
-	/* placement new operator does not allocate memory */
-	cachep->mutex_placement = kmem_cache_alloc(&mutex_cache);
-	cachep->cache_mutex = new std::mutex(), cachep->mutex_placement;
+/* ---------------------------------------------------------- */
+/* ------------------------ MAGAZINES ----------------------- */
+/* ---------------------------------------------------------- */
 
-	kmem_cache_constructor(cachep, name, size, ctor, dtor);
+void depot_put(kmem_cache_t* cachep, kmem_magazine_t* magp) {
+	/* Inside cachep depot CS */
 
-	return cachep;
+	if (magp == nullptr) return;
+	if (magp->rounds > 0) {
+		magp->next_mag = cachep->depot_full;
+		cachep->depot_full = magp;
+		cachep->depot_full_num++;
+	}
+	else {
+		magp->next_mag = cachep->depot_empty;
+		cachep->depot_empty = magp;
+	}
 }
 
-void kmem_init(void *space, int block_num) {
+kmem_cpu_cache_t* cpu_cache_enter(kmem_cache_t* cachep) {
+	/* returns cpu cache of calling thread with locked cc_mutex */
 
-	/* assert MUST be true, else program will crash during cache_cache's         */
-	/* first slab allocation(for size-32 cache) since it needs kmalloc           */
-	/* for slab descriptor and it*s making size-N caches which provide kmalloc.  */
-	
-	assert(sizeof(kmem_cache_t)<OBJECT_TRESHOLD);
+	kmem_cpu_cache_t** ccpp = &(thread_caches.ccs[cachep->cache_id]);
 
-	int block_is_lost = 0;
+	if (*ccpp != nullptr) {
+		(*ccpp)->cc_mutex.lock();
+		if ((*ccpp)->my_cache == cachep) return *ccpp;
+		(*ccpp)->cc_mutex.unlock();
 
-	/* align space with BLOCK_SIZE multiple and see if block is lost */
-	if ((unsigned(space) & (BLOCK_SIZE - 1)) > 0) {
-		block_is_lost = 1;
+		/* cache was destroyed and its id is reused, drop stale cpu cache */
+		(*ccpp)->cc_mutex.~mutex();
+		kmem_cache_free(&cpu_cache_cache, *ccpp);
+		*ccpp = nullptr;
 	}
-	space = (void*)(((unsigned)space + BLOCK_SIZE-1) & ~(BLOCK_SIZE - 1));
 
-	cache_head = nullptr;
-	block_N = 0;
-	while ((1 << block_N) < BLOCK_SIZE) block_N++;
+	/* first use of cachep by this thread */
 
-	int buddy_num_of_blocks = block_num - block_is_lost;
+	kmem_cpu_cache_t* ccp = (kmem_cpu_cache_t*)kmem_cache_alloc(&cpu_cache_cache);
+	if (ccp == nullptr) return nullptr;
 
-	/* aligned space is given to buddy_init */
-	space = buddy_init(space, &buddy_num_of_blocks);
+	new (&ccp->cc_mutex) std::mutex();
+	ccp->my_cache = cachep;
+	ccp->loaded = nullptr;
+	ccp->previous = nullptr;
+	new (&ccp->allocs) std::atomic<size_t>(0);
+	new (&ccp->frees) std::atomic<size_t>(0);
 
-	start = (unsigned)space;
+	magazine_mutex.lock();
+	ccp->prev_cc = nullptr;
+	ccp->next_cc = cachep->cpu_caches;
+	if (cachep->cpu_caches != nullptr) cachep->cpu_caches->prev_cc = ccp;
+	cachep->cpu_caches = ccp;
 
-	block_to_slab_mapping = (kmem_slab_t**)bmalloc(sizeof(kmem_slab_t*)*buddy_num_of_blocks);
+	/* locked before kmem_cache_drain_magazines can detach it */
+	ccp->cc_mutex.lock();
+	magazine_mutex.unlock();
 
-	for (int i = 0; i < buddy_num_of_blocks; i++) {
-		block_to_slab_mapping[i] = nullptr;
-	}
+	*ccpp = ccp;
+	return ccp;
+}
 
-	static_caches_init();
+void cpu_cache_leave(kmem_cpu_cache_t* ccp) {
+	ccp->cc_mutex.unlock();
 }
 
-int kmem_cache_shrink(kmem_cache_t *cachep) {
-	if (cachep == nullptr) return 0;
+int cpu_cache_refill(kmem_cache_t* cachep, kmem_cpu_cache_t* ccp) {
+	/* O(1), returns 1 if loaded magazine has objects after refill */
 
-	/* ENTER CS */
-	enter_cs(cachep);
+	if (ccp->loaded == nullptr || ccp->loaded->rounds == 0) {
 
-	int num_of_freed_blocks = kmem_cache_shrink_no_cs(cachep);
+		if (ccp->previous != nullptr && ccp->previous->rounds > 0) {
+			/* previous is full, swap it with empty loaded */
 
-	/* LEAVE CS */
-	leave_cs(cachep);
-	return num_of_freed_blocks;
+			kmem_magazine_t* magp = ccp->loaded;
+			ccp->loaded = ccp->previous;
+			ccp->previous = magp;
+		}
+		else {
+			/* both are empty, exchange one for full magazine from depot */
+
+			cachep->depot_mutex->lock();
+
+			kmem_magazine_t* magp = cachep->depot_full;
+			if (magp != nullptr) {
+				cachep->depot_full = magp->next_mag;
+				if (--cachep->depot_full_num < cachep->depot_full_min) cachep->depot_full_min = cachep->depot_full_num;
+				depot_put(cachep, ccp->previous);
+				ccp->previous = ccp->loaded;
+				ccp->loaded = magp;
+			}
+
+			cachep->depot_mutex->unlock();
+		}
+	}
+
+	return ccp->loaded != nullptr && ccp->loaded->rounds > 0;
 }
 
-void* kmem_cache_alloc(kmem_cache_t *cachep) {
-	if (cachep == nullptr) return nullptr;
+void* cpu_cache_alloc(kmem_cache_t* cachep) {
+	/* O(1), slab lists are not touched */
 
-	/* ENTER CS */
-	enter_cs(cachep);
+	kmem_cpu_cache_t* ccp = cpu_cache_enter(cachep);
+	if (ccp == nullptr) return nullptr;
 
-	kmem_slab_t* slabp = nullptr;
 	void* objp = nullptr;
 
-	if (cachep->partial != nullptr) slabp = cachep->partial;
-	else if (cachep->empty == nullptr) {
-		/* partial == nullptr && empty == nullptr */
-
-		slabp = new_slab(cachep);
-		slab_add_to_list(&cachep->partial, slabp);
-		cachep->num_of_slabs++;
+	if (cpu_cache_refill(cachep, ccp)) {
+		objp = ccp->loaded->objs[--(ccp->loaded->rounds)];
+		STAT_ADD(ccp->allocs, 1);
 	}
-	else{
-		/* partial == nullptr && empty != nullptr  */
 
-		slabp = cachep->empty;
-		assert(slabp->inuse == 0);
-		slab_remove_from_list(&cachep->empty, slabp);
-		slab_add_to_list(&cachep->partial, slabp);
-	}
+	cpu_cache_leave(ccp);
+	return objp;
+}
 
-	/* use if program crashes while trying to reference nullptr */
-	/* to prove that buddy ran out of blocks.                   */
-	//assert(slabp != nullptr);
+size_t cpu_cache_alloc_bulk(kmem_cache_t* cachep, size_t n, void** objs) {
+	/* O(n), slab lists are not touched */
 
-	if (slabp == nullptr) cachep->error = 1;
-	else {
-		/* slabp is in partial */
+	kmem_cpu_cache_t* ccp = cpu_cache_enter(cachep);
+	if (ccp == nullptr) return 0;
 
-		objp = slab_alloc(slabp);
-		if (slabp->free == -1) {
-			slab_remove_from_list(&cachep->partial, slabp);
-			slab_add_to_list(&cachep->full, slabp);
+	size_t taken = 0;
+
+	while (taken < n && cpu_cache_refill(cachep, ccp)) {
+		while (taken < n && ccp->loaded->rounds > 0) {
+			objs[taken++] = ccp->loaded->objs[--(ccp->loaded->rounds)];
 		}
-		cachep->num_of_active_objs++;
 	}
+	STAT_ADD(ccp->allocs, taken);
 
-	/* LEAVE CS */
-	leave_cs(cachep);
-	return objp;
+	cpu_cache_leave(ccp);
+	return taken;
 }
 
-void kmem_cache_free(kmem_cache_t *cachep, void *objp) {
-	if (cachep == nullptr) return;
-	if (objp == nullptr) return;
+int cpu_cache_make_room(kmem_cache_t* cachep, kmem_cpu_cache_t* ccp) {
+	/* O(1), returns 1 if loaded magazine has room after exchange */
 
-	/* ENTER CS */
-	enter_cs(cachep);
+	if (ccp->loaded == nullptr || ccp->loaded->rounds == cachep->mag_size) {
 
-	int blockn = ((((int)objp - start) & ~(BLOCK_SIZE - 1)) >> block_N);
+		if (ccp->previous != nullptr && ccp->previous->rounds == 0) {
+			/* previous is empty, swap it with full loaded */
 
-	kmem_slab_t* slabp = block_to_slab_mapping[blockn];
+			kmem_magazine_t* magp = ccp->loaded;
+			ccp->loaded = ccp->previous;
+			ccp->previous = magp;
+		}
+		else {
+			/* both are full, exchange one for empty magazine from depot */
+
+			cachep->depot_mutex->lock();
+
+			kmem_magazine_t* magp = cachep->depot_empty;
+			if (magp != nullptr) cachep->depot_empty = magp->next_mag;
+			else {
+				/* depot has no empty magazines, make new one. cc and depot */
+				/* locks are held, so failure falls back to slab_free      */
+				locks_held++;
+				magp = (kmem_magazine_t*)kmem_cache_alloc(&mag_cache);
+				locks_held--;
+				if (magp != nullptr) magp->rounds = 0;
+			}
+
+			if (magp != nullptr) {
+				depot_put(cachep, ccp->previous);
+				ccp->previous = ccp->loaded;
+				ccp->loaded = magp;
+			}
+
+			cachep->depot_mutex->unlock();
+		}
+	}
 
-	/* must not be nullptr */
-	assert(slabp != nullptr);
+	return ccp->loaded != nullptr && ccp->loaded->rounds < cachep->mag_size;
+}
 
-	slab_free(slabp, objp);
+int cpu_cache_free(kmem_cache_t* cachep, void* objp) {
+	/* O(1), slab lists are not touched */
 
-	if (slabp->inuse == 0) {
-		/* move from full/partial to empty */
-		if (slabp->my_cache->objs_per_slab == 1) 
-			slab_remove_from_list(&slabp->my_cache->full, slabp);
-		else slab_remove_from_list(&slabp->my_cache->partial, slabp);
+	/* back to init state, outside of cc_mutex in case ctor allocates */
+	if (cachep->ctor != nullptr && !(cachep->flags & KMEM_CACHE_CONSTRUCTED)) {
+		cachep->ctor(objp);
+	}
 
-		slab_add_to_list(&slabp->my_cache->empty, slabp);
+	kmem_cpu_cache_t* ccp = cpu_cache_enter(cachep);
+	if (ccp == nullptr) return 0;
 
-		/* try to shrink cache */
-		kmem_cache_shrink_no_cs(cachep);
-	}
-	else if (slabp->inuse == (slabp->my_cache->objs_per_slab - 1)) {
-		/* move from full to partial */
-		slab_remove_from_list(&slabp->my_cache->full, slabp);
-		slab_add_to_list(&slabp->my_cache->partial, slabp);
-	}
-	
-	cachep->num_of_active_objs--;
+	int freed = 0;
 
-	/* LEAVE CS */
-	leave_cs(cachep);
+	if (cpu_cache_make_room(cachep, ccp)) {
+		ccp->loaded->objs[(ccp->loaded->rounds)++] = objp;
+		STAT_ADD(ccp->frees, 1);
+		freed = 1;
+	}
 
-	return;
+	cpu_cache_leave(ccp);
+	return freed;
 }
 
-void kmem_cache_destroy(kmem_cache_t *cachep) {
-	/* does not have CS */
+size_t cpu_cache_free_bulk(kmem_cache_t* cachep, size_t n, void** objs) {
+	/* O(n), slab lists are not touched */
 
-	if (cachep == nullptr) return;
-	if (cachep->full != nullptr || cachep->partial != nullptr) {
-		/* cache that is about to be destroyed must not have active objects on it */
+	/* back to init state, outside of cc_mutex in case ctor allocates */
+	if (cachep->ctor != nullptr && !(cachep->flags & KMEM_CACHE_CONSTRUCTED)) {
+		for (size_t i = 0; i < n; i++) if (objs[i] != nullptr) cachep->ctor(objs[i]);
+	}
 
-		cachep->error = 1;
-		return;
+	kmem_cpu_cache_t* ccp = cpu_cache_enter(cachep);
+	if (ccp == nullptr) return 0;
+
+	size_t taken = 0, freed = 0;
+
+	while (taken < n && cpu_cache_make_room(cachep, ccp)) {
+		for (; taken < n && ccp->loaded->rounds < cachep->mag_size; taken++) {
+			if (objs[taken] == nullptr) continue;
+			ccp->loaded->objs[(ccp->loaded->rounds)++] = objs[taken];
+			freed++;
+		}
 	}
-	cache_remove_from_list(cachep);
-	cachep->growing = 0;
-	kmem_cache_shrink(cachep);
-	kmem_cache_free(&mutex_cache, cachep->mutex_placement);
-	kmem_cache_free(&cache_cache, cachep);
+	STAT_ADD(ccp->frees, freed);
+
+	cpu_cache_leave(ccp);
+	return taken;
 }
 
-void kmem_cache_info(kmem_cache_t* cachep) {
+void kmem_cache_drain_magazines(kmem_cache_t* cachep, int detach) {
+	/* if detach is 1 cpu caches are unlinked from cachep (used by destroy) */
 
-	/* ENTER CS */
-	enter_cs(cachep);
+	if (cachep == nullptr || cachep->mag_size == 0) return;
 
-#ifdef LINUX_LIKE_CACHE_INFO
-	int empty_slab_cnt = 0;
-	kmem_slab_t* slabp = cachep->empty;
+	kmem_magazine_t* mags = nullptr;
+	kmem_magazine_t* magp;
+
+	/* magazine_mutex is not held while cache is locked: slab allocation */
+	/* inside cache CS can register cpu cache of other cache (kmalloc)   */
+	magazine_mutex.lock();
+
+	/* take magazines of all threads */
+	kmem_cpu_cache_t* ccp = cachep->cpu_caches;
+	while (ccp != nullptr) {
+		kmem_cpu_cache_t* next = ccp->next_cc;
+
+		ccp->cc_mutex.lock();
+
+		if (ccp->loaded != nullptr) {
+			ccp->loaded->next_mag = mags;
+			mags = ccp->loaded;
+			ccp->loaded = nullptr;
+		}
+		if (ccp->previous != nullptr) {
+			ccp->previous->next_mag = mags;
+			mags = ccp->previous;
+			ccp->previous = nullptr;
+		}
+		if (detach == 1) {
+			/* owner thread will free it */
+			ccp->my_cache = nullptr;
+			ccp->next_cc = nullptr;
+			ccp->prev_cc = nullptr;
+		}
+
+		ccp->cc_mutex.unlock();
+		ccp = next;
+	}
+	if (detach == 1) cachep->cpu_caches = nullptr;
+
+	/* take magazines of depot */
+	cachep->depot_mutex->lock();
+	while (cachep->depot_full != nullptr) {
+		magp = cachep->depot_full;
+		cachep->depot_full = magp->next_mag;
+		magp->next_mag = mags;
+		mags = magp;
+	}
+	cachep->depot_full_num = 0;
+	cachep->depot_full_min = 0;
+	while (cachep->depot_empty != nullptr) {
+		magp = cachep->depot_empty;
+		cachep->depot_empty = magp->next_mag;
+		magp->next_mag = mags;
+		mags = magp;
+	}
+	cachep->depot_mutex->unlock();
+
+	magazine_mutex.unlock();
+
+	/* ENTER CS */
+	enter_cs(cachep);
+
+	/* return all objects to slabs, ctor ran when they were put in magazines */
+	for (magp = mags; magp != nullptr; magp = magp->next_mag) {
+		for (unsigned i = 0; i < magp->rounds; i++) {
+			kmem_cache_free_no_cs(cachep, magp->objs[i], 1);
+		}
+		magp->rounds = 0;
+	}
+
+	/* LEAVE CS */
+	leave_cs(cachep);
+
+	while (mags != nullptr) {
+		magp = mags;
+		mags = mags->next_mag;
+		kmem_cache_free(&mag_cache, magp);
+	}
+
+	/* freed magazines would pin their slabs until next reap */
+	/* ENTER CS */
+	enter_cs(&mag_cache);
+
+	kmem_cache_shrink_no_cs(&mag_cache);
+
+	/* LEAVE CS */
+	leave_cs(&mag_cache);
+}
+
+void cpu_caches_release() {
+	/* magazines are kept in depots, cpu caches are freed */
+
+	std::lock_guard<std::mutex> lock(magazine_mutex);
+
+	for (int i = 0; i < KMEM_MAX_CACHES; i++) {
+		kmem_cpu_cache_t* ccp = thread_caches.ccs[i];
+		if (ccp == nullptr) continue;
+		thread_caches.ccs[i] = nullptr;
+
+		ccp->cc_mutex.lock();
+
+		kmem_cache_t* cachep = ccp->my_cache;
+		if (cachep != nullptr) {
+			/* unlink from cpu cache list of cachep */
+			if (ccp->prev_cc != nullptr) ccp->prev_cc->next_cc = ccp->next_cc;
+			if (ccp->next_cc != nullptr) ccp->next_cc->prev_cc = ccp->prev_cc;
+			if (ccp == cachep->cpu_caches) cachep->cpu_caches = ccp->next_cc;
+
+			cachep->stat_exited_allocs += STAT_READ(ccp->allocs);
+			cachep->stat_exited_frees += STAT_READ(ccp->frees);
+
+			cachep->depot_mutex->lock();
+			depot_put(cachep, ccp->loaded);
+			depot_put(cachep, ccp->previous);
+			cachep->depot_mutex->unlock();
+		}
+
+		ccp->cc_mutex.unlock();
+		ccp->cc_mutex.~mutex();
+		kmem_cache_free(&cpu_cache_cache, ccp);
+	}
+}
+
+/* ----------------------------------------------------------- */
+/* -------------------------- CACHE -------------------------- */
+/* ----------------------------------------------------------- */
+
+kmem_cache_t *kmem_cache_create(const char *name, size_t size,
+	void(*ctor)(void *),
+	void(*dtor)(void *),
+	unsigned int mag_size,
+	unsigned int flags,
+	size_t align) {
+
+	if (kmem_cache_align(align, flags) == 0) return nullptr;
+	if (kmem_cache_check_name_availability(name) == 0) return nullptr;
+	
+	kmem_cache_t* cachep = (kmem_cache_t*)kmem_cache_alloc(&cache_cache);
+	if (cachep == nullptr) return nullptr; 
+
+	/* placement new operator does not allocate memory */
+	cachep->mutex_placement = kmem_cache_alloc(&mutex_cache);
+	cachep->cache_mutex = new (cachep->mutex_placement) std::mutex();
+
+	cachep->depot_mutex_placement = nullptr;
+	cachep->depot_mutex = nullptr;
+	if (mag_size > 0) {
+		cachep->depot_mutex_placement = kmem_cache_alloc(&mutex_cache);
+		cachep->depot_mutex = new (cachep->depot_mutex_placement) std::mutex();
+	}
+
+	kmem_cache_constructor(cachep, name, size, ctor, dtor, mag_size, flags, align);
+
+	/* no free cache id left, cache works without magazines */
+	if (cachep->mag_size == 0 && cachep->depot_mutex_placement != nullptr) {
+		kmem_cache_free(&mutex_cache, cachep->depot_mutex_placement);
+		cachep->depot_mutex_placement = nullptr;
+		cachep->depot_mutex = nullptr;
+	}
+
+	do {
+		cachep->trace_id = (cache_trace_ids.fetch_add(1, std::memory_order_relaxed) + 1) & 0xFFFF;
+	} while (cachep->trace_id == 0);
+
+	/* name was taken by cache created meanwhile */
+	if (cache_register(cachep) == 0) {
+		cache_release(cachep);
+		return nullptr;
+	}
+	TRACE_CACHE(TRACE_CACHE_CREATE, cachep, cachep);
+
+	return cachep;
+}
+
+void kmem_init(void *space, size_t block_num, int flags) {
+
+	/* assert MUST be true, else program will crash during cache_cache's         */
+	/* first slab allocation(for size-32 cache) since it needs kmalloc           */
+	/* for slab descriptor and it*s making size-N caches which provide kmalloc.  */
+	
+	assert(sizeof(kmem_cache_t)<OBJECT_TRESHOLD);
+
+	int block_is_lost = 0;
+
+	/* reaper of previous init must not walk old caches */
+	kmem_reaper_stop();
+
+	/* cached large blocks belong to previous arena */
+	for (int order = 0; order <= KMEM_LARGE_CACHE_MAX_ORDER; order++) large_cache_num[order] = 0;
+
+	/* cpu caches of calling thread were allocated from previous arena */
+	for (int i = 0; i < KMEM_MAX_CACHES; i++) thread_caches.ccs[i] = nullptr;
+
+	/* arena of previous init is not used anymore */
+	if (arena_owned) kmem_arena_unmap(arena_space, arena_size, arena_page_size);
+
+	/* own arena is page aligned, space argument is not used */
+	arena_owned = (flags & KMEM_OWN_ARENA) ? 1 : 0;
+	if (arena_owned) {
+		arena_size = block_num*BLOCK_SIZE;
+		space = arena_space = kmem_arena_map(arena_size, flags, &arena_page_size);
+		assert(space != nullptr);
+	}
+
+	/* align space with BLOCK_SIZE multiple and see if block is lost */
+	if (((uintptr_t)space & (BLOCK_SIZE - 1)) > 0) {
+		block_is_lost = 1;
+	}
+	space = (void*)(((uintptr_t)space + BLOCK_SIZE-1) & ~((uintptr_t)BLOCK_SIZE - 1));
+
+	cache_head.store(nullptr);
+	for (int i = 0; i < KMEM_CACHE_HASH_SIZE; i++) cache_hash[i] = nullptr;
+	block_N = 0;
+	while ((1 << block_N) < BLOCK_SIZE) block_N++;
+
+	size_t buddy_num_of_blocks = block_num - block_is_lost;
+	uintptr_t arena_end = (uintptr_t)space + buddy_num_of_blocks*BLOCK_SIZE;
+
+	/* one zone per node, each one gets equal part of space */
+	int zones = (flags & KMEM_NUMA_AWARE) ? buddy_numa_nodes() : 1;
+	int mode = (flags & KMEM_LAZY_BUDDY) ? BUDDY_LAZY : BUDDY_EAGER;
+	size_t part = buddy_num_of_blocks / zones;
+
+	for (int node = 0; node < zones; node++) {
+		void* part_space = (void*)((uintptr_t)space + node*part*BLOCK_SIZE);
+		size_t part_blocks = (node == zones - 1) ? buddy_num_of_blocks - node*part : part;
+
+		/* pages must be bound before zone structs touch them */
+		if (zones > 1) buddy_numa_bind(part_space, part_blocks*BLOCK_SIZE, node);
+
+		/* aligned space is given to buddy_init */
+		if (node == 0) start = (uintptr_t)buddy_init(part_space, &part_blocks, mode);
+		else buddy_zone_add(part_space, &part_blocks, node, mode);
+	}
+
+	/* block to slab mapping covers all zones, including their lost blocks */
+	buddy_num_of_blocks = (arena_end - start) / BLOCK_SIZE;
+
+	block_to_slab_mapping = (kmem_slab_t**)bmalloc(sizeof(kmem_slab_t*)*buddy_num_of_blocks);
+
+	for (size_t i = 0; i < buddy_num_of_blocks; i++) {
+		block_to_slab_mapping[i] = nullptr;
+	}
+
+	static_caches_init();
+
+	if (flags & KMEM_REAPER) kmem_reaper_start();
+}
+
+void* kmem_arena_map(size_t size, int flags, size_t* page_size) {
+
+	*page_size = BLOCK_SIZE;
+
+#ifdef _WIN32
+	/* large pages need SeLockMemoryPrivilege, so only small pages are used */
+	return VirtualAlloc(nullptr, size, MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE);
+#else
+	void* space;
+
+#ifdef MAP_HUGETLB
+	/* explicit huge pages, without MAP_NORESERVE map fails when there are */
+	/* not enough reserved, instead of SIGBUS on first touch             */
+	if (flags & KMEM_HUGEPAGES) {
+		size_t huge_size = (size + KMEM_HUGEPAGE_SIZE - 1) & ~(KMEM_HUGEPAGE_SIZE - 1);
+		space = mmap(nullptr, huge_size, PROT_READ | PROT_WRITE,
+			MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+		if (space != MAP_FAILED) {
+			*page_size = KMEM_HUGEPAGE_SIZE;
+			return space;
+		}
+	}
+#endif
+
+	/* map one huge page more, so arena can start on huge page boundary */
+	size_t map_size = size + ((flags & KMEM_HUGEPAGES) ? KMEM_HUGEPAGE_SIZE : 0);
+	space = mmap(nullptr, map_size, PROT_READ | PROT_WRITE,
+		MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+	if (space == MAP_FAILED) return nullptr;
+
+	if (flags & KMEM_HUGEPAGES) {
+		uintptr_t aligned = ((uintptr_t)space + KMEM_HUGEPAGE_SIZE - 1) & ~((uintptr_t)KMEM_HUGEPAGE_SIZE - 1);
+
+		/* unmap head and tail around aligned arena */
+		if (aligned > (uintptr_t)space) munmap(space, aligned - (uintptr_t)space);
+		if ((uintptr_t)space + map_size > aligned + size) {
+			munmap((void*)(aligned + size), (uintptr_t)space + map_size - (aligned + size));
+		}
+		space = (void*)aligned;
+
+#ifdef MADV_HUGEPAGE
+		/* transparent huge pages, released ranges split them back to small pages */
+		madvise(space, size, MADV_HUGEPAGE);
+#endif
+	}
+
+	return space;
+#endif
+}
+
+void kmem_arena_unmap(void* space, size_t size, size_t page_size) {
+	if (space == nullptr) return;
+
+#ifdef _WIN32
+	VirtualFree(space, 0, MEM_RELEASE);
+#else
+	/* explicit huge page mapping was rounded up to whole huge pages */
+	munmap(space, (size + page_size - 1) & ~(page_size - 1));
+#endif
+}
+
+size_t kmem_release(unsigned age_ms) {
+	/* memory handed to kmem_init can be anything, only own arena is released */
+	if (!arena_owned) return 0;
+
+	return buddy_release(age_ms, arena_page_size);
+}
+
+int kmem_cache_shrink(kmem_cache_t *cachep) {
+	if (cachep == nullptr) return 0;
+
+	/* objects kept in magazines go back to slabs first */
+	kmem_cache_drain_magazines(cachep, 0);
+
+	/* ENTER CS */
+	enter_cs(cachep);
+
+	remote_free_drain_no_cs(cachep);
+
+	int num_of_freed_blocks = kmem_cache_shrink_no_cs(cachep);
+
+	/* LEAVE CS */
+	leave_cs(cachep);
+
+	/* draining magazines can free slabs too */
+	kmem_release();
+
+	return num_of_freed_blocks;
+}
+
+void* kmem_cache_alloc(kmem_cache_t *cachep) {
+	if (cachep == nullptr) return nullptr;
+
+	void* objp = nullptr;
+
+	/* fast path, does not touch slab lists */
+	if (cachep->mag_size > 0) {
+		objp = cpu_cache_alloc(cachep);
+		if (objp != nullptr) {
+			TRACE_CACHE(TRACE_CACHE_ALLOC, cachep, objp);
+			return objp;
+		}
+	}
+
+	/* buddy out of blocks: memory is reclaimed once CS is left and allocation is retried */
+	/* once, nested allocations (slab descriptor of other cache) just fail                */
+	for (int reclaimed = 0; ; reclaimed = 1) {
+		/* ENTER CS */
+		enter_cs(cachep);
+
+		objp = kmem_cache_alloc_no_cs(cachep);
+		int retry = (objp == nullptr && !reclaimed && locks_held == 1 && !reclaim_running);
+
+		if (objp != nullptr) STAT_ADD(cachep->stat_allocs, 1);
+		else if (!retry) STAT_ADD(cachep->stat_alloc_failures, 1);
+
+		/* LEAVE CS */
+		leave_cs(cachep);
+
+		if (!retry) break;
+		kmem_reclaim(cachep->slab_size);
+	}
+
+	TRACE_CACHE(TRACE_CACHE_ALLOC, cachep, objp);
+	return objp;
+}
+
+void* kmem_cache_alloc_no_cs(kmem_cache_t *cachep) {
+	/* Does not have critical section */
+
+	kmem_slab_t* slabp = nullptr;
+	void* objp = nullptr;
+
+	/* remotely freed objects go back to slabs before cache grows */
+	remote_free_drain_no_cs(cachep);
+
+	/* fullest partial slab is used first, so emptier ones can drain and be reclaimed */
+	slabp = slab_partial_fullest(cachep);
+	if (slabp != nullptr) {
+		/* slab stays in its bin until it is full, it's already the first one */
+		/* taken from the fullest bin                                         */
+		objp = slab_alloc(slabp);
+		if (slabp->free == (unsigned)-1) {
+			slab_partial_remove(cachep, slabp);
+			slab_add_to_list(&cachep->full, slabp);
+		}
+		cachep->num_of_active_objs++;
+
+		return objp;
+	}
+
+	if (cachep->empty == nullptr) {
+		/* partial == nullptr && empty == nullptr */
+
+		slabp = new_slab(cachep);
+		if (slabp != nullptr) cachep->num_of_slabs++;
+	}
+	else{
+		/* partial == nullptr && empty != nullptr  */
+
+		slabp = cachep->empty;
+		assert(slabp->inuse == 0);
+		slab_remove_from_list(&cachep->empty, slabp);
+	}
+
+	/* use if program crashes while trying to reference nullptr */
+	/* to prove that buddy ran out of blocks.                   */
+	//assert(slabp != nullptr);
+
+	if (slabp == nullptr) cachep->error = 1;
+	else {
+		/* slabp is on no list */
+
+		objp = slab_alloc(slabp);
+		if (slabp->free == (unsigned)-1) slab_add_to_list(&cachep->full, slabp);
+		else slab_partial_add(cachep, slabp);
+		cachep->num_of_active_objs++;
+	}
+
+	return objp;
+}
+
+void kmem_cache_free(kmem_cache_t *cachep, void *objp) {
+	if (cachep == nullptr) return;
+	if (objp == nullptr) return;
+
+	TRACE_CACHE(TRACE_CACHE_FREE, cachep, objp);
+
+	/* fast path, does not touch slab lists */
+	if (cachep->mag_size > 0 && cpu_cache_free(cachep, objp) == 1) return;
+
+	/* cpu_cache_free ran ctor even if magazine could not take the object */
+	int constructed = (cachep->mag_size > 0 && cachep->ctor != nullptr && !(cachep->flags & KMEM_CACHE_CONSTRUCTED));
+
+	/* cache is busy, object is left to the thread holding the lock. constructed object */
+	/* (KMEM_CACHE_CONSTRUCTED or ctor ran above) is not pushed, link would overwrite   */
+	/* its state and only ctor could restore it                                         */
+	if (cachep->obj_size >= sizeof(void*) && !constructed && !(cachep->flags & KMEM_CACHE_CONSTRUCTED)) {
+		if (try_enter_cs(cachep) == 0) {
+			remote_free_push(cachep, objp);
+			return;
+		}
+	}
+	/* ENTER CS */
+	else enter_cs(cachep);
+
+	remote_free_drain_no_cs(cachep);
+	kmem_cache_free_no_cs(cachep, objp, constructed);
+	STAT_ADD(cachep->stat_frees, 1);
+
+	/* LEAVE CS */
+	leave_cs(cachep);
+}
+
+void kmem_cache_free_no_cs(kmem_cache_t *cachep, void *objp, int constructed) {
+	/* Does not have critical section */
+
+	size_t blockn = (((uintptr_t)objp - start) >> block_N);
+
+	kmem_slab_t* slabp = block_to_slab_mapping[blockn];
+
+	/* must not be nullptr */
+	assert(slabp != nullptr);
+
+	slab_free(slabp, objp, constructed);
+
+	if (slabp->inuse == 0) {
+		/* move from full/partial to empty */
+		if (slabp->my_cache->objs_per_slab == 1) 
+			slab_remove_from_list(&slabp->my_cache->full, slabp);
+		else slab_partial_remove(slabp->my_cache, slabp);
+
+		/* empty slab is freed by reaper or kmem_cache_shrink, on free path only */
+		/* above high watermark when reaper is off. growth is over once a slab   */
+		/* empties, so next shrink is not skipped                                */
+		slab_add_to_list(&slabp->my_cache->empty, slabp);
+		cachep->growing = 0;
+		kmem_cache_trim_no_cs(cachep);
+	}
+	else if (slabp->inuse == (slabp->my_cache->objs_per_slab - 1)) {
+		/* move from full to partial */
+		slab_remove_from_list(&slabp->my_cache->full, slabp);
+		slab_partial_add(slabp->my_cache, slabp);
+	}
+	
+	cachep->num_of_active_objs--;
+}
+
+void remote_free_push(kmem_cache_t* cachep, void* objp) {
+	/* O(1), lock-free */
+
+	void* head = cachep->remote_free.load(std::memory_order_relaxed);
+	do {
+		*(void**)objp = head;
+	} while (!cachep->remote_free.compare_exchange_weak(head, objp,
+		std::memory_order_release, std::memory_order_relaxed));
+}
+
+void remote_free_drain_no_cs(kmem_cache_t* cachep) {
+	/* O(number of remotely freed objects) */
+
+	/* whole list is taken at once, so there is no ABA problem */
+	if (cachep->remote_free.load(std::memory_order_relaxed) == nullptr) return;
+	void* objp = cachep->remote_free.exchange(nullptr, std::memory_order_acquire);
+
+	while (objp != nullptr) {
+		void* next = *(void**)objp;
+
+		/* objects are pushed unconstructed, slab_free runs ctor */
+		kmem_cache_free_no_cs(cachep, objp);
+		STAT_ADD(cachep->stat_frees, 1);
+		objp = next;
+	}
+}
+
+size_t kmem_cache_alloc_bulk(kmem_cache_t *cachep, size_t n, void **objs) {
+	if (cachep == nullptr) return 0;
+	if (objs == nullptr) return 0;
+
+	size_t allocated = 0;
+
+	/* objects freed one by one wait in magazines, they are used first */
+	if (cachep->mag_size > 0) allocated = cpu_cache_alloc_bulk(cachep, n, objs);
+
+	/* like kmem_cache_alloc, reclaims once if buddy runs out of blocks */
+	for (int reclaimed = 0; allocated < n; reclaimed = 1) {
+		/* ENTER CS */
+		enter_cs(cachep);
+
+		size_t from_slabs = kmem_cache_alloc_bulk_no_cs(cachep, n - allocated, objs + allocated);
+		allocated += from_slabs;
+		int retry = (allocated < n && !reclaimed && locks_held == 1 && !reclaim_running);
+
+		STAT_ADD(cachep->stat_allocs, from_slabs);
+		if (allocated < n && !retry) STAT_ADD(cachep->stat_alloc_failures, 1);
+
+		/* LEAVE CS */
+		leave_cs(cachep);
+
+		if (!retry) break;
+		kmem_reclaim((size_t)cachep->slab_size * ((n - allocated + cachep->objs_per_slab - 1) / cachep->objs_per_slab));
+	}
+
+	/* bulk is traced as single allocations */
+	for (size_t i = 0; i < allocated; i++) TRACE_CACHE(TRACE_CACHE_ALLOC, cachep, objs[i]);
+
+	return allocated;
+}
+
+size_t kmem_cache_alloc_bulk_no_cs(kmem_cache_t *cachep, size_t n, void **objs) {
+	/* Does not have critical section */
+
+	size_t allocated = 0;
+
+	remote_free_drain_no_cs(cachep);
+
+	while (allocated < n) {
+		kmem_slab_t* slabp;
+
+		/* slab is off lists while its run of free objects is taken */
+		if ((slabp = slab_partial_fullest(cachep)) != nullptr) slab_partial_remove(cachep, slabp);
+		else if (cachep->empty != nullptr) slabp = slab_remove_from_list(&cachep->empty, cachep->empty);
+		else {
+			slabp = new_slab(cachep);
+			if (slabp == nullptr) {
+				cachep->error = 1;
+				break;
+			}
+			cachep->num_of_slabs++;
+		}
+
+		while (allocated < n && slabp->free != (unsigned)-1) objs[allocated++] = slab_alloc(slabp);
+
+		if (slabp->free == (unsigned)-1) slab_add_to_list(&cachep->full, slabp);
+		else slab_partial_add(cachep, slabp);
+	}
+
+	cachep->num_of_active_objs += (unsigned)allocated;
+	return allocated;
+}
+
+void kmem_cache_free_bulk(kmem_cache_t *cachep, size_t n, void **objs) {
+	if (cachep == nullptr) return;
+	if (objs == nullptr || n == 0) return;
+
+	for (size_t i = 0; i < n; i++) TRACE_CACHE(TRACE_CACHE_FREE, cachep, objs[i]);
+
+	/* fast path, magazines take objects from the front of objs */
+	size_t taken = 0;
+	if (cachep->mag_size > 0) taken = cpu_cache_free_bulk(cachep, n, objs);
+	if (taken == n) return;
+
+	/* cpu_cache_free_bulk ran ctor on the rest too */
+	int constructed = (cachep->mag_size > 0 && cachep->ctor != nullptr && !(cachep->flags & KMEM_CACHE_CONSTRUCTED));
+
+	/* ENTER CS */
+	enter_cs(cachep);
+
+	kmem_cache_free_bulk_no_cs(cachep, n - taken, objs + taken, constructed);
+
+	/* LEAVE CS */
+	leave_cs(cachep);
+}
+
+void kmem_cache_free_bulk_no_cs(kmem_cache_t *cachep, size_t n, void **objs, int constructed) {
+	/* Does not have critical section */
+
+	size_t i = 0;
+
+	while (i < n) {
+		if (objs[i] == nullptr) {
+			i++;
+			continue;
+		}
+
+		kmem_slab_t* slabp = block_to_slab_mapping[((uintptr_t)objs[i] - start) >> block_N];
+
+		/* must not be nullptr */
+		assert(slabp != nullptr && slabp->my_cache == cachep);
+
+		unsigned int was_inuse = slabp->inuse;
+
+		/* run of objects of the same slab */
+		for (; i < n; i++) {
+			if (objs[i] == nullptr) continue;
+			if (block_to_slab_mapping[((uintptr_t)objs[i] - start) >> block_N] != slabp) break;
+
+			slab_free(slabp, objs[i], constructed);
+			cachep->num_of_active_objs--;
+			STAT_ADD(cachep->stat_frees, 1);
+		}
+
+		/* move slab once for the whole run */
+		if (was_inuse == cachep->objs_per_slab) slab_remove_from_list(&cachep->full, slabp);
+		else slab_partial_remove(cachep, slabp);
+
+		/* growth is over once a slab empties, as on single free path */
+		if (slabp->inuse == 0) {
+			slab_add_to_list(&cachep->empty, slabp);
+			cachep->growing = 0;
+		}
+		else slab_partial_add(cachep, slabp);
+	}
+
+	/* empty slabs are freed by reaper or kmem_cache_shrink, above high watermark here if reaper is off */
+	kmem_cache_trim_no_cs(cachep);
+}
+
+void kfree_bulk(size_t n, void **objs) {
+	if (objs == nullptr) return;
+
+	if (trace_enabled()) {
+		for (size_t i = 0; i < n; i++) {
+			if (objs[i] != nullptr) trace_record(TRACE_KFREE, 0, 0, objs[i]);
+		}
+	}
+
+	void* run[KMEM_BULK_RUN];
+
+	for (size_t i = 0; i < n; i++) {
+		if (objs[i] == nullptr) continue;
+
+		kmem_slab_t* slabp = block_to_slab_mapping[((uintptr_t)objs[i] - start) >> block_N];
+		assert(slabp != nullptr);
+
+		if (IS_LARGE_ENTRY(slabp)) {
+			kfree_large(objs[i], LARGE_ENTRY_ORDER(slabp));
+			objs[i] = nullptr;
+			continue;
+		}
+
+		kmem_cache_t* cachep = slabp->my_cache;
+
+		/* gather remaining pointers of this cache, in order, so runs of */
+		/* the same slab stay together                                   */
+		size_t run_len = 0;
+		for (size_t j = i; j < n; j++) {
+			if (objs[j] == nullptr) continue;
+			kmem_slab_t* runp = block_to_slab_mapping[((uintptr_t)objs[j] - start) >> block_N];
+			if (IS_LARGE_ENTRY(runp) || runp->my_cache != cachep) continue;
+
+			run[run_len++] = objs[j];
+			objs[j] = nullptr;
+
+			if (run_len == KMEM_BULK_RUN) {
+				kmem_cache_free_bulk(cachep, run_len, run);
+				run_len = 0;
+			}
+		}
+		kmem_cache_free_bulk(cachep, run_len, run);
+	}
+}
+
+void kmem_cache_destroy(kmem_cache_t *cachep) {
+	/* does not have CS */
+
+	if (cachep == nullptr) return;
+
+	TRACE_CACHE(TRACE_CACHE_DESTROY, cachep, cachep);
+
+	/* magazines of all threads are emptied and detached from cache */
+	kmem_cache_drain_magazines(cachep, 1);
+
+	/* ENTER CS */
+	enter_cs(cachep);
+
+	remote_free_drain_no_cs(cachep);
+
+	/* LEAVE CS */
+	leave_cs(cachep);
+
+	if (cachep->full != nullptr || cachep->partial_mask != 0) {
+		/* cache that is about to be destroyed must not have active objects on it */
+
+		cachep->error = 1;
+		return;
+	}
+	cache_list_mutex.lock();
+	cache_remove_from_list(cachep);
+	cache_list_mutex.unlock();
+
+	/* stats, reaper and trace walks which could still see cache are finished */
+	registry_synchronize();
+
+	cachep->growing = 0;
+	kmem_cache_shrink(cachep);
+
+	cache_release(cachep);
+}
+
+void cache_release(kmem_cache_t* cachep) {
+	/* cache is not on cache list */
+
+	if (cachep->cache_id >= 0) {
+		std::lock_guard<std::mutex> lock(magazine_mutex);
+		cache_ids[cachep->cache_id] = 0;
+	}
+	if (cachep->depot_mutex_placement != nullptr) 
+		kmem_cache_free(&mutex_cache, cachep->depot_mutex_placement);
+
+	kmem_cache_free(&mutex_cache, cachep->mutex_placement);
+	kmem_cache_free(&cache_cache, cachep);
+}
+
+void kmem_cache_info(kmem_cache_t* cachep) {
+
+	/* ENTER CS */
+	enter_cs(cachep);
+
+	remote_free_drain_no_cs(cachep);
+
+#ifdef LINUX_LIKE_CACHE_INFO
+	int empty_slab_cnt = 0;
+	kmem_slab_t* slabp = cachep->empty;
 	while (slabp != nullptr) {
 		slabp = slabp->next_slab;
 		empty_slab_cnt++;
@@ -710,10 +1939,12 @@ int kmem_cache_error(kmem_cache_t *cachep) {
 }
 
 void* kmalloc(size_t size) {
-	int pow = MIN_CACHE_SIZE;
-	while ((1 << pow) < size) pow++;
+	void* objp;
 
-	void* objp = kmem_cache_alloc(size_N_caches[pow - MIN_CACHE_SIZE].cs_cachep);
+	if (size > KMALLOC_MAX_SIZE) objp = kmalloc_large(size);
+	else objp = kmem_cache_alloc(size_N_caches[kmalloc_index(size)].cs_cachep);
+
+	if (trace_enabled()) trace_record(TRACE_KMALLOC, 0, size, objp);
 
 	return objp;
 }
@@ -721,10 +1952,559 @@ void* kmalloc(size_t size) {
 void kfree(const void *objp) {
 	if (objp == nullptr) return;
 
-	int blockn = ((((int)objp - start) & ~(BLOCK_SIZE - 1)) >> block_N);
+	if (trace_enabled()) trace_record(TRACE_KFREE, 0, 0, objp);
+
+	size_t blockn = (((uintptr_t)objp - start) >> block_N);
 	kmem_slab_t* slabp = block_to_slab_mapping[blockn];
 
 	assert(slabp != nullptr);
 
+	if (IS_LARGE_ENTRY(slabp)) {
+		kfree_large((void*)objp, LARGE_ENTRY_ORDER(slabp));
+		return;
+	}
+
 	kmem_cache_free(slabp->my_cache, (void*)objp);
-}
\ No newline at end of file
+}
+
+void kfree_sized(const void *objp, size_t size) {
+	if (objp == nullptr) return;
+
+	if (trace_enabled()) trace_record(TRACE_KFREE, 0, 0, objp);
+
+	if (size > KMALLOC_MAX_SIZE) {
+		assert(block_to_slab_mapping[((uintptr_t)objp - start) >> block_N] == LARGE_ENTRY(LARGE_ORDER(size)));
+		kfree_large((void*)objp, LARGE_ORDER(size));
+		return;
+	}
+
+	/* cache comes from size, magazine free does not touch block to slab mapping */
+	kmem_cache_t* cachep = size_N_caches[kmalloc_index(size)].cs_cachep;
+	assert(block_to_slab_mapping[((uintptr_t)objp - start) >> block_N]->my_cache == cachep);
+
+	kmem_cache_free(cachep, (void*)objp);
+}
+
+void* krealloc(const void *objp, size_t new_size) {
+	if (objp == nullptr) return kmalloc(new_size);
+	if (new_size == 0) {
+		kfree(objp);
+		return nullptr;
+	}
+
+	size_t blockn = (((uintptr_t)objp - start) >> block_N);
+	kmem_slab_t* slabp = block_to_slab_mapping[blockn];
+
+	assert(slabp != nullptr);
+
+	size_t old_size;
+
+	if (IS_LARGE_ENTRY(slabp)) {
+		int order = LARGE_ENTRY_ORDER(slabp);
+		old_size = SLAB_SIZE(order);
+
+		if (new_size > KMALLOC_MAX_SIZE) {
+			int new_order = LARGE_ORDER(new_size);
+
+			/* upper halves go back to buddy, or free right buddies are taken */
+			if (new_order < order) buddy_shrink((void*)objp, order, new_order);
+			if (new_order <= order || buddy_grow((void*)objp, order, new_order)) {
+				block_to_slab_mapping[blockn] = LARGE_ENTRY(new_order);
+				if (trace_enabled()) trace_record(TRACE_KREALLOC, 0, new_size, objp);
+				return (void*)objp;
+			}
+		}
+	}
+	else {
+		old_size = slabp->my_cache->obj_size;
+
+		/* same size class, nothing to do */
+		if (new_size <= KMALLOC_MAX_SIZE && kmalloc_class_size(kmalloc_index(new_size)) == old_size) {
+			if (trace_enabled()) trace_record(TRACE_KREALLOC, 0, new_size, objp);
+			return (void*)objp;
+		}
+	}
+
+	/* can't resize in place, traced as kmalloc and kfree */
+	void* new_objp = kmalloc(new_size);
+	if (new_objp == nullptr) return nullptr;
+
+	memcpy(new_objp, objp, (old_size < new_size) ? old_size : new_size);
+	kfree(objp);
+
+	return new_objp;
+}
+
+/* ---------------------------------------------------------- */
+/* --------------------- LARGE BUFFERS ---------------------- */
+/* ---------------------------------------------------------- */
+
+void* kmalloc_large(size_t size) {
+	int order = LARGE_ORDER(size);
+
+	void* blockp = nullptr;
+
+	/* recently freed block of the same order skips split and merge */
+	if (order <= KMEM_LARGE_CACHE_MAX_ORDER) {
+		std::lock_guard<std::mutex> lock(large_cache_mutex[order]);
+		if (large_cache_num[order] > 0) blockp = large_cache[order][--large_cache_num[order]].blockp;
+	}
+
+	if (blockp == nullptr) blockp = buddy_alloc(order);
+
+	/* no lock is held here, unless kmalloc is called by shrinker */
+	if (blockp == nullptr && kmem_reclaim_allowed()) {
+		kmem_reclaim((size_t)1 << order);
+		blockp = buddy_alloc(order);
+	}
+	if (blockp == nullptr) return nullptr;
+
+	/* only the first block is marked, kfree gets pointer to it */
+	block_to_slab_mapping[((uintptr_t)blockp - start) >> block_N] = LARGE_ENTRY(order);
+
+	return blockp;
+}
+
+void kfree_large(void* objp, int order) {
+	if (order <= KMEM_LARGE_CACHE_MAX_ORDER) {
+		std::lock_guard<std::mutex> lock(large_cache_mutex[order]);
+		if (large_cache_num[order] < KMEM_LARGE_CACHE_DEPTH) {
+			large_cache[order][large_cache_num[order]].blockp = objp;
+			large_cache[order][large_cache_num[order]].freed_at = kmem_now_ms();
+			large_cache_num[order]++;
+			return;
+		}
+	}
+
+	buddy_dealloc(objp);
+}
+
+size_t kmalloc_large_flush(unsigned age_ms) {
+	size_t num_of_freed_blocks = 0;
+	size_t now = kmem_now_ms();
+
+	for (int order = 0; order <= KMEM_LARGE_CACHE_MAX_ORDER; order++) {
+		void* old[KMEM_LARGE_CACHE_DEPTH];
+		unsigned int old_num = 0;
+
+		large_cache_mutex[order].lock();
+
+		/* the oldest blocks are at the bottom */
+		while (old_num < large_cache_num[order] && now - large_cache[order][old_num].freed_at >= age_ms) {
+			old[old_num] = large_cache[order][old_num].blockp;
+			old_num++;
+		}
+		for (unsigned int i = old_num; i < large_cache_num[order]; i++) {
+			large_cache[order][i - old_num] = large_cache[order][i];
+		}
+		large_cache_num[order] -= old_num;
+
+		large_cache_mutex[order].unlock();
+
+		for (unsigned int i = 0; i < old_num; i++) buddy_dealloc(old[i]);
+		num_of_freed_blocks += (size_t)old_num << order;
+	}
+
+	return num_of_freed_blocks;
+}
+
+/* ---------------------------------------------------------- */
+/* ----------------------- STATISTICS ----------------------- */
+/* ---------------------------------------------------------- */
+
+void kmem_cache_stats(kmem_cache_t* cachep, kmem_cache_stats_t* stats) {
+	if (cachep == nullptr || stats == nullptr) return;
+
+	/* geometry does not change after constructor */
+	strncpy(stats->name, cachep->name, CACHE_NAME_LEN);
+	stats->name[CACHE_NAME_LEN - 1] = '\0';
+	stats->obj_size = cachep->obj_size;
+	stats->objs_per_slab = cachep->objs_per_slab;
+	stats->blocks_per_slab = cachep->slab_size;
+
+	/* frees are read before allocs, so active objects are not negative */
+	size_t frees = STAT_READ(cachep->stat_frees);
+	size_t allocs = STAT_READ(cachep->stat_allocs);
+
+	/* magazine counters of all threads, only registration of cpu caches waits */
+	magazine_mutex.lock();
+	frees += cachep->stat_exited_frees;
+	allocs += cachep->stat_exited_allocs;
+	for (kmem_cpu_cache_t* ccp = cachep->cpu_caches; ccp != nullptr; ccp = ccp->next_cc) {
+		frees += STAT_READ(ccp->frees);
+		allocs += STAT_READ(ccp->allocs);
+	}
+	magazine_mutex.unlock();
+
+	stats->allocs = allocs;
+	stats->frees = frees;
+	stats->active_objs = (allocs > frees) ? allocs - frees : 0;
+
+	stats->shrinks = STAT_READ(cachep->stat_shrinks);
+	stats->grows = STAT_READ(cachep->stat_grows);
+	stats->alloc_failures = STAT_READ(cachep->stat_alloc_failures);
+
+	stats->num_of_slabs = (stats->grows > stats->shrinks) ? stats->grows - stats->shrinks : 0;
+	stats->total_objs = stats->num_of_slabs * cachep->objs_per_slab;
+
+	size_t meta = (cachep->off_slab == 1) ? sizeof(kmem_slab_t) + cachep->objs_per_slab * cachep->bufctl :
+		SLAB_META_SIZE(cachep->objs_per_slab, cachep->bufctl, 0, cachep->obj_align);
+	size_t used = cachep->objs_per_slab * cachep->obj_size + ((cachep->off_slab == 1) ? 0 : meta);
+
+	stats->meta_bytes = stats->num_of_slabs * meta;
+	stats->colour_bytes = stats->num_of_slabs * ((size_t)cachep->slab_size * BLOCK_SIZE - used);
+}
+
+int kmem_stats_snapshot(kmem_cache_stats_t* stats, int max) {
+	int n = 0;
+
+	/* walk holds no lock, destroyed caches are freed after it (registry_synchronize) */
+	unsigned int epoch = registry_enter();
+
+	FOR_EACH_CACHE(cachep) {
+		if (n < max) kmem_cache_stats(cachep, &stats[n]);
+		n++;
+	}
+
+	registry_leave(epoch);
+
+	return n;
+}
+
+size_t kmem_slabinfo_format(const kmem_cache_stats_t* stats, int n, char* buf, size_t size) {
+	size_t len = 0;
+
+	/* like snprintf, text is cut at size and length of whole text is returned */
+#define SLABINFO_PRINT(...) do { \
+		int written = snprintf(buf + ((len < size) ? len : size), (len < size) ? size - len : 0, __VA_ARGS__); \
+		if (written > 0) len += written; \
+	} while (0)
+
+	if (size > 0) buf[0] = '\0';
+
+	SLABINFO_PRINT("slabinfo - version: 2.1\n");
+	SLABINFO_PRINT("# name            <active_objs> <num_objs> <objsize> <objperslab> <pagesperslab>"
+		" : stats <allocs> <frees> <grows> <shrinks> <failures>"
+		" : waste <colour_bytes> <meta_bytes> : slabdata <num_slabs>\n");
+
+	for (int i = 0; i < n; i++) {
+		const kmem_cache_stats_t* sp = &stats[i];
+		SLABINFO_PRINT("%-17s %6zu %6zu %6zu %4u %4u : stats %10zu %10zu %6zu %6zu %4zu : waste %8zu %8zu : slabdata %6zu\n",
+			sp->name, sp->active_objs, sp->total_objs, sp->obj_size, sp->objs_per_slab, sp->blocks_per_slab,
+			sp->allocs, sp->frees, sp->grows, sp->shrinks, sp->alloc_failures,
+			sp->colour_bytes, sp->meta_bytes, sp->num_of_slabs);
+	}
+
+#undef SLABINFO_PRINT
+
+	return len;
+}
+
+/* ---------------------------------------------------------- */
+/* -------------------------- TRACE ------------------------- */
+/* ---------------------------------------------------------- */
+
+int kmem_trace_start(const char* path) {
+	if (trace_open(path, BLOCK_SIZE) != 0) return -1;
+
+	/* caches made before start are written first, replay needs their size, */
+	/* cache made meanwhile can be written twice                           */
+	unsigned int epoch = registry_enter();
+	FOR_EACH_CACHE(cachep) {
+		TRACE_CACHE(TRACE_CACHE_CREATE, cachep, cachep);
+	}
+	registry_leave(epoch);
+
+	return 0;
+}
+
+size_t kmem_trace_stop() {
+	return trace_close();
+}
+
+/* ---------------------------------------------------------- */
+/* ------------------------- REAPER ------------------------- */
+/* ---------------------------------------------------------- */
+
+size_t kmem_now_ms() {
+	return (size_t)std::chrono::duration_cast<std::chrono::milliseconds>(
+		std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+void kmem_cache_set_watermarks(kmem_cache_t* cachep, unsigned int empty_low, unsigned int empty_high) {
+	if (cachep == nullptr) return;
+
+	/* ENTER CS */
+	enter_cs(cachep);
+
+	cachep->empty_low = empty_low;
+	cachep->empty_high = empty_high;
+
+	/* LEAVE CS */
+	leave_cs(cachep);
+}
+
+void kmem_reaper_get(kmem_reaper_settings_t* settings) {
+	std::lock_guard<std::mutex> lock(reaper_mutex);
+	*settings = reaper_settings;
+}
+
+void kmem_reaper_set(const kmem_reaper_settings_t* settings) {
+	std::lock_guard<std::mutex> lock(reaper_mutex);
+	reaper_settings = *settings;
+
+	/* new interval is used right away */
+	reaper_cv.notify_all();
+}
+
+int kmem_cache_reap_no_cs(kmem_cache_t* cachep, const kmem_reaper_settings_t* settings) {
+	/* Does not have critical section */
+
+	unsigned int low = (cachep->empty_low != KMEM_WATERMARK_DEFAULT) ? cachep->empty_low : settings->empty_low;
+	unsigned int high = (cachep->empty_high != KMEM_WATERMARK_DEFAULT) ? cachep->empty_high : settings->empty_high;
+	if (high < low) high = low;
+
+	if (cachep->num_of_empty_slabs <= low) return 0;
+
+	/* slabs are added at the head of empty list, so the oldest is the last one */
+	kmem_slab_t* slabp = cachep->empty;
+	while (slabp->next_slab != nullptr) slabp = slabp->next_slab;
+
+	size_t now = kmem_now_ms();
+	int num_of_freed_blocks = 0;
+
+	/* above high watermark slabs are freed regardless of age, */
+	/* between watermarks only slabs older than age_ms are     */
+	while (slabp != nullptr && cachep->num_of_empty_slabs > low) {
+		if (cachep->num_of_empty_slabs <= high && now - slabp->empty_since < settings->age_ms) break;
+
+		kmem_slab_t* prev = slabp->prev_slab;
+		num_of_freed_blocks += slab_destroy(cachep, slabp);
+		slabp = prev;
+	}
+
+	return num_of_freed_blocks;
+}
+
+int kmem_cache_trim_no_cs(kmem_cache_t* cachep) {
+	/* Does not have critical section */
+
+	/* reaper frees them by age, settings are not read here since they need reaper_mutex */
+	if (reaper_running.load(std::memory_order_relaxed)) return 0;
+
+	unsigned int high = (cachep->empty_high != KMEM_WATERMARK_DEFAULT) ? cachep->empty_high : KMEM_REAPER_EMPTY_HIGH;
+	if (cachep->num_of_empty_slabs <= high) return 0;
+
+	/* slabs are added at the head of empty list, so the oldest is the last one */
+	kmem_slab_t* slabp = cachep->empty;
+	while (slabp->next_slab != nullptr) slabp = slabp->next_slab;
+
+	int num_of_freed_blocks = 0;
+	while (cachep->num_of_empty_slabs > high) {
+		kmem_slab_t* prev = slabp->prev_slab;
+		num_of_freed_blocks += slab_destroy(cachep, slabp);
+		slabp = prev;
+	}
+
+	return num_of_freed_blocks;
+}
+
+void kmem_cache_reap_depot(kmem_cache_t* cachep) {
+	/* full magazines which were not needed since last reap go back to slabs */
+
+	if (cachep->mag_size == 0) return;
+
+	kmem_magazine_t* mags = nullptr;
+	kmem_magazine_t* magp;
+
+	cachep->depot_mutex->lock();
+	for (unsigned int i = 0; i < cachep->depot_full_min && cachep->depot_full != nullptr; i++) {
+		magp = cachep->depot_full;
+		cachep->depot_full = magp->next_mag;
+		cachep->depot_full_num--;
+		magp->next_mag = mags;
+		mags = magp;
+	}
+	cachep->depot_full_min = cachep->depot_full_num;
+	cachep->depot_mutex->unlock();
+
+	if (mags == nullptr) return;
+
+	/* ENTER CS */
+	enter_cs(cachep);
+
+	for (magp = mags; magp != nullptr; magp = magp->next_mag) {
+		for (unsigned i = 0; i < magp->rounds; i++) {
+			kmem_cache_free_no_cs(cachep, magp->objs[i], 1);
+		}
+		magp->rounds = 0;
+	}
+
+	/* LEAVE CS */
+	leave_cs(cachep);
+
+	while (mags != nullptr) {
+		magp = mags;
+		mags = mags->next_mag;
+		kmem_cache_free(&mag_cache, magp);
+	}
+}
+
+int kmem_reap() {
+	kmem_reaper_settings_t settings;
+	kmem_reaper_get(&settings);
+
+	int num_of_freed_blocks = 0;
+
+	{
+		/* walk holds no lock, destroyed caches are freed after it (registry_synchronize) */
+		unsigned int epoch = registry_enter();
+
+		FOR_EACH_CACHE(cachep) {
+
+			kmem_cache_reap_depot(cachep);
+
+			/* ENTER CS */
+			enter_cs(cachep);
+
+			remote_free_drain_no_cs(cachep);
+			num_of_freed_blocks += kmem_cache_reap_no_cs(cachep, &settings);
+
+			/* LEAVE CS */
+			leave_cs(cachep);
+		}
+
+		registry_leave(epoch);
+	}
+
+	/* large kmalloc blocks not reused for age_ms go back to buddy */
+	num_of_freed_blocks += (int)kmalloc_large_flush(settings.age_ms);
+
+	/* free big blocks of own arena go back to the OS */
+	kmem_release();
+
+	return num_of_freed_blocks;
+}
+
+void kmem_reaper_main() {
+	std::unique_lock<std::mutex> lock(reaper_mutex);
+
+	while (reaper_running) {
+		reaper_cv.wait_for(lock, std::chrono::milliseconds(reaper_settings.interval_ms));
+		if (!reaper_running) break;
+
+		lock.unlock();
+		kmem_reap();
+		lock.lock();
+	}
+}
+
+void kmem_reaper_start() {
+	std::lock_guard<std::mutex> lock(reaper_mutex);
+	if (reaper_running) return;
+
+	reaper_running = 1;
+	reaper_thread = std::thread(kmem_reaper_main);
+}
+
+void kmem_reaper_stop() {
+	{
+		std::lock_guard<std::mutex> lock(reaper_mutex);
+		if (!reaper_running) return;
+
+		reaper_running = 0;
+		reaper_cv.notify_all();
+	}
+	reaper_thread.join();
+}
+
+/* ---------------------------------------------------------- */
+/* ------------------------- RECLAIM ------------------------ */
+/* ---------------------------------------------------------- */
+
+int kmem_reclaim_allowed() {
+	return locks_held == 0 && !reclaim_running;
+}
+
+int kmem_shrinker_register(kmem_shrinker_fn fn, void* arg) {
+	if (fn == nullptr) return -1;
+
+	std::lock_guard<std::mutex> lock(shrinker_mutex);
+
+	for (int i = 0; i < KMEM_MAX_SHRINKERS; i++) {
+		if (shrinkers[i].fn == nullptr) {
+			shrinkers[i].fn = fn;
+			shrinkers[i].arg = arg;
+			return i;
+		}
+	}
+
+	return -1;
+}
+
+void kmem_shrinker_unregister(int id) {
+	if (id < 0 || id >= KMEM_MAX_SHRINKERS) return;
+
+	std::lock_guard<std::mutex> lock(shrinker_mutex);
+	shrinkers[id].fn = nullptr;
+	shrinkers[id].arg = nullptr;
+}
+
+int kmem_cache_reclaim_no_cs(kmem_cache_t* cachep) {
+	/* Does not have critical section */
+
+	int num_of_freed_blocks = 0;
+
+	/* unlike shrink, slabs of growing cache are freed too, allocation failed anyway */
+	while (cachep->empty != nullptr) num_of_freed_blocks += slab_destroy(cachep, cachep->empty);
+	cachep->growing = 0;
+
+	return num_of_freed_blocks;
+}
+
+size_t kmem_reclaim(size_t blocks) {
+	/* shrinker allocating inside reclaim, or caller holding kmem lock, gets nothing */
+	if (!kmem_reclaim_allowed()) return 0;
+
+	reclaim_running = 1;
+
+	/* shrinkers first, entries they drop go to magazines and slabs freed below */
+	{
+		std::lock_guard<std::mutex> lock(shrinker_mutex);
+
+		for (int i = 0; i < KMEM_MAX_SHRINKERS; i++) {
+			if (shrinkers[i].fn != nullptr) shrinkers[i].fn(shrinkers[i].arg, blocks);
+		}
+	}
+
+	size_t num_of_freed_blocks = 0;
+
+	{
+		/* walk holds no lock, destroyed caches are freed after it (registry_synchronize) */
+		unsigned int epoch = registry_enter();
+
+		FOR_EACH_CACHE(cachep) {
+
+			/* objects kept by threads and depot go back to slabs */
+			kmem_cache_drain_magazines(cachep, 0);
+
+			/* ENTER CS */
+			enter_cs(cachep);
+
+			remote_free_drain_no_cs(cachep);
+			num_of_freed_blocks += kmem_cache_reclaim_no_cs(cachep);
+
+			/* LEAVE CS */
+			leave_cs(cachep);
+		}
+
+		registry_leave(epoch);
+	}
+
+	/* cached large kmalloc blocks of any age */
+	num_of_freed_blocks += kmalloc_large_flush(0);
+
+	reclaim_running = 0;
+
+	return num_of_freed_blocks;
+}
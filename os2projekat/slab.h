@@ -1,37 +1,164 @@
 #pragma once
 
 #include <stdlib.h>
+#include <stdint.h>
 #include "Buddy.h"
 #include <mutex>
+/* can be set at build time, e.g. to replay a trace with other block size */
+#ifndef BLOCK_SIZE
 #define BLOCK_SIZE (4096)
+#endif
 #define CACHE_L1_LINE_SIZE (64)
-#define SLAB_SIZE(n) ((1<<n)*BLOCK_SIZE)
+#define SLAB_SIZE(n) (((size_t)1<<(n))*BLOCK_SIZE)
+
+/* sizeof(kmem_slab_t) (checked in slab.cpp), slab geometry is computed at compile time with it. */
+/* descriptor has 4 pointers, 4 unsigned ints and size_t, none of them is padded: 56 B on 64-bit, */
+/* 36 B on 32-bit targets                                                                        */
+#define SLAB_DESC_SIZE (4*sizeof(void*) + 4*sizeof(unsigned int) + sizeof(size_t))
+
+/* objects on slab start at this alignment (alignof(max_align_t)), so object of */
+/* size which is a multiple of KMEM_MIN_ALIGN is aligned to KMEM_MIN_ALIGN      */
+#define KMEM_MIN_ALIGN (16)
+#define KMEM_ALIGN_UP(x, a) (((x) + (a) - 1) & ~((size_t)(a) - 1))
+
+/* free object indexes (bufctls) take 1, 2 or 4 bytes per object, the smallest one which */
+/* can hold objs_per_slab. caches without ctor/dtor (and KMEM_CACHE_CONSTRUCTED flag)   */
+/* keep index of next free object in the first bytes of free object instead, so their   */
+/* slabs have no index array                                                            */
+#define KMEM_BUFCTL_EMBEDDED (0)
+#define KMEM_BUFCTL_END(bufctl) ((bufctl) == 4 || (bufctl) == KMEM_BUFCTL_EMBEDDED ? \
+		0xFFFFFFFFu : (1u << (8*(bufctl))) - 1) // last free object, never a valid index
+
+/* bytes of slab taken by descriptor and free object indexes, 0 if they are off slab, */
+/* objects start after them at align (at least KMEM_MIN_ALIGN)                      */
+#define SLAB_META_SIZE(num, bufctl, off, align) \
+		((1-(off)) * KMEM_ALIGN_UP(SLAB_DESC_SIZE + (num)*(bufctl), align))
+
+/* size is object stride (object size padded to alignment) */
+#define LEFT_OVER(num, pow, size, bufctl, off, align) \
+		(SLAB_SIZE(pow) - SLAB_META_SIZE(num, bufctl, off, align) - (num)*(size))
+
+#define INSUFFICIENT_SLAB_SPACE(num, pow, size, bufctl, off, align) \
+		(SLAB_SIZE(pow) < SLAB_META_SIZE(num, bufctl, off, align) + (num)*(size))
+
+/* start of free object index array, entries are bufctl bytes wide */
+#define FREE_OBJS(slabp) ((unsigned char*)(((kmem_slab_t*)slabp)+1))
+#define CACHE_NAME_LEN (20)
+#define OBJECT_TRESHOLD ((BLOCK_SIZE)>>3) // 1/8 of block size
 
-#define LEFT_OVER(num, pow, size, off) \
-		(SLAB_SIZE(pow) - (1-off)*sizeof(kmem_slab_t) - (num)*(size+(1-off)*sizeof(int)))
+/* reaper defaults. while reaper runs empty slabs are never freed on free path, */
+/* without it free path keeps at most the high watermark of empty slabs        */
+#define KMEM_REAPER_INTERVAL_MS (500)
+#define KMEM_REAPER_EMPTY_LOW (1)     // empty slabs always kept per cache
+#define KMEM_REAPER_EMPTY_HIGH (8)    // above it empty slabs are freed regardless of age
+#define KMEM_REAPER_AGE_MS (2000)     // between watermarks, slabs empty for this long are freed
+#define KMEM_WATERMARK_DEFAULT ((unsigned int)-1)
 
-#define INSUFFICIENT_SLAB_SPACE(num, pow, size, off) \
-		((SLAB_SIZE(pow) - (1-off)*sizeof(kmem_slab_t)) < (num)*(size+(1-off)*sizeof(int)))
+/* shrinker callbacks kmem_reclaim can notify */
+#define KMEM_MAX_SHRINKERS (32)
 
-#define FREE_OBJS(slabp) ((int*)(((kmem_slab_t*)slabp)+1))
-#define CACHE_NAME_LEN (20)
-#define OBJECT_TRESHOLD ((BLOCK_SIZE)>>3) // 1/8 of block size
+/* partial slabs are kept in bins by inuse / objs_per_slab, allocation takes the fullest one */
+#define KMEM_PARTIAL_BINS (8)
+
+/* kfree_bulk frees pointers of one cache in runs of this size */
+#define KMEM_BULK_RUN (64)
+
+/* kmalloc size classes: 32, 48, 64, then 4 classes per power of two up to 128 KiB */
+#define KMALLOC_MIN_SIZE (32)
+#define KMALLOC_MAX_SIZE ((size_t)128 << 10)
+#define KMALLOC_CLASSES_NUM (47)
+#define KMALLOC_SMALL_MAX (4096)  // up to it classes are multiples of 16 B
+#define KMALLOC_SMALL_SHIFT (4)
+#define KMALLOC_LARGE_SHIFT (10)  // above KMALLOC_SMALL_MAX classes are multiples of 1 KiB
+
+/* kmalloc buffers above KMALLOC_MAX_SIZE come from buddy, recently freed */
+/* ones are kept per order up to KMEM_LARGE_CACHE_MAX_ORDER (4 MiB)       */
+#define KMEM_LARGE_CACHE_MAX_ORDER (10)
+#define KMEM_LARGE_CACHE_DEPTH (4)    // blocks kept per order
+
+/* magazine layer */
+#define KMEM_DEFAULT_MAG_SIZE (16) // objects per magazine
+#define KMEM_MAX_MAG_SIZE (32)
+#define KMEM_MAX_CACHES (1024)     // caches with magazine layer
+
+/* buckets of cache name hash, power of two */
+#define KMEM_CACHE_HASH_SIZE (1024)
 
 typedef struct kmem_slab_s kmem_slab_t;
 typedef struct kmem_cache_s kmem_cache_t;
+typedef struct kmem_magazine_s kmem_magazine_t;
+typedef struct kmem_cpu_cache_s kmem_cpu_cache_t;
+
+/* runtime settings of reaper */
+typedef struct kmem_reaper_settings_s {
+	unsigned int interval_ms;
+	unsigned int empty_low;
+	unsigned int empty_high;
+	unsigned int age_ms;
+} kmem_reaper_settings_t;
+
+/* shrinker of application cache: drops cached entries, so their kmem memory is freed, and */
+/* returns number of freed objects. blocks is number of buddy blocks failed allocation needs */
+typedef size_t (*kmem_shrinker_fn)(void* arg, size_t blocks);
+
+/* statistics of one cache, filled by kmem_stats_snapshot */
+typedef struct kmem_cache_stats_s {
+	char name[CACHE_NAME_LEN];
+	size_t obj_size;
+	unsigned int objs_per_slab;
+	unsigned int blocks_per_slab;
+	size_t active_objs;       // allocated and not yet freed by users
+	size_t total_objs;        // on all slabs, objects waiting in magazines included
+	size_t num_of_slabs;
+	size_t allocs;
+	size_t frees;
+	size_t grows;             // slabs allocated
+	size_t shrinks;           // slabs returned to buddy
+	size_t alloc_failures;
+	size_t colour_bytes;      // left over space of all slabs, used for colouring
+	size_t meta_bytes;        // slab descriptors and free object indexes
+} kmem_cache_stats_t;
 
 /* ----------------------------------------------------------- */
 /* -------------------------- CACHE -------------------------- */
 /* ----------------------------------------------------------- */
 
-void kmem_init(void *space, int block_num);
+/* kmem_init flags */
+#define KMEM_NUMA_AWARE (1)  // one buddy zone per NUMA node, slabs come from the local zone
+#define KMEM_LAZY_BUDDY (2)  // buddy zones defer coalescing (BUDDY_LAZY)
+#define KMEM_OWN_ARENA (4)   // space is ignored, arena is mapped by kmem_init and free memory is returned to the OS
+#define KMEM_HUGEPAGES (8)   // own arena is backed by 2 MiB huge pages (explicit if available, else transparent)
+#define KMEM_REAPER (16)     // starts reaper thread, which frees empty slabs (kmem_reaper_start), else free path does
+
+/* free big buddy blocks older than this are returned to the OS */
+#define KMEM_RELEASE_AGE_MS (1000)
+#define KMEM_HUGEPAGE_SIZE ((size_t)2 << 20)
+
+void kmem_init(void *space, size_t block_num, int flags = 0);
+
+/* Maps private anonymous memory for arena, sets *page_size to its page size */
+void* kmem_arena_map(size_t size, int flags, size_t* page_size);
+
+/* Unmaps arena of size mapped by kmem_arena_map with page_size it returned */
+void kmem_arena_unmap(void* space, size_t size, size_t page_size);
 
-/* Allocate cache */
+/* Returns free big blocks of own arena to the OS, returns bytes released */
+size_t kmem_release(unsigned age_ms = KMEM_RELEASE_AGE_MS);
+
+/* kmem_cache_create flags */
+#define KMEM_CACHE_CONSTRUCTED (1) // objects are freed in constructed state: ctor runs only on new slab, dtor only on reclaimed slab
+#define KMEM_CACHE_HWCACHE_ALIGN (2) // objects are aligned to CACHE_L1_LINE_SIZE, no two objects share a cache line
+
+/* Allocate cache, mag_size = 0 disables per-thread magazines. objects are aligned to align  */
+/* (power of two up to BLOCK_SIZE, 0 packs objects), nullptr if align is not valid           */
 kmem_cache_t* kmem_cache_create(const char *name, size_t size,
 	void(*ctor)(void *),
-	void(*dtor)(void *));
+	void(*dtor)(void *),
+	unsigned int mag_size = KMEM_DEFAULT_MAG_SIZE,
+	unsigned int flags = 0,
+	size_t align = 0);
 
-/* Shrink cache (thread safe) */
+/* Shrink cache, flushes all magazines and releases old free memory of own arena (thread safe) */
 int kmem_cache_shrink(kmem_cache_t *cachep); 
 
 /* Allocate one object from cache (thread safe) */
@@ -40,42 +167,222 @@ void* kmem_cache_alloc(kmem_cache_t *cachep);
 /* Deallocate one object from cache (thread safe) */
 void kmem_cache_free(kmem_cache_t *cachep, void *objp);
 
-/* Alloacate one small memory buffer (thread safe) */
+/* Allocate n objects from cache into objs, returns number of allocated objects (thread safe) */
+size_t kmem_cache_alloc_bulk(kmem_cache_t *cachep, size_t n, void **objs);
+
+/* Deallocate n objects of cache (thread safe) */
+void kmem_cache_free_bulk(kmem_cache_t *cachep, size_t n, void **objs);
+
+/* Alloacate one memory buffer, buffers above KMALLOC_MAX_SIZE are buddy blocks (thread safe) */
 void* kmalloc(size_t size);
 
-/* Deallocate one small memory buffer (thread safe) */
+/* Deallocate one memory buffer (thread safe) */
 void kfree(const void *objp);
 
-/* Deallocate cache */
+/* Deallocate memory buffer of size given to kmalloc (or last krealloc), size is */
+/* used instead of block to slab mapping lookup (thread safe)                     */
+void kfree_sized(const void *objp, size_t size);
+
+/* Deallocate n memory buffers of any size, entries of objs are set to nullptr (thread safe) */
+void kfree_bulk(size_t n, void **objs);
+
+/* Resize memory buffer, contents up to the smaller size are kept, returns nullptr and */
+/* keeps old buffer if there is no memory. krealloc(nullptr, size) is kmalloc(size),   */
+/* krealloc(objp, 0) is kfree(objp) and returns nullptr (thread safe)                  */
+void* krealloc(const void *objp, size_t new_size);
+
+/* Deallocate cache, waits for statistics and reaper walks which can still see it */
 void kmem_cache_destroy(kmem_cache_t *cachep);
 
+/* Returns cache with name, nullptr if there is none, O(1) (thread safe) */
+kmem_cache_t* kmem_cache_find(const char* name);
+
 /* Print cache info (thread safe) */
 void kmem_cache_info(kmem_cache_t *cachep);
 
 /* Print error message (thread safe) */
 int kmem_cache_error(kmem_cache_t *cachep);
 
+/* Registers shrinker called with arg by kmem_reclaim, returns its id, -1 if all slots are taken. */
+/* fn runs in thread whose allocation failed, so it must not block on locks held around          */
+/* allocations (try_lock them) and must not register or unregister shrinkers (thread safe)      */
+int kmem_shrinker_register(kmem_shrinker_fn fn, void* arg);
+
+/* Unregisters shrinker, once it returns fn is not running and won't be called (thread safe) */
+void kmem_shrinker_unregister(int id);
+
+/* Frees memory kept by kmem: calls shrinkers, drains magazines of all threads and returns all */
+/* empty slabs and cached large buffers to buddy, returns number of freed blocks. allocations */
+/* call it once buddy is out of blocks and retry (thread safe)                                */
+size_t kmem_reclaim(size_t blocks = 0);
+
+/* ---------------------------------------------------------- */
+/* ---------------------- SLAB GEOMETRY --------------------- */
+/* ---------------------------------------------------------- */
+
+/* slab layout of cache, filled by kmem_cache_geometry */
+typedef struct kmem_geometry_s {
+	unsigned int pow;         // slab has 2^pow blocks
+	unsigned int num;         // objects per slab
+	unsigned int colour_num;
+	int off_slab;             // slab descriptor is kept off slab
+	unsigned int bufctl;      // bytes per free object index, KMEM_BUFCTL_EMBEDDED if kept in free objects
+	size_t size;              // object stride, object size padded to align
+	size_t align;             // object array starts at multiple of it, at least KMEM_MIN_ALIGN
+	size_t colour_off;        // colour unit, multiple of CACHE_L1_LINE_SIZE and align
+} kmem_geometry_t;
+
+/* Calculate slab size and number of objects per slab, memory wastage is less then 1/8 of total slab size */
+constexpr void kmem_cache_estimate(unsigned* pow, unsigned* num, size_t size, unsigned bufctl, int off, size_t align) {
+	*pow = 0;
+	*num = 1;
+
+	while (!INSUFFICIENT_SLAB_SPACE((*num) + 1, *pow, size, bufctl, off, align)) (*num)++;
+	while (INSUFFICIENT_SLAB_SPACE(*num, *pow, size, bufctl, off, align) ||
+		   LEFT_OVER(*num, *pow, size, bufctl, off, align)>(SLAB_SIZE(*pow) >> 3)) {
+		(*pow)++;
+		while (!INSUFFICIENT_SLAB_SPACE((*num) + 1, *pow, size, bufctl, off, align)) (*num)++;
+	}
+}
+
+/* Returns alignment of object array of cache created with align and flags, 0 if align is not valid */
+constexpr size_t kmem_cache_align(size_t align, unsigned int flags) {
+	if ((align & (align - 1)) != 0 || align > BLOCK_SIZE) return 0;
+	if ((flags & KMEM_CACHE_HWCACHE_ALIGN) && align < CACHE_L1_LINE_SIZE) align = CACHE_L1_LINE_SIZE;
+	return (align < KMEM_MIN_ALIGN) ? KMEM_MIN_ALIGN : align;
+}
+
+/* Returns slab layout of cache with objects of size, evaluated at compile time for constant size. */
+/* stride is size rounded up to align given to kmem_cache_create (cache line for HWCACHE_ALIGN), */
+/* so aligned objects never share cache line or straddle it, and colours move slab by multiples  */
+/* of the alignment. align below KMEM_MIN_ALIGN does not pad stride, only start of object array  */
+/* is aligned to KMEM_MIN_ALIGN. has_ctor is 1 for caches with ctor or dtor, because their free */
+/* objects (and KMEM_CACHE_CONSTRUCTED ones) can't hold free list pointer                       */
+constexpr kmem_geometry_t kmem_cache_geometry(size_t size, size_t align = 0, unsigned int flags = 0, int has_ctor = 0) {
+	kmem_geometry_t geometry = { 0, 1, 0, 0, KMEM_BUFCTL_EMBEDDED, size, kmem_cache_align(align, flags), CACHE_L1_LINE_SIZE };
+	if (geometry.align == 0) return { 0, 0, 0, 0, KMEM_BUFCTL_EMBEDDED, size, 0, 0 };
+
+	size_t stride_align = ((flags & KMEM_CACHE_HWCACHE_ALIGN) && align < CACHE_L1_LINE_SIZE) ? CACHE_L1_LINE_SIZE : align;
+	if (stride_align > 1) geometry.size = KMEM_ALIGN_UP(size, stride_align);
+	if (geometry.align > CACHE_L1_LINE_SIZE) geometry.colour_off = geometry.align;
+
+	/* if object size is larger then treshold slab desc. is kept off slab */
+	geometry.off_slab = (geometry.size > OBJECT_TRESHOLD) ? 1 : 0;
+
+	/* narrowest index array which can index all objects, index 0xFF... marks the end */
+	if (has_ctor || (flags & KMEM_CACHE_CONSTRUCTED) || geometry.size < sizeof(unsigned int)) {
+		for (geometry.bufctl = 1; ; geometry.bufctl *= 2) {
+			kmem_cache_estimate(&geometry.pow, &geometry.num, geometry.size, geometry.bufctl, geometry.off_slab, geometry.align);
+			if (geometry.bufctl == 4 || geometry.num < KMEM_BUFCTL_END(geometry.bufctl)) break;
+		}
+	}
+	else kmem_cache_estimate(&geometry.pow, &geometry.num, geometry.size, geometry.bufctl, geometry.off_slab, geometry.align);
+	geometry.colour_num = (unsigned)(LEFT_OVER(geometry.num, geometry.pow, geometry.size, geometry.bufctl,
+		geometry.off_slab, geometry.align) / geometry.colour_off + 1);
+
+	return geometry;
+}
+
+/* ---------------------------------------------------------- */
+/* ---------------------- SIZE CLASSES ---------------------- */
+/* ---------------------------------------------------------- */
+
+/* Returns object size of kmalloc class i */
+constexpr size_t kmalloc_class_size(unsigned i) {
+	return (i < 3) ? KMALLOC_MIN_SIZE + 16 * i :
+		((size_t)64 << ((i - 3) / 4)) + ((size_t)16 << ((i - 3) / 4)) * ((i - 3) % 4 + 1);
+}
+
+/* size to class table, generated at compile time */
+struct kmalloc_index_table_t {
+	unsigned char small[(KMALLOC_SMALL_MAX >> KMALLOC_SMALL_SHIFT) + 1]; // by (size + 15) >> 4
+	unsigned char large[KMALLOC_MAX_SIZE >> KMALLOC_LARGE_SHIFT];        // by (size - 1) >> 10
+
+	constexpr kmalloc_index_table_t() : small(), large() {
+		/* entry gets smallest class which fits the largest size mapped to it */
+		unsigned c = 0;
+		for (unsigned i = 0; i < sizeof(small); i++) {
+			while (kmalloc_class_size(c) < ((size_t)i << KMALLOC_SMALL_SHIFT)) c++;
+			small[i] = (unsigned char)c;
+		}
+		c = 0;
+		for (unsigned i = 0; i < sizeof(large); i++) {
+			while (kmalloc_class_size(c) < ((size_t)(i + 1) << KMALLOC_LARGE_SHIFT)) c++;
+			large[i] = (unsigned char)c;
+		}
+	}
+};
+
+constexpr kmalloc_index_table_t kmalloc_index_table;
+
+static_assert(kmalloc_class_size(KMALLOC_CLASSES_NUM - 1) == KMALLOC_MAX_SIZE, "last kmalloc class must be KMALLOC_MAX_SIZE");
+static_assert(kmalloc_index_table.large[sizeof(kmalloc_index_table.large) - 1] == KMALLOC_CLASSES_NUM - 1, "kmalloc index table is broken");
+
+/* Returns kmalloc class of size, size must not be above KMALLOC_MAX_SIZE (O(1)) */
+inline unsigned kmalloc_index(size_t size) {
+	if (size <= KMALLOC_SMALL_MAX) return kmalloc_index_table.small[(size + 15) >> KMALLOC_SMALL_SHIFT];
+	return kmalloc_index_table.large[(size - 1) >> KMALLOC_LARGE_SHIFT];
+}
+
 /* ---------------------------------------------------------- */
 /* -------------------------- UTIL -------------------------- */
 /* ---------------------------------------------------------- */
 
-/* Removes cache from global cache list and returns removed cache */
+/* Removes cache from global cache list and name hash and returns removed cache, caller holds cache list mutex */
 kmem_cache_t* cache_remove_from_list(kmem_cache_t* cachep);
 
+/* Returns bucket of name in cache name hash */
+unsigned int cache_name_hash(const char* name);
+
+/* Returns cache with name, nullptr if there is none, caller holds cache list mutex */
+kmem_cache_t* cache_lookup(const char* name);
+
+/* Puts constructed cache on cache list and name hash, returns 0 if name is taken */
+int cache_register(kmem_cache_t* cachep);
+
+/* Frees mutexes, cache id and struct of cache which is not on cache list */
+void cache_release(kmem_cache_t* cachep);
+
+/* Starts walk of cache list, returns epoch for registry_leave. caches are not freed */
+/* until walk ends, create and allocations are not blocked by it (lock-free)         */
+unsigned int registry_enter();
+
+/* Ends walk of cache list */
+void registry_leave(unsigned int epoch);
+
+/* Waits until walks which could see caches removed from list before the call end */
+void registry_synchronize();
+
 /* Removes slab from *headp slab list and returns removed slab */
 kmem_slab_t* slab_remove_from_list(kmem_slab_t** headp, kmem_slab_t* slabp);
 
 /* Adds slab to *headp slab list */
 void slab_add_to_list(kmem_slab_t** headp, kmem_slab_t* slabp);
 
+/* Returns index of free object after free object i of slab, -1 after the last one */
+unsigned int slab_next_free(kmem_slab_t* slabp, unsigned int i);
+
+/* Sets index of free object after free object i of slab */
+void slab_set_next_free(kmem_slab_t* slabp, unsigned int i, unsigned int next);
+
+/* Adds slab to partial bin of its inuse */
+void slab_partial_add(kmem_cache_t* cachep, kmem_slab_t* slabp);
+
+/* Removes slab from its partial bin */
+void slab_partial_remove(kmem_cache_t* cachep, kmem_slab_t* slabp);
+
+/* Returns slab of the fullest non empty partial bin, nullptr if there are no partial slabs. */
+/* partial slabs are not moved on free, stale ones are moved to bin of their inuse here      */
+kmem_slab_t* slab_partial_fullest(kmem_cache_t* cachep);
+
 /* Creates and returns new slab for cache cachep */
 kmem_slab_t* new_slab(kmem_cache_t* cachep);
 
 /* Allocates one object of slab */
 void* slab_alloc(kmem_slab_t* slabp);
 
-/* Frees one object from slab */
-void slab_free(kmem_slab_t* slabp, void* objp);
+/* Frees one object from slab, ctor brings it back to init state unless constructed is 1 */
+void slab_free(kmem_slab_t* slabp, void* objp, int constructed = 0);
 
 /* Checks if object is on slab*/
 int is_obj_on_slab(kmem_slab_t* slabp, void* objp);
@@ -86,13 +393,19 @@ void add_empty_slab(kmem_cache_t* cachep); // for debugging
 /* Enters critical section for cache cachep */
 void enter_cs(kmem_cache_t* cachep);
 
+/* Enters critical section for cache cachep if it's free, returns 1 on success */
+int try_enter_cs(kmem_cache_t* cachep);
+
 /* Leaves critical section for cache cachep */
 void leave_cs(kmem_cache_t* cachep);
 
 /* Constructs cache on the given address */
 void kmem_cache_constructor(kmem_cache_t* cachep, const char* name, size_t size,
 	void(*ctor)(void*),
-	void(*dtor)(void*));
+	void(*dtor)(void*),
+	unsigned int mag_size,
+	unsigned int flags,
+	size_t align = 0);
 
 /* Initialize all size-N caches */
 void static_caches_init();
@@ -103,8 +416,8 @@ void kmem_slab_info(kmem_slab_t* slabp); // for debugging
 /* Ctor for small memory buffers */
 void cache_sizes_ctor(void* mem);
 
-/* Calculate slab size and number of objects per slab */
-void kmem_cache_estimate(unsigned* pow, unsigned* num, int size,  int off);
+/* Removes empty slab from cache, calls dtor and frees its memory, returns number of freed blocks */
+int slab_destroy(kmem_cache_t* cachep, kmem_slab_t* slabp);
 
 /* Calls ctor/dtor on all objects on this slab */
 void process_objects_on_slab(kmem_slab_t* slabp, void(*function)(void *));
@@ -115,4 +428,142 @@ void btsm_update(kmem_slab_t* slabp, kmem_slab_t* set_to);
 /* Check if cachep->name is already taken */
 int kmem_cache_check_name_availability(const char* name);
 
-int kmem_cache_shrink_no_cs(kmem_cache_t *cachep);
\ No newline at end of file
+int kmem_cache_shrink_no_cs(kmem_cache_t *cachep);
+
+/* Allocates one object from slab lists (inside cachep CS) */
+void* kmem_cache_alloc_no_cs(kmem_cache_t *cachep);
+
+/* Returns one object to slab lists, constructed is 1 if ctor already ran on it (inside cachep CS) */
+void kmem_cache_free_no_cs(kmem_cache_t *cachep, void *objp, int constructed = 0);
+
+/* Pushes object on remote free list of cache, used when cache is locked by other thread */
+void remote_free_push(kmem_cache_t* cachep, void* objp);
+
+/* Returns all objects from remote free list to slab lists (inside cachep CS) */
+void remote_free_drain_no_cs(kmem_cache_t* cachep);
+
+/* Allocates n objects, whole runs of free objects are taken from each slab (inside cachep CS) */
+size_t kmem_cache_alloc_bulk_no_cs(kmem_cache_t *cachep, size_t n, void **objs);
+
+/* Returns n objects, slab lists are updated once per run of objects of the same slab (inside cachep CS). */
+/* constructed is 1 if ctor already ran on the objects                                                   */
+void kmem_cache_free_bulk_no_cs(kmem_cache_t *cachep, size_t n, void **objs, int constructed = 0);
+
+/* ---------------------------------------------------------- */
+/* --------------------- LARGE BUFFERS ---------------------- */
+/* ---------------------------------------------------------- */
+
+/* Allocates buffer above KMALLOC_MAX_SIZE as one buddy block, its order is kept in btsm */
+void* kmalloc_large(size_t size);
+
+/* Frees large buffer of the given order, keeps it in per-order cache if there is room */
+void kfree_large(void* objp, int order);
+
+/* Returns cached large blocks, freed at least age_ms ago, to buddy, returns number of blocks */
+size_t kmalloc_large_flush(unsigned age_ms);
+
+/* ---------------------------------------------------------- */
+/* ------------------------ MAGAZINES ----------------------- */
+/* ---------------------------------------------------------- */
+
+/* Puts magazine to full or empty list of depot (inside depot CS) */
+void depot_put(kmem_cache_t* cachep, kmem_magazine_t* magp);
+
+/* Returns locked cpu cache of calling thread for cachep, registers it if needed */
+kmem_cpu_cache_t* cpu_cache_enter(kmem_cache_t* cachep);
+
+/* Unlocks cpu cache */
+void cpu_cache_leave(kmem_cpu_cache_t* ccp);
+
+/* Makes loaded magazine non-empty if possible, returns 1 on success (inside cc CS) */
+int cpu_cache_refill(kmem_cache_t* cachep, kmem_cpu_cache_t* ccp);
+
+/* Makes loaded magazine non-full if possible, returns 1 on success (inside cc CS) */
+int cpu_cache_make_room(kmem_cache_t* cachep, kmem_cpu_cache_t* ccp);
+
+/* Allocates one object from magazines of calling thread, nullptr on miss */
+void* cpu_cache_alloc(kmem_cache_t* cachep);
+
+/* Allocates up to n objects from magazines of calling thread and depot, returns their number */
+size_t cpu_cache_alloc_bulk(kmem_cache_t* cachep, size_t n, void** objs);
+
+/* Frees one object to magazines of calling thread, returns 0 on miss */
+int cpu_cache_free(kmem_cache_t* cachep, void* objp);
+
+/* Frees objects from the front of objs to magazines of calling thread and depot, returns how many */
+/* entries of objs were taken. ctor runs on all n objects                                          */
+size_t cpu_cache_free_bulk(kmem_cache_t* cachep, size_t n, void** objs);
+
+/* Moves magazines of all threads and depot back to slab lists */
+void kmem_cache_drain_magazines(kmem_cache_t* cachep, int detach);
+
+/* Hands magazines of calling thread to depots (called on thread exit) */
+void cpu_caches_release();
+
+/* ---------------------------------------------------------- */
+/* ----------------------- STATISTICS ----------------------- */
+/* ---------------------------------------------------------- */
+
+/* Fills stats of cachep, cache CS is not entered so allocation is not stalled (thread safe) */
+void kmem_cache_stats(kmem_cache_t* cachep, kmem_cache_stats_t* stats);
+
+/* Fills stats of up to max caches from cache list, returns number of all caches (thread safe) */
+int kmem_stats_snapshot(kmem_cache_stats_t* stats, int max);
+
+/* Formats n cache stats as /proc/slabinfo-like text, returns length of whole text (like snprintf) */
+size_t kmem_slabinfo_format(const kmem_cache_stats_t* stats, int n, char* buf, size_t size);
+
+/* ---------------------------------------------------------- */
+/* -------------------------- TRACE ------------------------- */
+/* ---------------------------------------------------------- */
+
+/* Starts writing kmem_cache_create/destroy/alloc/free, kmalloc/kfree/krealloc and bmalloc/bfree */
+/* to trace file (Trace.h), caches that exist are written first, returns 0 on success (thread safe) */
+int kmem_trace_start(const char* path);
+
+/* Stops tracing, writes buffers of all threads and closes file, returns number of records (thread safe) */
+size_t kmem_trace_stop();
+
+/* ---------------------------------------------------------- */
+/* ------------------------- REAPER ------------------------- */
+/* ---------------------------------------------------------- */
+
+/* Starts reaper thread, it calls kmem_reap every interval_ms */
+void kmem_reaper_start();
+
+/* Stops reaper thread and waits for it */
+void kmem_reaper_stop();
+
+/* Reads/changes reaper settings, changes are used from next pass (thread safe) */
+void kmem_reaper_get(kmem_reaper_settings_t* settings);
+void kmem_reaper_set(const kmem_reaper_settings_t* settings);
+
+/* Sets empty slab watermarks of one cache, KMEM_WATERMARK_DEFAULT follows reaper settings (thread safe) */
+void kmem_cache_set_watermarks(kmem_cache_t* cachep, unsigned int empty_low, unsigned int empty_high);
+
+/* One reaper pass over all caches, returns number of freed blocks (thread safe) */
+int kmem_reap();
+
+/* Returns full depot magazines, not taken since last reap, to slabs */
+void kmem_cache_reap_depot(kmem_cache_t* cachep);
+
+/* Frees empty slabs of cache by watermarks and age (inside cachep CS) */
+int kmem_cache_reap_no_cs(kmem_cache_t* cachep, const kmem_reaper_settings_t* settings);
+
+/* Frees the oldest empty slabs above high watermark of cache (default KMEM_REAPER_EMPTY_HIGH) */
+/* if reaper is not running, called on free path (inside cachep CS)                          */
+int kmem_cache_trim_no_cs(kmem_cache_t* cachep);
+
+/* Returns steady clock time in ms */
+size_t kmem_now_ms();
+
+/* ---------------------------------------------------------- */
+/* ------------------------- RECLAIM ------------------------ */
+/* ---------------------------------------------------------- */
+
+/* Returns 1 if calling thread holds no cache, cpu cache or depot lock and is not reclaiming, */
+/* only then failed allocation can reclaim without deadlock                                  */
+int kmem_reclaim_allowed();
+
+/* Frees all empty slabs of cache, growing cache too (inside cachep CS) */
+int kmem_cache_reclaim_no_cs(kmem_cache_t* cachep);
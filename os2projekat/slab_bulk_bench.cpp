@@ -0,0 +1,79 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <chrono>
+#include "slab.h"
+
+#define BULK_BENCH_BLOCK_NUMBER (1<<14)
+#define BULK_BENCH_ROUNDS (20000)
+#define BULK_BENCH_BATCH (32)   // objects allocated and freed together
+#define BULK_BENCH_OBJ_SIZE (96)
+
+//#define SLAB_BULK_BENCH
+
+void* bulk_bench_objs[BULK_BENCH_BATCH];
+
+double bulk_bench_single(kmem_cache_t* cachep) {
+	auto begin = std::chrono::steady_clock::now();
+
+	for (int r = 0; r < BULK_BENCH_ROUNDS; r++) {
+		for (int i = 0; i < BULK_BENCH_BATCH; i++) bulk_bench_objs[i] = kmem_cache_alloc(cachep);
+		for (int i = 0; i < BULK_BENCH_BATCH; i++) kmem_cache_free(cachep, bulk_bench_objs[i]);
+	}
+
+	auto end = std::chrono::steady_clock::now();
+	return 2.0 * BULK_BENCH_ROUNDS * BULK_BENCH_BATCH / std::chrono::duration<double>(end - begin).count();
+}
+
+double bulk_bench_bulk(kmem_cache_t* cachep) {
+	auto begin = std::chrono::steady_clock::now();
+
+	for (int r = 0; r < BULK_BENCH_ROUNDS; r++) {
+		kmem_cache_alloc_bulk(cachep, BULK_BENCH_BATCH, bulk_bench_objs);
+		kmem_cache_free_bulk(cachep, BULK_BENCH_BATCH, bulk_bench_objs);
+	}
+
+	auto end = std::chrono::steady_clock::now();
+	return 2.0 * BULK_BENCH_ROUNDS * BULK_BENCH_BATCH / std::chrono::duration<double>(end - begin).count();
+}
+
+double bulk_bench_kfree(int bulk) {
+	auto begin = std::chrono::steady_clock::now();
+
+	/* mixed sizes, so pointers belong to different size-N caches, */
+	/* kfree_bulk frees one run per cache to magazines of the thread */
+	for (int r = 0; r < BULK_BENCH_ROUNDS; r++) {
+		for (int i = 0; i < BULK_BENCH_BATCH; i++) bulk_bench_objs[i] = kmalloc(32 << (i % 4));
+		if (bulk) kfree_bulk(BULK_BENCH_BATCH, bulk_bench_objs);
+		else for (int i = 0; i < BULK_BENCH_BATCH; i++) kfree(bulk_bench_objs[i]);
+	}
+
+	auto end = std::chrono::steady_clock::now();
+	return 2.0 * BULK_BENCH_ROUNDS * BULK_BENCH_BATCH / std::chrono::duration<double>(end - begin).count();
+}
+
+#ifdef SLAB_BULK_BENCH
+
+int main() {
+	void *space = malloc(BLOCK_SIZE * BULK_BENCH_BLOCK_NUMBER);
+	kmem_init(space, BULK_BENCH_BLOCK_NUMBER);
+
+	kmem_cache_t* no_mags = kmem_cache_create("bulk no mags", BULK_BENCH_OBJ_SIZE, nullptr, nullptr, 0);
+	kmem_cache_t* mags = kmem_cache_create("bulk mags", BULK_BENCH_OBJ_SIZE, nullptr, nullptr);
+
+	printf("%-36s %-12s\n", "batch of 32", "ops/sec");
+	printf("%-36s %-12.0f\n", "single calls, no magazines", bulk_bench_single(no_mags));
+	printf("%-36s %-12.0f\n", "bulk calls, no magazines", bulk_bench_bulk(no_mags));
+	printf("%-36s %-12.0f\n", "single calls, magazines", bulk_bench_single(mags));
+	printf("%-36s %-12.0f\n", "bulk calls, magazines", bulk_bench_bulk(mags));
+	printf("%-36s %-12.0f\n", "kmalloc + kfree", bulk_bench_kfree(0));
+	printf("%-36s %-12.0f\n", "kmalloc + kfree_bulk", bulk_bench_kfree(1));
+
+	int failed = kmem_cache_error(no_mags) || kmem_cache_error(mags);
+
+	kmem_cache_destroy(no_mags);
+	kmem_cache_destroy(mags);
+
+	return failed;
+}
+
+#endif
@@ -0,0 +1,140 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <atomic>
+#include <new>
+#include <chrono>
+#include <thread>
+#include <vector>
+#include "slab.h"
+
+#define CTOR_BENCH_BLOCK_NUMBER (1<<14)
+#define CTOR_BENCH_ROUNDS (20000)
+#define CTOR_BENCH_BATCH (32)
+#define CTOR_BENCH_THREADS (4)
+#define CTOR_BENCH_CONTENDED_ROUNDS (20000)
+
+//#define SLAB_CTOR_BENCH
+
+/* object with non-trivial constructor, e.g. precomputed table */
+typedef struct ctor_bench_obj_s {
+	unsigned int table[64];
+	std::atomic<int> refcount;
+} ctor_bench_obj_t;
+
+std::atomic<long> ctor_bench_ctors;
+
+void ctor_bench_ctor(void* mem) {
+	ctor_bench_obj_t* objp = (ctor_bench_obj_t*)mem;
+
+	unsigned int x = 2463534242u;
+	for (int i = 0; i < 64; i++) {
+		x ^= x << 13; x ^= x >> 17; x ^= x << 5;
+		objp->table[i] = x;
+	}
+	new (&objp->refcount) std::atomic<int>(0);
+
+	ctor_bench_ctors++;
+}
+
+void* ctor_bench_objs[CTOR_BENCH_BATCH];
+
+double ctor_bench_run(unsigned int flags, long* ctors) {
+	kmem_cache_t* cachep = kmem_cache_create(flags ? "ctor constructed" : "ctor default",
+		sizeof(ctor_bench_obj_t), ctor_bench_ctor, nullptr, KMEM_DEFAULT_MAG_SIZE, flags);
+
+	ctor_bench_ctors = 0;
+
+	auto begin = std::chrono::steady_clock::now();
+
+	for (int r = 0; r < CTOR_BENCH_ROUNDS; r++) {
+		for (int i = 0; i < CTOR_BENCH_BATCH; i++) {
+			ctor_bench_obj_t* objp = (ctor_bench_obj_t*)kmem_cache_alloc(cachep);
+			objp->refcount++;
+			ctor_bench_objs[i] = objp;
+		}
+
+		/* objects are returned in constructed state */
+		for (int i = 0; i < CTOR_BENCH_BATCH; i++) {
+			((ctor_bench_obj_t*)ctor_bench_objs[i])->refcount--;
+			kmem_cache_free(cachep, ctor_bench_objs[i]);
+		}
+	}
+
+	auto end = std::chrono::steady_clock::now();
+
+	*ctors = ctor_bench_ctors;
+	kmem_cache_destroy(cachep);
+
+	return 2.0 * CTOR_BENCH_ROUNDS * CTOR_BENCH_BATCH / std::chrono::duration<double>(end - begin).count();
+}
+
+/* resource owned by constructed object, ctor takes it and dtor returns it */
+std::atomic<long> ctor_bench_resources;
+std::atomic<long> ctor_bench_dtors;
+
+void ctor_bench_res_ctor(void* mem) {
+	*(void**)mem = malloc(16);
+	ctor_bench_resources++;
+	ctor_bench_ctors++;
+}
+
+void ctor_bench_res_dtor(void* mem) {
+	free(*(void**)mem);
+	ctor_bench_resources--;
+	ctor_bench_dtors++;
+}
+
+/* threads free under contention without magazines, so frees find the cache busy. */
+/* ctor must run only for new slabs, returns 1 if ctors and dtors balance         */
+int ctor_bench_contended() {
+	kmem_cache_t* cachep = kmem_cache_create("ctor contended", sizeof(ctor_bench_obj_t), ctor_bench_res_ctor,
+		ctor_bench_res_dtor, 0, KMEM_CACHE_CONSTRUCTED);
+
+	ctor_bench_ctors = 0;
+	ctor_bench_dtors = 0;
+	ctor_bench_resources = 0;
+
+	std::vector<std::thread> threads;
+	for (int t = 0; t < CTOR_BENCH_THREADS; t++) {
+		threads.emplace_back([cachep]() {
+			void* objs[CTOR_BENCH_BATCH];
+			for (int r = 0; r < CTOR_BENCH_CONTENDED_ROUNDS; r++) {
+				for (int i = 0; i < CTOR_BENCH_BATCH; i++) objs[i] = kmem_cache_alloc(cachep);
+				for (int i = 0; i < CTOR_BENCH_BATCH; i++) kmem_cache_free(cachep, objs[i]);
+			}
+		});
+	}
+	for (std::thread& t : threads) t.join();
+
+	long ctors = ctor_bench_ctors;
+	kmem_cache_destroy(cachep);
+
+	printf("%-24s %-12s %-12ld dtor calls %ld, resources left %ld\n", "constructed, contended", "", ctors,
+		ctor_bench_dtors.load(), ctor_bench_resources.load());
+
+	return ctors == ctor_bench_dtors && ctor_bench_resources == 0;
+}
+
+#ifdef SLAB_CTOR_BENCH
+
+int main() {
+	void *space = malloc(BLOCK_SIZE * CTOR_BENCH_BLOCK_NUMBER);
+	kmem_init(space, CTOR_BENCH_BLOCK_NUMBER);
+
+	long ctors;
+
+	printf("%-24s %-12s %-12s\n", "mode", "ops/sec", "ctor calls");
+
+	double ops = ctor_bench_run(0, &ctors);
+	printf("%-24s %-12.0f %-12ld\n", "ctor on every free", ops, ctors);
+
+	ops = ctor_bench_run(KMEM_CACHE_CONSTRUCTED, &ctors);
+	printf("%-24s %-12.0f %-12ld\n", "constructed state", ops, ctors);
+
+	int failed = !ctor_bench_contended();
+
+	printf(failed ? "FAILED\n" : "OK\n");
+	return failed;
+}
+
+#endif
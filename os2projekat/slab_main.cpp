@@ -48,7 +48,7 @@ int main() {
 	char buffer[1024];
 	unsigned int size = 600;
 
-	sprintf_s(buffer, 1024, "my size-%d", size);
+	snprintf(buffer, 1024, "my size-%u", size);
 
 	kmem_cache_t* mc = kmem_cache_create(buffer, size, ctor, dtor);
 
@@ -0,0 +1,121 @@
+#include <stdio.h>
+#include <string.h>
+#include <thread>
+#include <chrono>
+#include <atomic>
+#include <vector>
+#include "Buddy.h"
+#include "slab.h"
+
+#define SLABINFO_BLOCK_NUMBER (1 << 15)
+#define SLABINFO_THREADS (4)
+#define SLABINFO_OPS (200000)
+#define SLABINFO_HELD (64)          // objects held by thread at once
+#define SLABINFO_MAX_CACHES (128)
+
+//#define SLABINFO_MAIN
+
+static std::atomic<int> slabinfo_running;
+
+void slabinfo_worker(kmem_cache_t* cachep, int id) {
+	void* held[SLABINFO_HELD] = { nullptr };
+
+	for (int i = 0; i < SLABINFO_OPS; i++) {
+		int j = (i * 7 + id) % SLABINFO_HELD;
+		if (held[j] != nullptr) {
+			if (j % 2) kfree(held[j]);
+			else kmem_cache_free(cachep, held[j]);
+		}
+		held[j] = (j % 2) ? kmalloc(16 + (size_t)(i % 2000)) : kmem_cache_alloc(cachep);
+	}
+
+	for (int j = 0; j < SLABINFO_HELD; j++) {
+		if (j % 2) kfree(held[j]);
+		else kmem_cache_free(cachep, held[j]);
+	}
+}
+
+#ifdef SLABINFO_MAIN
+
+kmem_cache_stats_t slabinfo_stats[SLABINFO_MAX_CACHES];
+char slabinfo_text[1 << 16];
+
+int main() {
+	void *space = malloc(BLOCK_SIZE * (size_t)SLABINFO_BLOCK_NUMBER);
+	kmem_init(space, SLABINFO_BLOCK_NUMBER);
+
+	kmem_cache_t* cachep = kmem_cache_create("slabinfo test", 200, nullptr, nullptr);
+
+	std::vector<std::thread> threads;
+	for (int i = 0; i < SLABINFO_THREADS; i++) threads.push_back(std::thread(slabinfo_worker, cachep, i));
+
+	/* snapshots are taken while workers allocate, without entering cache CS */
+	int snapshots = 0;
+	double total_us = 0;
+	slabinfo_running = 1;
+	std::thread snapper([&]() {
+		while (slabinfo_running) {
+			auto begin = std::chrono::steady_clock::now();
+			kmem_stats_snapshot(slabinfo_stats, SLABINFO_MAX_CACHES);
+			auto end = std::chrono::steady_clock::now();
+
+			total_us += std::chrono::duration<double, std::micro>(end - begin).count();
+			snapshots++;
+		}
+	});
+
+	for (int i = 0; i < SLABINFO_THREADS; i++) threads[i].join();
+	slabinfo_running = 0;
+	snapper.join();
+
+	printf("%d snapshots during load, %.1f us each\n\n", snapshots, total_us / snapshots);
+
+	int failed = 0;
+
+	int n = kmem_stats_snapshot(slabinfo_stats, SLABINFO_MAX_CACHES);
+	if (n > SLABINFO_MAX_CACHES) n = SLABINFO_MAX_CACHES;
+
+	/* only caches that were used are printed */
+	int used = 0;
+	for (int i = 0; i < n; i++) {
+		if (slabinfo_stats[i].allocs == 0) continue;
+		if (strcmp(slabinfo_stats[i].name, "slabinfo test") == 0) {
+			if (slabinfo_stats[i].active_objs != 0 ||
+				slabinfo_stats[i].allocs != (size_t)SLABINFO_THREADS * SLABINFO_OPS / 2) failed = 1;
+		}
+		slabinfo_stats[used++] = slabinfo_stats[i];
+	}
+
+	size_t len = kmem_slabinfo_format(slabinfo_stats, used, slabinfo_text, sizeof(slabinfo_text));
+	if (len >= sizeof(slabinfo_text)) failed = 1;
+	printf("%s\n", slabinfo_text);
+
+	buddy_zone_stats_t zone_stats[BUDDY_MAX_ZONES];
+	int zones = buddy_stats_snapshot(zone_stats, BUDDY_MAX_ZONES);
+	for (int z = 0; z < zones; z++) {
+		buddy_zone_stats_t* zp = &zone_stats[z];
+		printf("zone %d (node %d): %zu/%zu blocks free, %zu lazy, allocs %zu, frees %zu, splits %zu, merges %zu, failures %zu\n",
+			z, zp->node, zp->free_blocks, zp->blocks, zp->lazy_blocks,
+			zp->allocs, zp->frees, zp->splits, zp->merges, zp->alloc_failures);
+	}
+
+	/* free histogram, fragmentation index is printed like Linux extfrag_index */
+	buddy_free_info_t free_info[BUDDY_MAX_ZONES];
+	zones = buddy_free_snapshot(free_info, BUDDY_MAX_ZONES);
+	for (int z = 0; z < zones; z++) {
+		buddy_free_info_t* ip = &free_info[z];
+		printf("\nzone %d free blocks by order, largest free order %d\n", z, ip->largest_free_order);
+		printf("%-6s %-8s %-8s %-10s\n", "order", "free", "lazy", "extfrag");
+		for (int k = 0; k < ip->orders; k++) {
+			printf("%-6d %-8zu %-8zu %-10.3f\n", k, ip->free[k], ip->lazy[k], ip->frag_index[k] / 1000.0);
+		}
+		if (ip->largest_free_order > buddy_largest_free_order()) failed = 1;
+	}
+
+	/* space is not freed, magazines of this thread are released on exit */
+
+	printf(failed ? "FAILED\n" : "OK\n");
+	return failed;
+}
+
+#endif
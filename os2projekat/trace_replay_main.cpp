@@ -0,0 +1,413 @@
+#include <stdio.h>
+#include <string.h>
+#include <thread>
+#include <chrono>
+#include <vector>
+#include <algorithm>
+#include <unordered_map>
+#include "Buddy.h"
+#include "slab.h"
+#include "Trace.h"
+
+/* Linux build, BLOCK_SIZE of replay can differ from the traced program:    */
+/*   g++ -std=c++17 -O2 -pthread -DTRACE_REPLAY_MAIN [-DBLOCK_SIZE=8192]   */
+/*       BitMapTree.cpp Buddy.cpp Trace.cpp slab.cpp trace_replay_main.cpp */
+/*   ./trace_replay                   captures sample workload and replays it */
+/*   ./trace_replay capture <file>    captures sample workload only           */
+/*   ./trace_replay <file>            replays trace of another program        */
+
+#define REPLAY_BLOCK_NUMBER ((size_t)1 << 17)
+#define REPLAY_THREADS (4)
+#define REPLAY_OPS (100000)          // operations per thread of sample workload
+#define REPLAY_HELD (512)            // objects held per thread
+#define REPLAY_NONE ((uint32_t)-1)
+
+/* size classes used by replay of kmalloc/krealloc sizes */
+#define REPLAY_CLASSES_DENSE (0)     // kmalloc classes as built
+#define REPLAY_CLASSES_POW2 (1)      // sizes rounded up to power of two first
+
+//#define TRACE_REPLAY_MAIN
+
+/* record with object id resolved to slot, so replay loop does not hash */
+typedef struct replay_op_s {
+	uint32_t slot;                   // REPLAY_NONE for frees of objects allocated before trace
+	uint32_t size;
+	uint16_t cache;
+	uint8_t op;
+} replay_op_t;
+
+typedef struct replay_trace_s {
+	std::vector<replay_op_t> ops;
+	uint32_t slots;
+	uint32_t block_size;
+	unsigned int threads;
+	size_t unmatched;                // frees and reallocs of unknown objects
+	size_t failed;                   // allocations that failed in traced program
+} replay_trace_t;
+
+typedef struct replay_result_s {
+	double sec;
+	size_t peak_blocks;              // buddy blocks taken, at peak
+	size_t peak_live;                // bytes requested by live objects, at peak
+	size_t end_blocks;               // at the end of trace, before leftovers are freed
+	size_t end_live;
+	size_t failed;                   // allocations that failed in replay
+} replay_result_t;
+
+/* ---------------------------------------------------------- */
+/* ------------------------- CAPTURE ------------------------ */
+/* ---------------------------------------------------------- */
+
+/* sample workload: cache objects, kmalloc of mixed sizes, growing buffers and buddy blocks */
+void replay_worker(kmem_cache_t* cachep, int id) {
+	void* held[REPLAY_HELD] = { nullptr };
+	size_t sizes[REPLAY_HELD] = { 0 };
+	uint32_t rand = 2463534242u + id;
+
+	for (int i = 0; i < REPLAY_OPS; i++) {
+		rand ^= rand << 13;
+		rand ^= rand >> 17;
+		rand ^= rand << 5;
+
+		int j = rand % REPLAY_HELD;
+		int kind = j % 8;
+
+		if (held[j] != nullptr) {
+			if (kind < 4) kmem_cache_free(cachep, held[j]);
+			else if (kind < 7) {
+				/* some buffers grow instead of being freed */
+				if ((rand >> 16) % 4 == 0 && sizes[j] < ((size_t)64 << 10)) {
+					sizes[j] += sizes[j] / 2;
+					void* newp = krealloc(held[j], sizes[j]);
+					if (newp != nullptr) held[j] = newp;
+					continue;
+				}
+				kfree(held[j]);
+			}
+			else bfree(held[j]);
+			held[j] = nullptr;
+			continue;
+		}
+
+		if (kind < 4) held[j] = kmem_cache_alloc(cachep);
+		else if (kind < 7) {
+			sizes[j] = 16 + (rand >> 8) % ((rand & 1) ? 200 : 3000);
+			held[j] = kmalloc(sizes[j]);
+		}
+		else held[j] = bmalloc(BLOCK_SIZE * (1 + (rand >> 8) % 3));
+	}
+
+	for (int j = 0; j < REPLAY_HELD; j++) {
+		if (held[j] == nullptr) continue;
+		if (j % 8 < 4) kmem_cache_free(cachep, held[j]);
+		else if (j % 8 < 7) kfree(held[j]);
+		else bfree(held[j]);
+	}
+}
+
+size_t replay_capture(const char* path) {
+	if (kmem_trace_start(path) != 0) return 0;
+
+	kmem_cache_t* cachep = kmem_cache_create("replay node", 96, nullptr, nullptr);
+
+	std::vector<std::thread> threads;
+	for (int i = 0; i < REPLAY_THREADS; i++) threads.push_back(std::thread(replay_worker, cachep, i));
+	for (int i = 0; i < REPLAY_THREADS; i++) threads[i].join();
+
+	kmem_cache_destroy(cachep);
+
+	return kmem_trace_stop();
+}
+
+/* ---------------------------------------------------------- */
+/* -------------------------- LOAD -------------------------- */
+/* ---------------------------------------------------------- */
+
+/* reads trace, sorts it by time and gives each live object a slot, returns 0 on success */
+int replay_load(const char* path, replay_trace_t* tp) {
+	FILE* f = fopen(path, "rb");
+	if (f == nullptr) return -1;
+
+	trace_header_t header;
+	if (fread(&header, sizeof(header), 1, f) != 1 || memcmp(header.magic, TRACE_MAGIC, sizeof(header.magic)) != 0 ||
+		header.record_size != sizeof(trace_record_t)) {
+		fclose(f);
+		return -1;
+	}
+
+	std::vector<trace_record_t> records;
+	trace_record_t rec;
+	while (fread(&rec, sizeof(rec), 1, f) == 1) records.push_back(rec);
+	fclose(f);
+
+	/* records of one thread keep their order on equal times */
+	std::stable_sort(records.begin(), records.end(),
+		[](const trace_record_t& a, const trace_record_t& b) { return a.time_ns < b.time_ns; });
+
+	tp->ops.clear();
+	tp->slots = 0;
+	tp->block_size = header.block_size;
+	tp->threads = 0;
+	tp->unmatched = 0;
+	tp->failed = 0;
+
+	std::unordered_map<uint64_t, uint32_t> live;
+	std::vector<uint32_t> free_slots;
+	char seen[256] = { 0 };
+
+	for (const trace_record_t& r : records) {
+		if (!seen[r.thread]) {
+			seen[r.thread] = 1;
+			tp->threads++;
+		}
+
+		replay_op_t op = { REPLAY_NONE, r.size, r.cache, r.op };
+
+		switch (r.op) {
+		case TRACE_CACHE_CREATE:
+		case TRACE_CACHE_DESTROY:
+			break;
+
+		case TRACE_CACHE_ALLOC:
+		case TRACE_KMALLOC:
+		case TRACE_BMALLOC:
+			if (r.objp == 0) {
+				tp->failed++;
+				continue;
+			}
+			if (free_slots.empty()) op.slot = tp->slots++;
+			else {
+				op.slot = free_slots.back();
+				free_slots.pop_back();
+			}
+			live[r.objp] = op.slot;
+			break;
+
+		case TRACE_CACHE_FREE:
+		case TRACE_KFREE:
+		case TRACE_BFREE:
+		case TRACE_KREALLOC: {
+			auto it = live.find(r.objp);
+			if (it == live.end()) {
+				tp->unmatched++;
+				continue;
+			}
+			op.slot = it->second;
+			if (r.op != TRACE_KREALLOC) {
+				free_slots.push_back(op.slot);
+				live.erase(it);
+			}
+			break;
+		}
+
+		default:
+			continue;
+		}
+
+		tp->ops.push_back(op);
+	}
+
+	return 0;
+}
+
+/* ---------------------------------------------------------- */
+/* ------------------------- REPLAY ------------------------- */
+/* ---------------------------------------------------------- */
+
+size_t replay_size(size_t size, int classes) {
+	if (classes == REPLAY_CLASSES_DENSE || size > KMALLOC_MAX_SIZE) return size;
+
+	size_t pow2 = KMALLOC_MIN_SIZE;
+	while (pow2 < size) pow2 <<= 1;
+	return pow2;
+}
+
+size_t replay_used_blocks() {
+	buddy_zone_stats_t stats[BUDDY_MAX_ZONES];
+	int zones = buddy_stats_snapshot(stats, BUDDY_MAX_ZONES);
+
+	size_t used = 0;
+	for (int z = 0; z < zones; z++) used += stats[z].blocks - stats[z].free_blocks - stats[z].lazy_blocks;
+	return used;
+}
+
+/* replays trace in time order on calling thread, with sample buddy usage is read after */
+/* every operation, without it run is timed. leftover objects and caches are freed      */
+replay_result_t replay_run(const replay_trace_t* tp, int classes, int sample) {
+	replay_result_t res = { 0, 0, 0, 0, 0, 0 };
+
+	std::vector<void*> objs(tp->slots, nullptr);
+	std::vector<size_t> sizes(tp->slots, 0);
+	std::vector<kmem_cache_t*> caches(1 << 16, nullptr);
+	size_t live = 0;
+	char name[CACHE_NAME_LEN];
+
+	auto begin = std::chrono::steady_clock::now();
+
+	for (const replay_op_t& op : tp->ops) {
+		void* objp;
+
+		switch (op.op) {
+		case TRACE_CACHE_CREATE:
+			/* caches made before start can be written twice */
+			if (caches[op.cache] != nullptr) break;
+			snprintf(name, CACHE_NAME_LEN, "replay %u", (unsigned)op.cache);
+			caches[op.cache] = kmem_cache_create(name, op.size, nullptr, nullptr);
+			break;
+		case TRACE_CACHE_DESTROY:
+			kmem_cache_destroy(caches[op.cache]);
+			caches[op.cache] = nullptr;
+			break;
+		case TRACE_CACHE_ALLOC:
+			objp = kmem_cache_alloc(caches[op.cache]);
+			if (objp == nullptr) res.failed++;
+			objs[op.slot] = objp;
+			sizes[op.slot] = op.size;
+			break;
+		case TRACE_KMALLOC:
+			objp = kmalloc(replay_size(op.size, classes));
+			if (objp == nullptr) res.failed++;
+			objs[op.slot] = objp;
+			sizes[op.slot] = op.size;
+			break;
+		case TRACE_BMALLOC:
+			objp = bmalloc(op.size);
+			if (objp == nullptr) res.failed++;
+			objs[op.slot] = objp;
+			sizes[op.slot] = op.size;
+			break;
+		case TRACE_CACHE_FREE:
+			kmem_cache_free(caches[op.cache], objs[op.slot]);
+			objs[op.slot] = nullptr;
+			break;
+		case TRACE_KFREE:
+			kfree(objs[op.slot]);
+			objs[op.slot] = nullptr;
+			break;
+		case TRACE_BFREE:
+			bfree(objs[op.slot]);
+			objs[op.slot] = nullptr;
+			break;
+		case TRACE_KREALLOC:
+			objp = krealloc(objs[op.slot], replay_size(op.size, classes));
+			if (objp != nullptr) objs[op.slot] = objp;
+			else res.failed++;
+			break;
+		}
+
+		if (sample) {
+			if (op.op == TRACE_CACHE_ALLOC || op.op == TRACE_KMALLOC || op.op == TRACE_BMALLOC) live += sizes[op.slot];
+			else if (op.op == TRACE_KREALLOC) {
+				live += op.size - sizes[op.slot];
+				sizes[op.slot] = op.size;
+			}
+			else if (op.op == TRACE_CACHE_FREE || op.op == TRACE_KFREE || op.op == TRACE_BFREE) live -= sizes[op.slot];
+
+			size_t used = replay_used_blocks();
+			if (used > res.peak_blocks) {
+				res.peak_blocks = used;
+				res.peak_live = live;
+			}
+		}
+	}
+
+	auto end = std::chrono::steady_clock::now();
+	res.sec = std::chrono::duration<double>(end - begin).count();
+	res.end_blocks = replay_used_blocks();
+	res.end_live = live;
+
+	/* objects still live at the end of trace, kind is found by op that allocated them */
+	for (const replay_op_t& op : tp->ops) {
+		if (op.slot == REPLAY_NONE || objs[op.slot] == nullptr) continue;
+		if (op.op == TRACE_CACHE_ALLOC) kmem_cache_free(caches[op.cache], objs[op.slot]);
+		else if (op.op == TRACE_KMALLOC) kfree(objs[op.slot]);
+		else if (op.op == TRACE_BMALLOC) bfree(objs[op.slot]);
+		else continue;
+		objs[op.slot] = nullptr;
+	}
+	for (kmem_cache_t* cachep : caches) kmem_cache_destroy(cachep);
+
+	/* next run starts from empty arena */
+	kmem_reap();
+	kmem_reap();
+	buddy_coalesce();
+
+	return res;
+}
+
+void replay_print(const char* classes, const replay_trace_t* tp, const replay_result_t* timed, const replay_result_t* sampled) {
+	double peak_frag = sampled->peak_blocks ? 100.0 * (1.0 - (double)sampled->peak_live / ((double)sampled->peak_blocks * BLOCK_SIZE)) : 0;
+
+	printf("%-8s %-14.0f %-12zu %-14.2f %-12zu %-14zu %-8zu\n", classes, tp->ops.size() / timed->sec,
+		sampled->peak_blocks * BLOCK_SIZE >> 10, peak_frag, sampled->end_blocks * BLOCK_SIZE >> 10, sampled->end_live >> 10,
+		timed->failed + sampled->failed);
+}
+
+#ifdef TRACE_REPLAY_MAIN
+
+int main(int argc, char** argv) {
+	kmem_init(nullptr, REPLAY_BLOCK_NUMBER, KMEM_OWN_ARENA);
+
+	/* empty slabs, magazines and cached large blocks are all freed by kmem_reap */
+	kmem_reaper_settings_t settings;
+	kmem_reaper_get(&settings);
+	settings.empty_low = 0;
+	settings.empty_high = 0;
+	settings.age_ms = 0;
+	kmem_reaper_set(&settings);
+
+	const char* path = "kmem.trace";
+	int capture = 1;
+	int replay = 1;
+	if (argc > 2 && strcmp(argv[1], "capture") == 0) {
+		path = argv[2];
+		replay = 0;
+	}
+	else if (argc > 1) {
+		path = argv[1];
+		capture = 0;
+	}
+
+	int failed = 0;
+
+	if (capture) {
+		auto begin = std::chrono::steady_clock::now();
+		size_t records = replay_capture(path);
+		auto end = std::chrono::steady_clock::now();
+
+		printf("captured %zu records to %s in %.3f sec\n", records, path, std::chrono::duration<double>(end - begin).count());
+		if (records == 0) failed = 1;
+
+		kmem_reap();
+		kmem_reap();
+		buddy_coalesce();
+	}
+
+	if (replay) {
+		replay_trace_t trace;
+		if (replay_load(path, &trace) != 0) {
+			printf("can't read trace %s\n", path);
+			return 1;
+		}
+
+		printf("%zu operations of %u threads, %zu failed allocations, %zu unmatched frees\n",
+			trace.ops.size(), trace.threads, trace.failed, trace.unmatched);
+		if (trace.block_size != BLOCK_SIZE) printf("traced with BLOCK_SIZE %u, replayed with %d\n", trace.block_size, BLOCK_SIZE);
+		if (capture && trace.unmatched > 0) failed = 1;
+
+		printf("\n%-8s %-14s %-12s %-14s %-12s %-14s %-8s\n", "classes", "ops/sec", "peak KiB", "peak frag %", "end KiB", "end live KiB", "failed");
+
+		replay_result_t timed = replay_run(&trace, REPLAY_CLASSES_DENSE, 0);
+		replay_result_t sampled = replay_run(&trace, REPLAY_CLASSES_DENSE, 1);
+		replay_print("dense", &trace, &timed, &sampled);
+
+		timed = replay_run(&trace, REPLAY_CLASSES_POW2, 0);
+		sampled = replay_run(&trace, REPLAY_CLASSES_POW2, 1);
+		replay_print("pow2", &trace, &timed, &sampled);
+	}
+
+	printf(failed ? "FAILED\n" : "OK\n");
+	return failed;
+}
+
+#endif
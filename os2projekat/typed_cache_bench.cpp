@@ -0,0 +1,108 @@
+#include <stdio.h>
+#include <string.h>
+#include <chrono>
+#include "Buddy.h"
+#include "slab.h"
+#include "TypedCache.h"
+
+#define TYPED_BLOCK_NUMBER (1 << 15)
+#define TYPED_OPS (2000000)
+#define TYPED_BATCH (256)
+
+//#define TYPED_CACHE_BENCH
+
+typedef struct typed_node_s {
+	struct typed_node_s* next;
+	int key;
+	char payload[180];
+
+	typed_node_s(int key) : next(nullptr), key(key) { payload[0] = 0; }
+} typed_node_t;
+
+typedef struct typed_big_s {
+	char data[3000];
+} typed_big_t;
+
+/* geometry is known to the compiler */
+static_assert(kmem_cache_geometry(sizeof(typed_big_t), alignof(typed_big_t)).off_slab,
+	"objects above OBJECT_TRESHOLD have slab descriptor off slab");
+
+void typed_node_ctor(void* mem) {
+	typed_node_t* np = (typed_node_t*)mem;
+	np->next = nullptr;
+	np->key = 0;
+	np->payload[0] = 0;
+}
+
+/* returns ns per alloc/free pair, objects are freed in batches so slabs are used too */
+template <typename Alloc, typename Free>
+double typed_bench(Alloc alloc, Free free) {
+	typed_node_t* batch[TYPED_BATCH];
+
+	auto begin = std::chrono::steady_clock::now();
+	for (int i = 0; i < TYPED_OPS / TYPED_BATCH; i++) {
+		for (int j = 0; j < TYPED_BATCH; j++) batch[j] = alloc(i + j);
+		for (int j = 0; j < TYPED_BATCH; j++) free(batch[j]);
+	}
+	auto end = std::chrono::steady_clock::now();
+
+	return std::chrono::duration<double, std::nano>(end - begin).count() / TYPED_OPS;
+}
+
+/* compile-time geometry must match the one kmem_cache_create computed */
+template <typename T>
+int typed_check(const char* name) {
+	constexpr kmem_geometry_t geometry = kmem_cache_geometry(sizeof(T), alignof(T));
+
+	kmem::TypedCache<T> cache(name);
+	kmem_cache_stats_t stats;
+	kmem_cache_stats(cache.cache(), &stats);
+
+	return stats.objs_per_slab == geometry.num && stats.blocks_per_slab == (1u << geometry.pow);
+}
+
+#ifdef TYPED_CACHE_BENCH
+
+int main() {
+	void *space = malloc(BLOCK_SIZE * (size_t)TYPED_BLOCK_NUMBER);
+	kmem_init(space, TYPED_BLOCK_NUMBER);
+
+	int failed = 0;
+	if (!typed_check<typed_node_t>("typed node check") || !typed_check<typed_big_t>("typed big check")) failed = 1;
+
+	constexpr kmem_geometry_t geometry = kmem_cache_geometry(sizeof(typed_node_t), alignof(typed_node_t));
+	printf("typed_node_t: %zu B, %u objects per slab of 2^%u blocks, %u colours, %s slab descriptor\n",
+		sizeof(typed_node_t), geometry.num, geometry.pow, geometry.colour_num, geometry.off_slab ? "off" : "on");
+
+	printf("%-34s %-10s\n", "", "ns/pair");
+
+	/* magazines off, every free goes to slab_free */
+	for (unsigned mag : { 0u, (unsigned)KMEM_DEFAULT_MAG_SIZE }) {
+		kmem_cache_t* cachep = kmem_cache_create(mag ? "typed generic mag" : "typed generic", sizeof(typed_node_t),
+			typed_node_ctor, nullptr, mag);
+		double generic = typed_bench(
+			[&](int key) { typed_node_t* np = (typed_node_t*)kmem_cache_alloc(cachep); np->key = key; return np; },
+			[&](typed_node_t* np) { kmem_cache_free(cachep, np); });
+		kmem_cache_destroy(cachep);
+
+		double typed;
+		if (mag == 0) {
+			kmem::TypedCache<typed_node_t, kmem::CacheOptions<0>> cache("typed node");
+			typed = typed_bench([&](int key) { return cache.create(key); }, [&](typed_node_t* np) { cache.destroy(np); });
+		}
+		else {
+			kmem::TypedCache<typed_node_t> cache("typed node mag");
+			typed = typed_bench([&](int key) { return cache.create(key); }, [&](typed_node_t* np) { cache.destroy(np); });
+		}
+
+		printf("%-34s %-10.1f\n", mag ? "kmem_cache + ctor, magazines" : "kmem_cache + ctor, no magazines", generic);
+		printf("%-34s %-10.1f\n", mag ? "TypedCache, magazines" : "TypedCache, no magazines", typed);
+	}
+
+	/* space is not freed, magazines of this thread are released on exit */
+
+	printf(failed ? "FAILED\n" : "OK\n");
+	return failed;
+}
+
+#endif